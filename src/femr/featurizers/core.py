@@ -14,7 +14,9 @@ import numpy as np
 import scipy.sparse
 
 import femr.index
+import femr.memory
 import femr.ontology
+import femr.tracing
 
 
 class ColumnValue(NamedTuple):
@@ -121,6 +123,7 @@ def _features_map_func(
     assert (
         np_data.shape == np_indices.shape
     ), f"`data` should have equal shape as `indices`, but instead have {np_data.shape} != {np_indices.shape}"
+    femr.memory.record("csr buffers", np_data.nbytes + np_indices.nbytes + np_indptr.nbytes)
     data_matrix = scipy.sparse.csr_matrix((np_data, np_indices, np_indptr), shape=(total_rows, total_columns))
 
     np_patient_ids: np.ndarray = np.array(patient_ids, dtype=np.int64)
@@ -237,6 +240,7 @@ class FeaturizerList:
         """
         self.featurizers: List[Featurizer] = featurizers
 
+    @femr.tracing.traced("FeaturizerList.preprocess_featurizers")
     def preprocess_featurizers(
         self,
         dataset: datasets.Dataset,
@@ -260,6 +264,9 @@ class FeaturizerList:
         patient_ids: List[int] = sorted(list({label["patient_id"] for label in labels}))
 
         dataset = index.filter_dataset(dataset, patient_ids)
+        femr.tracing.count("patients", len(patient_ids))
+        femr.tracing.count("labels", len(labels))
+        femr.memory.record_size("label_map", label_map)
 
         # Preprocess in parallel
         featurize_stats = femr.hf_utils.aggregate_over_dataset(
@@ -268,6 +275,7 @@ class FeaturizerList:
             _preprocess_agg_func,
             batch_size=batch_size,
             num_proc=num_proc,
+            stage="FeaturizerList.preprocess_featurizers",
         )
 
         # Aggregate featurizers
@@ -275,6 +283,7 @@ class FeaturizerList:
             # Merge all featurizers of the same class as `featurizer`
             featurizer.encorperate_prepreprocessed_data(featurizer_stat)
 
+    @femr.tracing.traced("FeaturizerList.featurize")
     def featurize(
         self,
         dataset: datasets.Dataset,
@@ -304,6 +313,9 @@ class FeaturizerList:
         patient_ids: List[int] = sorted(list({label["patient_id"] for label in labels}))
 
         dataset = index.filter_dataset(dataset, patient_ids)
+        femr.tracing.count("patients", len(patient_ids))
+        femr.tracing.count("labels", len(labels))
+        femr.memory.record_size("label_map", label_map)
 
         features = femr.hf_utils.aggregate_over_dataset(
             dataset,
@@ -311,11 +323,13 @@ class FeaturizerList:
             _features_agg_func,
             batch_size=batch_size,
             num_proc=num_proc,
+            stage="FeaturizerList.featurize",
         )
 
         result = {k: np.concatenate(features[k]) for k in ("patient_ids", "feature_times")}
 
         result["features"] = scipy.sparse.vstack(features["features"])
+        femr.memory.record_size("features", result)
 
         return result
 
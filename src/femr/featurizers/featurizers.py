@@ -11,6 +11,7 @@ import meds
 import numpy as np
 
 import femr.ontology
+import femr.shared
 
 from .core import ColumnValue, Featurizer
 from .utils import OnlineStatistics
@@ -165,7 +166,7 @@ def exclusion_helper(
     return False
 
 
-class CountFeaturizer(Featurizer):
+class CountFeaturizer(Featurizer, femr.shared.Shareable):
     """
     Produces one column per each diagnosis code, procedure code, and prescription code.
     The value in each column is the count of how many times that code appears in the patient record
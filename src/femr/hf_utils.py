@@ -1,13 +1,149 @@
+import concurrent.futures
+import contextlib
 import functools
+import itertools
+import os
 import pickle
+import threading
+import warnings
 
+import pyarrow.compute as pc
 
-def _agg_helper(*args, map_func):
-    result = map_func(*args)
-    return {"data": [pickle.dumps(result)]}
+import femr.memory
+import femr.shared
+import femr.tracing
 
+# The backend of aggregate_over_dataset when none is given, "process" or "thread"
+_default_backend = os.environ.get("FEMR_BACKEND", "process")
 
-def aggregate_over_dataset(dataset, map_func, agg_func, batch_size, num_proc, with_indices=False):
+# RSS that this process freed after going over a memory budget, but which the allocator may still hold on to
+_retained_rss = 0
+# How much the RSS grew per row while mapping the last batch of this process, which predicts the next batch
+_rss_growth_per_row = 0.0
+_rss_lock = threading.Lock()
+
+
+def _map_within_budget(map_func, args, name, memory, min_batch_size):
+    """Map a batch, splitting it in halves while the process goes over the memory budget of its stage.
+
+    This returns the results of all parts, in order. Only the batch that went over is redone, as smaller batches.
+    The RSS can only be checked once the map function returns, so batches that the growth of the previous batch
+    predicts to go over the budget are split before they are mapped.
+    """
+    global _retained_rss, _rss_growth_per_row
+    batch = args[0]
+    num_rows = len(next(iter(batch.values()))) if batch else 0
+    can_split = num_rows // 2 >= max(min_batch_size, 1)
+
+    before = femr.memory.sample_rss() if memory is not None else 0
+    with _rss_lock:
+        retained = _retained_rss
+        expected_growth = _rss_growth_per_row * num_rows
+
+    if memory is not None and memory[1] is not None and can_split and before - retained + expected_growth > memory[1]:
+        warning = f"Stage {memory[0]} is expected to go over its memory budget"
+    else:
+        try:
+            result = map_func(*args)
+            if memory is not None:
+                stage, budget = memory
+                femr.memory.record_size("partial " + name, result)
+                femr.memory.check(
+                    stage,
+                    budget,
+                    can_shrink=True,
+                    context=f"after map {name} of {num_rows} rows",
+                    retained=retained,
+                )
+                with _rss_lock:
+                    _rss_growth_per_row = max(femr.memory.get_rss() - before, 0) / max(num_rows, 1)
+            return [result]
+        except femr.memory.MemoryBudgetExceeded as e:
+            if not e.can_shrink or not can_split:
+                raise
+        # Drop the oversized result before measuring how much memory was freed
+        result = None
+
+        if memory is not None:
+            # Freed memory can stay resident in the allocator, where the smaller batches can reuse it
+            released = femr.memory.release()
+            with _rss_lock:
+                _retained_rss = max(_retained_rss, released - before)
+
+        stage = memory[0] if memory is not None else name
+        warning = f"Stage {stage} went over its memory budget"
+
+    half = num_rows // 2
+    warnings.warn(f"{warning}, retrying with a batch size of {half}")
+
+    results = []
+    for start, end in ((0, half), (half, num_rows)):
+        # The arguments are the batch and, with with_indices, the indices of its rows
+        part = ({k: v[start:end] for k, v in batch.items()},) + tuple(arg[start:end] for arg in args[1:])
+        results.extend(_map_within_budget(map_func, part, name, memory, min_batch_size))
+    return results
+
+
+def _agg_helper(*args, map_func, name, min_batch_size):
+    results = _map_within_budget(map_func, args, name, None, min_batch_size)
+    return {"data": [pickle.dumps(result) for result in results]}
+
+
+def _traced_agg_helper(table, *args, map_func, name, parent_pid, is_traced, memory, min_batch_size):
+    is_worker = os.getpid() != parent_pid
+
+    with contextlib.ExitStack() as stack:
+        # Workers record into their own tracer and accounting and send them back,
+        # the parent process records directly
+        tracer = stack.enter_context(femr.tracing.capture()) if is_traced and is_worker else None
+        accounting = stack.enter_context(femr.memory.capture()) if memory is not None and is_worker else None
+
+        # The batch arrives in the arrow format, so that decoding it into python objects is traced here
+        with femr.tracing.span("decode " + name) as span:
+            if is_traced and "patient_id" in table.column_names:
+                span.count("patients", len(table))
+            if is_traced and "events" in table.column_names:
+                measurements = pc.struct_field(pc.list_flatten(table.column("events")), "measurements")
+                span.count("measurements", pc.sum(pc.list_value_length(measurements)).as_py() or 0)
+            batch = table.to_pydict()
+
+        with femr.tracing.span("map " + name):
+            results = _map_within_budget(map_func, (batch,) + args, name, memory, min_batch_size)
+
+        data = []
+        with femr.tracing.span("pickle " + name) as span:
+            for result in results:
+                data.append(pickle.dumps(result))
+                span.count("bytes", len(data[-1]))
+                femr.memory.record("pickled partial " + name, len(data[-1]))
+
+    events = tracer.events if tracer is not None else []
+    records = accounting.records if accounting is not None else []
+    # A batch that was split returns several rows, where the first one carries the trace and memory records
+    empty = pickle.dumps([])
+    return {
+        "data": data,
+        "trace": [pickle.dumps(events)] + [empty] * (len(data) - 1),
+        "memory": [pickle.dumps(records)] + [empty] * (len(data) - 1),
+    }
+
+
+def set_default_backend(backend: str) -> None:
+    """Set the backend of aggregate_over_dataset, which can also be set with the FEMR_BACKEND environment variable.
+
+    "process" uses datasets.map(num_proc=...), with num_proc worker processes.
+    "thread" uses num_proc threads in this process, which avoids starting processes and pickling arguments and
+    results, but only scales with map functions that spend most of their time outside of the GIL,
+    such as the numpy and pyarrow kernels of femr.transforms.columnar.
+    """
+    global _default_backend
+    assert backend in ("process", "thread"), f"Unknown backend {backend}"
+    _default_backend = backend
+
+
+def aggregate_over_dataset(
+    dataset, map_func, agg_func, batch_size, num_proc, with_indices=False, stage=None, min_batch_size=1, backend=None
+):
     """Perform an aggregation over a huggingface dataset.
 
     This logic consists of two parts, map_func and agg_func.
@@ -15,24 +151,207 @@ def aggregate_over_dataset(dataset, map_func, agg_func, batch_size, num_proc, wi
     map_func takes a batch of data and converts it to an intermediate result.
 
     agg_func takes those intermediate results and combines them into a final result.
+
+    backend is "process" or "thread", see set_default_backend. Both fold the intermediate results in dataset order,
+    so they give the same result.
+
+    When femr.tracing is enabled, every call is traced in the decode, map, pickle, unpickle and fold phases.
+
+    When femr.memory is enabled, the RSS of every process and the size of every intermediate result are recorded.
+    If the process is already over the memory budget of the stage (which defaults to the name of map_func) when the
+    aggregation starts, femr.memory.MemoryBudgetExceeded is raised right away.
+    If a process goes over the budget while mapping a batch, that batch is mapped again as two halves, down to
+    min_batch_size, after which femr.memory.MemoryBudgetExceeded is raised. Other batches are unaffected.
+    Budgets bound the RSS of whole processes, so they can't be used with more than one thread of the thread backend.
     """
-    parts = dataset.map(
-        functools.partial(_agg_helper, map_func=map_func),
-        batched=True,
-        batch_size=batch_size,
-        remove_columns=dataset.column_names,
-        num_proc=num_proc,
-        with_indices=with_indices,
-        keep_in_memory=True,
-        new_fingerprint="invalid",
-    )
-
-    current = None
-    for stat in parts:
-        fixed_stat = pickle.loads(stat["data"])
-        if current is None:
-            current = fixed_stat
-        else:
-            current = agg_func(current, fixed_stat)
+    global _retained_rss, _rss_growth_per_row
+    name = getattr(map_func, "func", map_func).__name__
+    stage = stage or name
+    backend = backend or _default_backend
+    assert backend in ("process", "thread"), f"Unknown backend {backend}"
+
+    if backend == "thread" and num_proc > 1 and femr.memory.get_budget(stage) is not None:
+        # get_rss() measures the whole process, so every thread would be charged for the batches of all threads
+        raise ValueError(
+            f"Stage {stage} has a memory budget, which bounds the RSS of every process. "
+            + "It can't be used with more than one thread of the thread backend"
+        )
+
+    is_accounted = femr.memory.is_enabled() or femr.memory.get_budget(stage) is not None
+    if is_accounted:
+        with _rss_lock:
+            _retained_rss = 0
+            _rss_growth_per_row = 0.0
+        # Nothing a smaller batch can fix
+        femr.memory.check(stage, context=f"before aggregate {name}")
+
+    aggregate = _aggregate_over_dataset if backend == "process" else _aggregate_with_threads
+    return aggregate(dataset, map_func, agg_func, batch_size, num_proc, with_indices, name, stage, min_batch_size)
+
+
+def _aggregate_over_dataset(
+    dataset, map_func, agg_func, batch_size, num_proc, with_indices, name, stage, min_batch_size
+):
+    is_traced = femr.tracing.is_enabled()
+    is_accounted = femr.memory.is_enabled() or femr.memory.get_budget(stage) is not None
+
+    if not is_traced and not is_accounted:
+        helper = functools.partial(_agg_helper, map_func=map_func, name=name, min_batch_size=min_batch_size)
+        mapped = dataset
+    else:
+        helper = functools.partial(
+            _traced_agg_helper,
+            map_func=map_func,
+            name=name,
+            parent_pid=os.getpid(),
+            is_traced=is_traced,
+            # The budget is passed along as workers don't necessarily share the configuration of this process
+            memory=(stage, femr.memory.get_budget(stage)) if is_accounted else None,
+            min_batch_size=min_batch_size,
+        )
+        # The helper decodes the batches itself, which times the decoding
+        mapped = dataset.with_format("arrow")
+
+    # Workers attach to large read-only arguments, such as an Ontology, instead of each unpickling a copy
+    sharing = femr.shared.sharing(map_func) if num_proc > 1 else contextlib.nullcontext()
+
+    with femr.tracing.span(f"aggregate {name}"), sharing:
+        parts = mapped.map(
+            helper,
+            batched=True,
+            batch_size=batch_size,
+            remove_columns=dataset.column_names,
+            num_proc=num_proc,
+            with_indices=with_indices,
+            keep_in_memory=True,
+            new_fingerprint="invalid",
+        ).with_format(None)
+
+        current = None
+        for stat in parts:
+            with femr.tracing.span(f"unpickle {name}") as span:
+                fixed_stat = pickle.loads(stat["data"])
+                span.count("bytes", len(stat["data"]))
+                if is_traced:
+                    femr.tracing.add_events(pickle.loads(stat["trace"]))
+                if is_accounted:
+                    femr.memory.add_records(pickle.loads(stat["memory"]))
+
+            with femr.tracing.span(f"fold {name}"):
+                if current is None:
+                    current = fixed_stat
+                else:
+                    current = agg_func(current, fixed_stat)
+
+            if is_accounted:
+                femr.memory.check(stage, context=f"fold {name}", retained=_retained_rss)
+
+        femr.memory.record_size("aggregate " + name, current)
 
     return current
+
+
+class _OrderedFold:
+    """Folds results that arrive in any order in the order of their index, holding on to those that are early.
+
+    One thread at a time folds, outside of the lock, so other threads only wait for the lock to hand in a result.
+    A thread takes one of max_pending slots before it maps a batch, which is freed once the batch is folded.
+    This bounds how many results wait for a slow batch to be folded.
+    """
+
+    def __init__(self, agg_func, name, max_pending):
+        self.agg_func = agg_func
+        self.name = name
+        self.lock = threading.Lock()
+        self.slots = threading.Semaphore(max_pending)
+        self.pending = {}
+        self.next_index = 0
+        self.is_folding = False
+        self.current = None
+
+    def add(self, index, results):
+        """Add the results of a batch, which has more than one when the batch was split."""
+        with self.lock:
+            self.pending[index] = results
+            if self.is_folding:
+                # The folding thread picks these up once it gets to them
+                return
+            self.is_folding = True
+
+        while True:
+            with self.lock:
+                if self.next_index not in self.pending:
+                    self.is_folding = False
+                    return
+                index = self.next_index
+                results = self.pending.pop(index)
+
+            with femr.tracing.span(f"fold {self.name}"):
+                for i, result in enumerate(results):
+                    if index == 0 and i == 0:
+                        self.current = result
+                    else:
+                        self.current = self.agg_func(self.current, result)
+
+            with self.lock:
+                self.next_index += 1
+            self.slots.release()
+
+
+def _aggregate_with_threads(
+    dataset, map_func, agg_func, batch_size, num_threads, with_indices, name, stage, min_batch_size
+):
+    """Run the aggregation in a pool of threads, which take the next batch whenever they are done with one.
+
+    Nothing is pickled, and large arguments such as an Ontology are shared as is.
+    """
+    is_accounted = femr.memory.is_enabled() or femr.memory.get_budget(stage) is not None
+    memory = (stage, femr.memory.get_budget(stage)) if is_accounted else None
+
+    num_batches = (len(dataset) + batch_size - 1) // batch_size
+    # next() on itertools.count is atomic, which hands out every batch exactly once
+    batch_indices = itertools.count()
+    # Threads can run ahead of a slow batch by a couple of batches each
+    fold = _OrderedFold(agg_func, name, max_pending=2 * num_threads)
+    is_stopped = threading.Event()
+
+    def work():
+        try:
+            map_batches()
+        except BaseException:
+            # Wake up the threads that wait for a slot, which the failed batch will never free
+            is_stopped.set()
+            for _ in range(num_threads):
+                fold.slots.release()
+            raise
+
+    def map_batches():
+        while True:
+            fold.slots.acquire()
+            batch_index = next(batch_indices)
+            if batch_index >= num_batches or is_stopped.is_set():
+                return
+            start = batch_index * batch_size
+            end = min(start + batch_size, len(dataset))
+
+            with femr.tracing.span("decode " + name):
+                batch = dataset[start:end]
+            with femr.tracing.span("map " + name) as span:
+                span.count("patients", end - start)
+                args = (batch, list(range(start, end))) if with_indices else (batch,)
+                results = _map_within_budget(map_func, args, name, memory, min_batch_size)
+
+            fold.add(batch_index, results)
+
+    with femr.tracing.span(f"aggregate {name}"):
+        with concurrent.futures.ThreadPoolExecutor(max_workers=num_threads) as executor:
+            futures = [executor.submit(work) for _ in range(max(1, min(num_threads, num_batches)))]
+            try:
+                for future in futures:
+                    future.result()
+            finally:
+                is_stopped.set()
+
+        femr.memory.record_size("aggregate " + name, fold.current)
+
+    return fold.current
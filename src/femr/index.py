@@ -1,8 +1,38 @@
 from __future__ import annotations
 
+import json
+import os
+from typing import Any, Dict, Iterable, List, Optional, Tuple
+
 import datasets
+import numpy as np
+import pyarrow.parquet as pq
 
 import femr.hf_utils
+import femr.tracing
+
+SHARD_MANIFEST_NAME = "shards.json"
+
+
+def write_shard_manifest(path: str, shards: List[Dict[str, Any]]) -> None:
+    """Write the manifest of a sharded dataset, listing the number of patients and patient id range of every shard.
+
+    Arguments:
+        path: The dataset folder, which contains the shards in a data subfolder
+        shards: One dictionary per shard, in order, with file, num_patients, min_patient_id and max_patient_id
+    """
+    offset = 0
+    for shard in shards:
+        shard["offset"] = offset
+        offset += shard["num_patients"]
+
+    with open(os.path.join(path, SHARD_MANIFEST_NAME), "w") as f:
+        json.dump({"num_patients": offset, "shards": shards}, f)
+
+
+def read_shard_manifest(path: str) -> Dict[str, Any]:
+    with open(os.path.join(path, SHARD_MANIFEST_NAME)) as f:
+        return json.load(f)
 
 
 def map_index(batch, indices):
@@ -15,12 +45,21 @@ def agg_index(index1, index2):
 
 
 class PatientIndex:
+    @femr.tracing.traced("PatientIndex")
     def __init__(self, dataset: datasets.Dataset, num_proc: int = 1):
         data = femr.hf_utils.aggregate_over_dataset(
-            dataset, map_index, agg_index, num_proc=num_proc, batch_size=1_000, with_indices=True
+            dataset, map_index, agg_index, num_proc=num_proc, batch_size=1_000, with_indices=True, stage="PatientIndex"
         )
         self.index_map = dict(data)
 
+    @classmethod
+    def from_sharded_dataset(cls, path: str) -> PatientIndex:
+        """Create an index for a dataset with a shard manifest, such as the output of femr_stanford_omop_fixer.
+
+        Indices match datasets.Dataset.from_parquet over the shards in manifest order. See ShardedPatientIndex.
+        """
+        return ShardedPatientIndex(path)
+
     def get_patient_ids(self):
         return self.index_map.keys()
 
@@ -29,3 +68,78 @@ class PatientIndex:
 
     def filter_dataset(self, dataset, patient_ids):
         return dataset.select([self.get_index(patient_id) for patient_id in patient_ids])
+
+
+class ShardedPatientIndex(PatientIndex):
+    """An index of a dataset with a shard manifest, which reads the patient ids of a shard when they are first needed.
+
+    The patient id range of every shard in the manifest selects the shards that can contain a patient. The ids of a
+    shard are kept as a sorted numpy array, which is searched with np.searchsorted, and the offset of the shard in the
+    manifest turns a row of the shard into an index of the dataset.
+    """
+
+    def __init__(self, path: str):
+        self.path = path
+        self.shards = [shard for shard in read_shard_manifest(path)["shards"] if shard["num_patients"] > 0]
+        self.min_patient_ids = np.array([shard["min_patient_id"] for shard in self.shards], dtype=np.int64)
+        self.max_patient_ids = np.array([shard["max_patient_id"] for shard in self.shards], dtype=np.int64)
+        # The sorted patient ids of every loaded shard, with the row of each id when the shard isn't sorted already
+        self.shard_patient_ids: Dict[int, Tuple[np.ndarray, Optional[np.ndarray]]] = {}
+
+    def _get_shard_patient_ids(self, shard_index: int) -> Tuple[np.ndarray, Optional[np.ndarray]]:
+        if shard_index not in self.shard_patient_ids:
+            file = os.path.join(self.path, "data", self.shards[shard_index]["file"])
+            patient_ids = pq.read_table(file, columns=["patient_id"]).column("patient_id").to_numpy()
+            if np.all(patient_ids[1:] > patient_ids[:-1]):
+                self.shard_patient_ids[shard_index] = (patient_ids, None)
+            else:
+                order = np.argsort(patient_ids, kind="stable")
+                self.shard_patient_ids[shard_index] = (patient_ids[order], order)
+        return self.shard_patient_ids[shard_index]
+
+    def get_patient_ids(self):
+        patient_ids = []
+        for shard_index in range(len(self.shards)):
+            sorted_ids, order = self._get_shard_patient_ids(shard_index)
+            if order is None:
+                patient_ids.append(sorted_ids)
+            else:
+                shard_ids = np.empty_like(sorted_ids)
+                shard_ids[order] = sorted_ids
+                patient_ids.append(shard_ids)
+        return np.concatenate([np.zeros(0, dtype=np.int64)] + patient_ids).tolist()
+
+    def get_indices(self, patient_ids: Iterable[int]) -> np.ndarray:
+        """Get the index of every patient id, raising a KeyError for ids that are not in the dataset."""
+        patient_ids = np.asarray(list(patient_ids), dtype=np.int64)
+        indices = np.full(len(patient_ids), -1, dtype=np.int64)
+
+        for shard_index in np.flatnonzero(
+            (self.min_patient_ids <= patient_ids.max(initial=np.iinfo(np.int64).min))
+            & (self.max_patient_ids >= patient_ids.min(initial=np.iinfo(np.int64).max))
+        ):
+            is_candidate = (
+                (indices == -1)
+                & (patient_ids >= self.min_patient_ids[shard_index])
+                & (patient_ids <= self.max_patient_ids[shard_index])
+            )
+            if not np.any(is_candidate):
+                continue
+
+            sorted_ids, order = self._get_shard_patient_ids(shard_index)
+            candidates = np.flatnonzero(is_candidate)
+            positions = np.minimum(np.searchsorted(sorted_ids, patient_ids[candidates]), len(sorted_ids) - 1)
+            is_found = sorted_ids[positions] == patient_ids[candidates]
+
+            rows = positions[is_found] if order is None else order[positions[is_found]]
+            indices[candidates[is_found]] = self.shards[shard_index]["offset"] + rows
+
+        if np.any(indices == -1):
+            raise KeyError(int(patient_ids[np.flatnonzero(indices == -1)[0]]))
+        return indices
+
+    def get_index(self, patient_id):
+        return int(self.get_indices([patient_id])[0])
+
+    def filter_dataset(self, dataset, patient_ids):
+        return dataset.select(self.get_indices(patient_ids))
@@ -15,6 +15,7 @@ import datasets
 import meds
 
 import femr.hf_utils
+import femr.tracing
 
 
 @dataclass(frozen=True)
@@ -66,6 +67,7 @@ class Labeler(ABC):
         """
         pass
 
+    @femr.tracing.traced("Labeler.apply")
     def apply(
         self,
         dataset: datasets.Dataset,
@@ -82,13 +84,17 @@ class Labeler(ABC):
             A list of labels
         """
 
-        return femr.hf_utils.aggregate_over_dataset(
+        labels = femr.hf_utils.aggregate_over_dataset(
             dataset,
             functools.partial(_label_map_func, labeler=self),
             _label_agg_func,
             batch_size=batch_size,
             num_proc=num_proc,
+            stage="Labeler.apply",
         )
+        femr.tracing.count("patients", len(dataset))
+        femr.tracing.count("labels", len(labels or []))
+        return labels
 
 
 ##########################################################
@@ -0,0 +1,209 @@
+"""Patient access directly over the Arrow arrays of MEDS parquet files, without creating Python objects per event.
+
+datasets decodes the nested events -> measurements structure of MEDS into Python dictionaries for every batch.
+MEDSReader instead reads one row group at a time and walks the list offsets of Arrow.
+Per row group, it exposes the event times, codes and numeric values as flat numpy arrays, and every patient as a
+PatientSpan of views into them.
+
+Only patient_id, time, code and numeric_value (and optionally text_value) are read, so the metadata of the
+measurements is never decoded.
+
+Example:
+    reader = femr.meds_reader.MEDSReader(path_to_meds, vocabulary=tokenizer_codes)
+    for row_group in reader.iter_row_groups():
+        counts += np.bincount(row_group.code_ids[row_group.code_ids >= 0], minlength=len(tokenizer_codes))
+        for patient in row_group:
+            birth_time = patient.times[0]
+"""
+
+from __future__ import annotations
+
+import glob
+import os
+from typing import Iterator, List, Optional, Sequence, Union
+
+import numpy as np
+import pyarrow as pa
+import pyarrow.compute as pc
+import pyarrow.parquet as pq
+
+
+class PatientSpan:
+    """The events and measurements of a single patient, as views into the arrays of its RowGroup.
+
+    Event j of the patient has time times[j] and measurements measurement_offsets[j] to measurement_offsets[j + 1]
+    of the row group, so measurement k of the patient is at index measurement_offsets[0] + k of codes, code_ids,
+    numeric_values and text_values.
+    """
+
+    __slots__ = ("row_group", "patient_id", "times", "measurement_offsets", "start", "end")
+
+    def __init__(self, row_group: RowGroup, index: int):
+        event_start, event_end = row_group.event_offsets[index], row_group.event_offsets[index + 1]
+
+        self.row_group = row_group
+        self.patient_id = int(row_group.patient_ids[index])
+        self.times = row_group.times[event_start:event_end]
+        self.measurement_offsets = row_group.measurement_offsets[event_start : event_end + 1]
+        self.start = int(row_group.measurement_offsets[event_start])
+        self.end = int(row_group.measurement_offsets[event_end])
+
+    @property
+    def num_events(self) -> int:
+        return len(self.times)
+
+    @property
+    def num_measurements(self) -> int:
+        return self.end - self.start
+
+    @property
+    def measurement_times(self) -> np.ndarray:
+        """The time of every measurement, which unlike the other properties is a copy."""
+        return np.repeat(self.times, np.diff(self.measurement_offsets))
+
+    @property
+    def code_ids(self) -> np.ndarray:
+        assert self.row_group.code_ids is not None, "MEDSReader needs a vocabulary for code ids"
+        return self.row_group.code_ids[self.start : self.end]
+
+    @property
+    def codes(self) -> pa.Array:
+        return self.row_group.codes.slice(self.start, self.end - self.start)
+
+    @property
+    def numeric_values(self) -> np.ndarray:
+        return self.row_group.numeric_values[self.start : self.end]
+
+    @property
+    def text_values(self) -> pa.Array:
+        assert self.row_group.text_values is not None, "MEDSReader needs with_text_values for text values"
+        return self.row_group.text_values.slice(self.start, self.end - self.start)
+
+
+def _get_list_offsets(array: Union[pa.ListArray, pa.LargeListArray]) -> np.ndarray:
+    # The offsets index into array.values, which are not sliced, so they stay valid for sliced arrays
+    return array.offsets.to_numpy()
+
+
+class RowGroup:
+    """The patients of a row group of a MEDS parquet file, flattened through the list offsets of Arrow.
+
+    Attributes:
+        patient_ids: The id of every patient
+        event_offsets: The events of patient i are event_offsets[i] to event_offsets[i + 1]
+        times: The time of every event, as datetime64[us]
+        measurement_offsets: The measurements of event j are measurement_offsets[j] to measurement_offsets[j + 1]
+        codes: The code of every measurement, as an Arrow string array
+        code_ids: The index of every code in the vocabulary of the reader, or -1 if it is not in the vocabulary
+        numeric_values: The numeric value of every measurement as float32, or NaN if there is none
+        text_values: The text value of every measurement, as an Arrow string array
+    """
+
+    def __init__(self, table: pa.Table, vocabulary: Optional[pa.Array] = None, with_text_values: bool = False):
+        events = table.column("events").combine_chunks()
+        event_values = events.values
+        measurements = event_values.field("measurements")
+        measurement_values = measurements.values
+
+        self.patient_ids: np.ndarray = table.column("patient_id").combine_chunks().to_numpy()
+        self.event_offsets: np.ndarray = _get_list_offsets(events)
+        self.times: np.ndarray = event_values.field("time").to_numpy(zero_copy_only=False)
+        self.measurement_offsets: np.ndarray = _get_list_offsets(measurements)
+
+        self.codes: pa.Array = measurement_values.field("code")
+
+        self.code_ids: Optional[np.ndarray] = None
+        if vocabulary is not None:
+            code_ids = pc.index_in(self.codes, value_set=vocabulary.cast(self.codes.type))
+            self.code_ids = pc.fill_null(code_ids, -1).to_numpy()
+
+        if measurement_values.type.get_field_index("numeric_value") == -1:
+            self.numeric_values: np.ndarray = np.full(len(measurement_values), np.nan, dtype=np.float32)
+        else:
+            numeric_values = measurement_values.field("numeric_value")
+            if numeric_values.type != pa.float32():
+                numeric_values = numeric_values.cast(pa.float32())
+            if numeric_values.null_count > 0:
+                numeric_values = pc.fill_null(numeric_values, np.nan)
+            # Zero copy unless the values had to be cast or filled
+            self.numeric_values = numeric_values.to_numpy(zero_copy_only=False)
+
+        self.text_values: Optional[pa.Array] = None
+        if with_text_values:
+            if measurement_values.type.get_field_index("text_value") == -1:
+                self.text_values = pa.nulls(len(measurement_values), pa.string())
+            else:
+                self.text_values = measurement_values.field("text_value")
+
+    def __len__(self) -> int:
+        return len(self.patient_ids)
+
+    def __getitem__(self, index: int) -> PatientSpan:
+        return PatientSpan(self, index)
+
+    def __iter__(self) -> Iterator[PatientSpan]:
+        for i in range(len(self)):
+            yield PatientSpan(self, i)
+
+
+def _get_column_paths(schema: pq.ParquetSchema, with_text_values: bool) -> List[str]:
+    """Get the paths of the leaf columns to read, such as events.list.element.measurements.list.element.code."""
+    measurement_fields = {"code", "numeric_value"} | ({"text_value"} if with_text_values else set())
+
+    paths = []
+    for i in range(len(schema)):
+        path = schema.column(i).path
+        parts = path.split(".")
+        # Every list adds two levels, whose names depend on the writer
+        if parts == ["patient_id"]:
+            paths.append(path)
+        elif len(parts) == 4 and parts[0] == "events" and parts[3] == "time":
+            paths.append(path)
+        elif len(parts) == 7 and parts[0] == "events" and parts[3] == "measurements" and parts[6] in measurement_fields:
+            paths.append(path)
+    return paths
+
+
+class MEDSReader:
+    """Reads MEDS parquet files one row group at a time, see RowGroup and PatientSpan."""
+
+    def __init__(
+        self,
+        path: Union[str, Sequence[str]],
+        vocabulary: Optional[Sequence[str]] = None,
+        with_text_values: bool = False,
+    ):
+        """Create a reader.
+
+        Arguments:
+            path: A MEDS dataset folder, a parquet file or a list of parquet files
+            vocabulary: Codes to compute RowGroup.code_ids with, such as the codes of a tokenizer
+            with_text_values: Whether to also read the text values of the measurements
+        """
+        if isinstance(path, str):
+            if os.path.isdir(path):
+                self.files = sorted(glob.glob(os.path.join(path, "data", "*.parquet")))
+            else:
+                self.files = [path]
+        else:
+            self.files = list(path)
+
+        self.vocabulary = pa.array(vocabulary, type=pa.string()) if vocabulary is not None else None
+        self.with_text_values = with_text_values
+
+        self.num_patients = sum(pq.ParquetFile(file).metadata.num_rows for file in self.files)
+
+    def __len__(self) -> int:
+        return self.num_patients
+
+    def iter_row_groups(self) -> Iterator[RowGroup]:
+        for file in self.files:
+            parquet_file = pq.ParquetFile(file, memory_map=True)
+            columns = _get_column_paths(parquet_file.schema, self.with_text_values)
+            for i in range(parquet_file.num_row_groups):
+                table = parquet_file.read_row_group(i, columns=columns)
+                yield RowGroup(table, self.vocabulary, self.with_text_values)
+
+    def __iter__(self) -> Iterator[PatientSpan]:
+        for row_group in self.iter_row_groups():
+            yield from row_group
@@ -0,0 +1,306 @@
+"""Memory accounting for femr stages, with per worker RSS sampling, structure sizes and per stage memory budgets.
+
+Accounting is off by default. It is turned on with enable(), by setting the FEMR_MEMORY_REPORT environment variable,
+in which case a report is printed to stderr when the program exits, or by configuring a budget.
+
+When on, femr.hf_utils.aggregate_over_dataset samples the resident set size (RSS) of every worker before and after
+each batch, and records the size of every partial aggregate before and after pickling. The stages that build large
+structures record them too, such as "label_map" and the CSR buffers of FeaturizerList.featurize.
+Workers record into their own accounting and send it back with their results, like femr.tracing.
+
+A budget bounds the RSS of every process of a stage. When a process exceeds it after mapping a batch,
+aggregate_over_dataset maps that batch again as two halves. Memory that is freed by dropping the oversized result but
+kept by the allocator is not counted against the budget afterwards, as the smaller batches reuse it.
+The RSS is only checked between batches, so a single batch can still exhaust the memory of the machine before the
+check. To make that less likely, a batch is split before it is mapped when the RSS before it, plus the growth per row
+of the previous batch of the process, would go over the budget.
+As the RSS covers a whole process, budgets can't be used with more than one thread of the thread backend.
+A stage that is already over budget when it starts, or that goes over once a batch cannot shrink any further, fails
+fast with a MemoryBudgetExceeded error that lists what was recorded, instead of being killed by the kernel.
+
+Budgets are set per stage with set_budget, or with the FEMR_MEMORY_BUDGET environment variable, which is either a
+single size for every stage or a list of stage=size pairs, where the stage "default" covers the rest.
+
+Example:
+    FEMR_MEMORY_BUDGET="8G,FeaturizerList.featurize=16G" python featurize.py
+
+    femr.memory.set_budget("train_tokenizer", "4G")
+    tokenizer = femr.models.tokenizer.train_tokenizer(dataset, vocab_size=1000, num_proc=4)
+    print(femr.memory.get_report())
+"""
+
+from __future__ import annotations
+
+import atexit
+import contextlib
+import ctypes
+import ctypes.util
+import gc
+import multiprocessing
+import os
+import resource
+import sys
+import threading
+from typing import Any, Dict, Iterator, List, Optional, Tuple, Union
+
+# A recorded size: process id, name and size in bytes
+Record = Tuple[int, str, int]
+
+_SIZE_SUFFIXES = {"": 1, "K": 1 << 10, "M": 1 << 20, "G": 1 << 30, "T": 1 << 40}
+
+
+class MemoryBudgetExceeded(MemoryError):
+    """A process of a stage went over its memory budget.
+
+    can_shrink is True when the budget was exceeded while processing a batch, so a smaller batch size might fit.
+    """
+
+    def __init__(self, report: str, can_shrink: bool = False):
+        # Both values are kept in args, so the error survives being pickled back from a worker
+        super().__init__(report, can_shrink)
+        self.report = report
+        self.can_shrink = can_shrink
+
+    def __str__(self) -> str:
+        return self.report
+
+
+class Accounting:
+    """The peak size of every recorded structure, per process."""
+
+    def __init__(self) -> None:
+        self.peaks: Dict[Tuple[int, str], int] = {}
+        self.lock = threading.Lock()
+
+    def add(self, record: Record) -> None:
+        pid, name, nbytes = record
+        with self.lock:
+            key = (pid, name)
+            if nbytes > self.peaks.get(key, -1):
+                self.peaks[key] = nbytes
+
+    @property
+    def records(self) -> List[Record]:
+        with self.lock:
+            return [(pid, name, nbytes) for (pid, name), nbytes in self.peaks.items()]
+
+
+_accounting: Optional[Accounting] = None
+_budgets: Dict[str, int] = {}
+
+
+def _get_malloc_trim() -> Optional[Any]:
+    # glibc keeps freed memory in its arenas, malloc_trim hands it back to the kernel
+    try:
+        return ctypes.CDLL(ctypes.util.find_library("c") or "libc.so.6").malloc_trim
+    except (OSError, AttributeError):
+        return None
+
+
+_malloc_trim = _get_malloc_trim()
+
+
+def parse_size(size: Union[int, str]) -> int:
+    """Convert a size such as 1024, "512M", "4G" or "4GB" to bytes."""
+    if isinstance(size, int):
+        return size
+    text = size.strip().upper().removesuffix("B").removesuffix("I")
+    suffix = text[-1:] if text[-1:] in _SIZE_SUFFIXES else ""
+    return int(float(text[: len(text) - len(suffix)]) * _SIZE_SUFFIXES[suffix])
+
+
+def format_size(nbytes: int) -> str:
+    value = float(nbytes)
+    for unit in ("B", "KiB", "MiB", "GiB"):
+        if abs(value) < 1024:
+            return f"{value:.1f} {unit}"
+        value /= 1024
+    return f"{value:.1f} TiB"
+
+
+def get_rss() -> int:
+    """Get the current resident set size of this process in bytes."""
+    try:
+        with open("/proc/self/statm") as f:
+            return int(f.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+    except OSError:
+        # Not Linux, so fall back to the peak, which is in bytes on macOS
+        return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+
+def get_size(obj: Any) -> int:
+    """Estimate the memory used by an object, following containers, numpy arrays, sparse matrices and attributes.
+
+    Shared objects are only counted once.
+    """
+    seen = set()
+    total = 0
+    pending = [obj]
+    while pending:
+        current = pending.pop()
+        if id(current) in seen:
+            continue
+        seen.add(id(current))
+
+        if hasattr(current, "indptr") and hasattr(current, "indices"):
+            # A scipy sparse matrix
+            pending.extend((current.data, current.indices, current.indptr))
+            continue
+        if hasattr(current, "nbytes") and hasattr(current, "dtype"):
+            # A numpy array, where views don't own their buffer
+            if getattr(current, "base", None) is None:
+                total += current.nbytes
+            continue
+
+        total += sys.getsizeof(current)
+        if isinstance(current, dict):
+            pending.extend(current.keys())
+            pending.extend(current.values())
+        elif isinstance(current, (list, tuple, set, frozenset)):
+            pending.extend(current)
+        elif hasattr(current, "__dict__") and not isinstance(current, type):
+            pending.append(current.__dict__)
+    return total
+
+
+def is_enabled() -> bool:
+    return _accounting is not None
+
+
+def enable() -> None:
+    """Start memory accounting, discarding anything recorded before."""
+    global _accounting
+    _accounting = Accounting()
+
+
+def disable() -> None:
+    global _accounting
+    _accounting = None
+
+
+def set_budget(stage: str, size: Union[int, str, None]) -> None:
+    """Set the RSS budget of every process of a stage, or of every stage without its own with "default".
+
+    A size of None removes the budget. Setting a budget turns accounting on.
+    """
+    if size is None:
+        _budgets.pop(stage, None)
+        return
+    _budgets[stage] = parse_size(size)
+    if _accounting is None:
+        enable()
+
+
+def get_budget(stage: str) -> Optional[int]:
+    return _budgets.get(stage, _budgets.get("default"))
+
+
+def clear_budgets() -> None:
+    _budgets.clear()
+
+
+def record(name: str, nbytes: int) -> None:
+    """Record the size of a structure, keeping the peak per process."""
+    if _accounting is not None:
+        _accounting.add((os.getpid(), name, nbytes))
+
+
+def record_size(name: str, obj: Any) -> None:
+    """Record the estimated size of an object, which is only computed when accounting is on."""
+    if _accounting is not None:
+        _accounting.add((os.getpid(), name, get_size(obj)))
+
+
+def sample_rss() -> int:
+    """Record the current RSS of this process under "rss", and return it."""
+    rss = get_rss()
+    record("rss", rss)
+    return rss
+
+
+def add_records(records: List[Record]) -> None:
+    """Add the records of another process, such as a worker."""
+    if _accounting is not None:
+        for r in records:
+            _accounting.add(r)
+
+
+@contextlib.contextmanager
+def capture() -> Iterator[Accounting]:
+    """Record into a fresh accounting, for instance in a worker process that sends its records back to the parent."""
+    global _accounting
+    previous = _accounting
+    _accounting = Accounting()
+    try:
+        yield _accounting
+    finally:
+        _accounting = previous
+
+
+def release() -> int:
+    """Return freed memory to the operating system where possible, and get the RSS of this process afterwards."""
+    gc.collect()
+    if _malloc_trim is not None:
+        _malloc_trim(0)
+    return get_rss()
+
+
+def check(
+    stage: str, budget: Optional[int] = None, can_shrink: bool = False, context: str = "", retained: int = 0
+) -> None:
+    """Sample the RSS of this process and fail with a report if it is over the budget of the stage.
+
+    Arguments:
+        stage: The stage whose budget applies
+        budget: The budget to use instead of the one configured for the stage, for processes that don't share
+            the configuration of the parent
+        can_shrink: Whether the caller can retry with less work, see MemoryBudgetExceeded
+        context: What the process was doing, which is included in the report
+        retained: Memory that was freed after an earlier failed check but that the allocator still holds on to,
+            which doesn't count against the budget
+    """
+    if budget is None:
+        budget = get_budget(stage)
+    if budget is None and _accounting is None:
+        return
+
+    rss = sample_rss()
+    if budget is not None and rss - retained > budget:
+        header = f"Process {os.getpid()} of stage {stage} is using {format_size(rss)}, over its budget of "
+        header += f"{format_size(budget)}" + (f" ({context})" if context else "")
+        if retained:
+            header += f", of which {format_size(retained)} was retained from an earlier batch"
+        raise MemoryBudgetExceeded(header + "\n" + get_report(), can_shrink)
+
+
+def get_report() -> str:
+    """Get a table with the peak size of every recorded structure, per process, sorted by size."""
+    if _accounting is None:
+        return "Memory accounting is not enabled"
+
+    records = _accounting.records
+    lines = ["{:>8} {:<64} {:>12}".format("pid", "name", "peak")]
+    for pid, name, nbytes in sorted(records, key=lambda r: (r[0], -r[2])):
+        lines.append("{:>8} {:<64} {:>12}".format(pid, name, format_size(nbytes)))
+    return "\n".join(lines)
+
+
+def _parse_budgets(text: str) -> None:
+    for part in text.split(","):
+        if not part.strip():
+            continue
+        stage, _, size = part.rpartition("=")
+        set_budget(stage.strip() or "default", size)
+
+
+def _print_on_exit() -> None:
+    if _accounting is not None:
+        print(get_report(), file=sys.stderr)
+
+
+if multiprocessing.parent_process() is None:
+    if os.environ.get("FEMR_MEMORY_BUDGET"):
+        _parse_budgets(os.environ["FEMR_MEMORY_BUDGET"])
+    if os.environ.get("FEMR_MEMORY_REPORT"):
+        enable()
+        atexit.register(_print_on_exit)
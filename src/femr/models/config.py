@@ -13,11 +13,14 @@ class FEMRTransformerConfig(transformers.PretrainedConfig):
         hidden_size: int = 768,
         intermediate_size: int = 3072,
         n_heads: int = 12,
+        n_kv_heads: Optional[int] = None,
         n_layers: int = 6,
         attention_width: int = 496,
         use_normed_ages: bool = False,
         use_bias: bool = True,
         hidden_act: str = "gelu",
+        layer_implementation: str = "eager",
+        checkpoint_blocks: str = "layer",
         **kwargs,
     ) -> None:
         """Defined a configuration for a FEMR Transformer.
@@ -28,11 +31,22 @@ class FEMRTransformerConfig(transformers.PretrainedConfig):
             hidden_size: The internal representation size
             intermediate_size: The size of the FFN in the transformer layers
             n_heads: The number of attention heads
+            n_kv_heads: The number of key and value heads, which defaults to n_heads.
+                Smaller values use grouped query attention, with n_kv_heads=1 being multi query attention.
             n_layers: The number of transformer encoder layers
             attention_width: FEMR by default uses a local attention transformer with a width defined here
             use_normed_ages: Whether or not to provide normalized ages as a feature to the model
             use_bias: Whether or not to use bias terms in the transformer layers
             hidden_act: The type of activation function to use in the transformer
+            layer_implementation: How transformer layers are executed. "eager" runs every op separately.
+                "fused" folds the norm into the input projection, rotates queries and keys in place during
+                inference and skips the concatenation before the output projection. "compiled" compiles everything but the attention call
+                with torch.compile and dynamic shapes, so variable length batches don't trigger recompiles.
+            checkpoint_blocks: What each layer recomputes during the backward pass when gradient checkpointing
+                is enabled with FEMRModel.gradient_checkpointing_enable (or gradient_checkpointing=True in the
+                transformers.TrainingArguments). "layer" recomputes the entire layer and only saves its input.
+                "attention" recomputes the norm, input projection and attention. "feed_forward" recomputes the
+                activation and output projection, which saves the feed forward input but not its activations.
         """
         super().__init__(**kwargs)
 
@@ -42,6 +56,11 @@ class FEMRTransformerConfig(transformers.PretrainedConfig):
         self.hidden_size = hidden_size
         self.intermediate_size = intermediate_size
         self.n_heads = n_heads
+
+        if n_kv_heads is None:
+            n_kv_heads = n_heads
+        assert n_heads % n_kv_heads == 0, f"{n_heads} heads can't be split into {n_kv_heads} groups"
+        self.n_kv_heads = n_kv_heads
         self.n_layers = n_layers
         self.attention_width = attention_width
 
@@ -50,6 +69,12 @@ class FEMRTransformerConfig(transformers.PretrainedConfig):
         self.use_bias = use_bias
         self.hidden_act = hidden_act
 
+        assert layer_implementation in ("eager", "fused", "compiled"), f"Unknown implementation {layer_implementation}"
+        self.layer_implementation = layer_implementation
+
+        assert checkpoint_blocks in ("layer", "attention", "feed_forward"), f"Unknown blocks {checkpoint_blocks}"
+        self.checkpoint_blocks = checkpoint_blocks
+
 
 class FEMRTaskConfig(transformers.PretrainedConfig):
     def __init__(self, task_type: str = "", task_kwargs: Mapping[str, Any] = {}, **kwargs):
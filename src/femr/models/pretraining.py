@@ -0,0 +1,335 @@
+"""Single pass preparation of the tokenizer and MOTOR pretraining task."""
+
+from __future__ import annotations
+
+import functools
+from typing import Any, Dict, List, Mapping, Tuple
+
+import numpy as np
+import scipy.sparse
+
+import femr.hf_utils
+import femr.models.tasks
+import femr.models.tokenizer
+import femr.ontology
+import femr.pat_utils
+import femr.stat_utils
+import femr.tracing
+
+# Event times are summarized with log2 spaced histograms, which have a resolution of about 9%
+_BUCKETS_PER_OCTAVE = 8
+_NUM_BUCKETS = 40 * _BUCKETS_PER_OCTAVE
+
+# The number of buffered events after which they are summed into the sparse histogram
+_MAX_PENDING_HISTOGRAM_KEYS = 1 << 20
+
+
+def _get_bucket(seconds: np.ndarray) -> np.ndarray:
+    with np.errstate(divide="ignore"):
+        buckets = np.floor(np.log2(seconds) * _BUCKETS_PER_OCTAVE)
+    return np.clip(buckets, 0, _NUM_BUCKETS - 1).astype(np.int64)
+
+
+def _get_histogram_percentiles(counts: np.ndarray, percentiles: np.ndarray) -> np.ndarray:
+    """Approximate percentiles of a histogram, interpolating within buckets in log space."""
+    cumulative = np.cumsum(counts)
+    targets = percentiles / 100 * cumulative[-1]
+
+    buckets = np.clip(np.searchsorted(cumulative, targets, side="left"), 0, _NUM_BUCKETS - 1)
+    before = cumulative[buckets] - counts[buckets]
+    fraction = (targets - before) / np.maximum(counts[buckets], 1)
+
+    return 2 ** ((buckets + np.clip(fraction, 0, 1)) / _BUCKETS_PER_OCTAVE)
+
+
+class _SurvivalStatistics:
+    """Time to event statistics for every code, accumulated from sparse survival rows.
+
+    Every prediction time is censored for all codes except those with an event, so the statistics
+    are stored as totals over all prediction times together with per code corrections for the events.
+    The totals are relative to a shift near the data, so the variances do not cancel catastrophically,
+    and partials are merged with the parallel variance formula.
+
+    Most codes only have events in a few buckets, so the event time histograms are a sparse (code, bucket) matrix.
+    New events are buffered as flat code * _NUM_BUCKETS + bucket keys and summed into the matrix in chunks.
+    """
+
+    def __init__(self):
+        self.codes: List[str] = []
+
+        self.num_predictions = 0
+        self.shift = 0.0
+        self.censor_sum = 0.0
+        self.censor_square_sum = 0.0
+
+        self.num_events = np.zeros(0, dtype=np.int64)
+        self.correction_sum = np.zeros(0, dtype=np.float64)
+        self.correction_square_sum = np.zeros(0, dtype=np.float64)
+
+        self.event_histogram = scipy.sparse.csr_array((0, _NUM_BUCKETS), dtype=np.int64)
+        self.pending_histogram_keys: List[np.ndarray] = []
+        self.num_pending_histogram_keys = 0
+
+    def __getstate__(self):
+        self.fold_histogram()
+        return self.__dict__
+
+    def fold_histogram(self) -> None:
+        """Sum the buffered events into the histogram matrix, which is resized to the current number of codes."""
+        num_codes = len(self.num_events)
+        if self.event_histogram.shape[0] != num_codes:
+            self.event_histogram.resize((num_codes, _NUM_BUCKETS))
+
+        if self.pending_histogram_keys:
+            keys = np.concatenate(self.pending_histogram_keys)
+            rows, buckets = np.divmod(keys, _NUM_BUCKETS)
+            # Duplicate (code, bucket) pairs are summed when converting to CSR
+            pending = scipy.sparse.coo_array(
+                (np.ones(len(keys), dtype=np.int64), (rows, buckets)), shape=(num_codes, _NUM_BUCKETS)
+            )
+            self.event_histogram = self.event_histogram + pending.tocsr()
+
+            self.pending_histogram_keys = []
+            self.num_pending_histogram_keys = 0
+
+    def resize(self, num_codes: int) -> None:
+        extra = num_codes - len(self.num_events)
+        if extra > 0:
+            # Grow geometrically, as new codes keep appearing throughout a batch
+            extra = max(extra, len(self.num_events))
+            self.num_events = np.concatenate((self.num_events, np.zeros(extra, dtype=np.int64)))
+            self.correction_sum = np.concatenate((self.correction_sum, np.zeros(extra)))
+            self.correction_square_sum = np.concatenate((self.correction_square_sum, np.zeros(extra)))
+
+    def add(self, censor_seconds: float, code_indices: np.ndarray, event_seconds: np.ndarray) -> None:
+        if self.num_predictions == 0:
+            self.shift = censor_seconds
+
+        censor_seconds -= self.shift
+        event_seconds = event_seconds - self.shift
+
+        self.num_predictions += 1
+        self.censor_sum += censor_seconds
+        self.censor_square_sum += censor_seconds**2
+
+        self.num_events[code_indices] += 1
+        self.correction_sum[code_indices] += event_seconds - censor_seconds
+        self.correction_square_sum[code_indices] += event_seconds**2 - censor_seconds**2
+
+        self.pending_histogram_keys.append(code_indices.astype(np.int64) * _NUM_BUCKETS + _get_bucket(event_seconds))
+        self.num_pending_histogram_keys += len(code_indices)
+        if self.num_pending_histogram_keys > _MAX_PENDING_HISTOGRAM_KEYS:
+            self.fold_histogram()
+
+    def trim(self) -> None:
+        num_codes = len(self.codes)
+        self.num_events = self.num_events[:num_codes]
+        self.correction_sum = self.correction_sum[:num_codes]
+        self.correction_square_sum = self.correction_square_sum[:num_codes]
+        self.fold_histogram()
+
+    def get_moments(self) -> Tuple[float, float, np.ndarray, np.ndarray]:
+        """Get the mean and the sum of squared deviations for codes without events, and for every code."""
+        if self.num_predictions == 0:
+            return 0.0, 0.0, np.zeros_like(self.correction_sum), np.zeros_like(self.correction_square_sum)
+
+        censor_mean = self.censor_sum / self.num_predictions
+        censor_square_deviations = self.censor_square_sum - self.num_predictions * censor_mean**2
+
+        means = (self.censor_sum + self.correction_sum) / self.num_predictions
+        square_deviations = self.censor_square_sum + self.correction_square_sum - self.num_predictions * means**2
+
+        return self.shift + censor_mean, censor_square_deviations, self.shift + means, square_deviations
+
+    def combine(self, other: _SurvivalStatistics) -> None:
+        code_to_index = {code: i for i, code in enumerate(self.codes)}
+        other_indices = np.zeros(len(other.codes), dtype=np.int64)
+        for i, code in enumerate(other.codes):
+            if code not in code_to_index:
+                code_to_index[code] = len(self.codes)
+                self.codes.append(code)
+            other_indices[i] = code_to_index[code]
+
+        self.resize(len(self.codes))
+        self.trim()
+        other.trim()
+
+        if other.num_predictions > 0:
+            censor_mean, censor_square_deviations, means, square_deviations = self.get_moments()
+            other_censor_mean, other_censor_square_deviations, other_means, other_square_deviations = (
+                other.get_moments()
+            )
+
+            # Codes without events in the other partial are censored at all of its prediction times
+            expanded_means = np.full(len(self.codes), other_censor_mean)
+            expanded_means[other_indices] = other_means
+            expanded_square_deviations = np.full(len(self.codes), other_censor_square_deviations)
+            expanded_square_deviations[other_indices] = other_square_deviations
+
+            # The parallel variance formula, for the codes without events and for every code
+            n1 = self.num_predictions
+            n2 = other.num_predictions
+            n = n1 + n2
+
+            censor_delta = other_censor_mean - censor_mean
+            censor_mean += censor_delta * n2 / n
+            censor_square_deviations += other_censor_square_deviations + censor_delta**2 * n1 * n2 / n
+
+            delta = expanded_means - means
+            means = means + delta * n2 / n
+            square_deviations = square_deviations + expanded_square_deviations + delta**2 * n1 * n2 / n
+
+            # Store the merged moments as totals shifted by the censor mean
+            self.num_predictions = n
+            self.shift = censor_mean
+            self.censor_sum = 0.0
+            self.censor_square_sum = censor_square_deviations
+            self.correction_sum = n * (means - censor_mean)
+            self.correction_square_sum = square_deviations + n * (means - censor_mean) ** 2 - censor_square_deviations
+
+        self.num_events[other_indices] += other.num_events
+
+        other_histogram = other.event_histogram.tocoo()
+        remapped = scipy.sparse.coo_array(
+            (other_histogram.data, (other_indices[other_histogram.row], other_histogram.col)),
+            shape=self.event_histogram.shape,
+        )
+        self.event_histogram = self.event_histogram + remapped.tocsr()
+
+    def get_task_stats(self, tasks: List[str]) -> Tuple[np.ndarray, List[Any]]:
+        """Get the event time histogram and the censored count, event count and time statistics of some tasks."""
+        self.fold_histogram()
+        code_to_index = {code: i for i, code in enumerate(self.codes)}
+        censor_mean, censor_square_deviations, means, square_deviations = self.get_moments()
+
+        histogram = np.zeros(_NUM_BUCKETS, dtype=np.int64)
+        stats = []
+
+        for task in tasks:
+            time_stats = femr.stat_utils.OnlineStatistics()
+            if task not in code_to_index:
+                # A task without any events is censored at every prediction time
+                num_events = 0
+                mean = censor_mean
+                square_deviations_sum = censor_square_deviations
+            else:
+                index = code_to_index[task]
+                num_events = int(self.num_events[index])
+                mean = float(means[index])
+                square_deviations_sum = float(square_deviations[index])
+                histogram += self.event_histogram[[index]].toarray()[0]
+
+            if self.num_predictions > 0:
+                time_stats.count = self.num_predictions
+                time_stats.current_mean = mean
+                time_stats.variance = max(square_deviations_sum, 0)
+
+            stats.append([self.num_predictions - num_events, num_events, time_stats])
+
+        return histogram, stats
+
+
+def _pretraining_statistics_map(
+    batch, *, num_patients: int, is_hierarchical: bool, ontology: femr.ontology.Ontology
+) -> Mapping[str, Any]:
+    tokenizer_statistics = femr.models.tokenizer.map_statistics(
+        batch, num_patients=num_patients, is_hierarchical=is_hierarchical, ontology=ontology
+    )
+
+    survival_statistics = _SurvivalStatistics()
+    code_to_index: Dict[str, int] = {}
+    code_cache: Dict[str, List[int]] = {}
+
+    for patient_id, events in zip(batch["patient_id"], batch["events"]):
+        patient = {"patient_id": patient_id, "events": events}
+
+        # Every code could end up as a MOTOR task, so the calculator tracks all of them
+        calculator = femr.models.tasks.IndexedSurvivalCalculator(
+            ontology, patient, code_to_index, code_cache, add_missing_tasks=True
+        )
+        survival_statistics.resize(len(code_to_index))
+
+        birth = femr.pat_utils.get_patient_birthdate(patient)
+
+        for event, next_event in zip(patient["events"], patient["events"][1:]):
+            if (event["time"] - birth).days <= 1:
+                continue
+            if femr.models.tasks.should_make_survival_prediction(event["time"], next_event["time"]):
+                survival_statistics.add(*calculator.get_future_events_for_time(event["time"]))
+
+    # Codes are added in index order
+    survival_statistics.codes = list(code_to_index)
+    survival_statistics.trim()
+
+    return {"tokenizer": tokenizer_statistics, "survival": survival_statistics}
+
+
+def _pretraining_statistics_agg(first: Any, second: Any) -> Any:
+    first["tokenizer"] = femr.models.tokenizer.agg_statistics(first["tokenizer"], second["tokenizer"])
+    first["survival"].combine(second["survival"])
+    return first
+
+
+@femr.tracing.traced()
+def train_tokenizer_and_motor_task(
+    dataset,
+    vocab_size: int,
+    num_tasks: int,
+    num_bins: int,
+    final_layer_size: int,
+    ontology: femr.ontology.Ontology,
+    is_hierarchical: bool = False,
+    num_numeric: int = 1000,
+    num_proc: int = 1,
+) -> Tuple[femr.models.tokenizer.FEMRTokenizer, femr.models.tasks.MOTORTask]:
+    """Train a FEMR tokenizer and fit a MOTOR pretraining task with a single pass over the dataset.
+
+    This is equivalent to train_tokenizer followed by MOTORTask.fit_pretraining_task_info, except that time bins
+    are computed from histograms of the event times instead of a reservoir sample.
+    As the MOTOR tasks are only known once the tokenizer is trained, time to event statistics are collected for
+    every code in the dataset.
+
+    Arguments:
+        dataset: A huggingface dataset containing MEDS patients
+        vocab_size: The vocabulary size of the tokenizer
+        num_tasks: The number of MOTOR pretraining tasks
+        num_bins: The number of MOTOR time bins
+        final_layer_size: The size of the per time bin representation of the MOTOR head
+        ontology: The ontology used for both the tokenizer and the MOTOR tasks
+        is_hierarchical: Whether to train a hierarchical tokenizer
+        num_numeric: The number of numeric bins in a hierarchical tokenizer
+        num_proc: The number of processes to use
+
+    Returns:
+        The tokenizer and the MOTOR task
+    """
+    statistics = femr.hf_utils.aggregate_over_dataset(
+        dataset,
+        functools.partial(
+            _pretraining_statistics_map, num_patients=len(dataset), is_hierarchical=is_hierarchical, ontology=ontology
+        ),
+        _pretraining_statistics_agg,
+        num_proc=num_proc,
+        batch_size=1_000,
+        stage="train_tokenizer_and_motor_task",
+    )
+
+    tokenizer = femr.models.tokenizer.FEMRTokenizer(
+        femr.models.tokenizer.convert_statistics_to_msgpack(
+            statistics["tokenizer"], vocab_size, is_hierarchical, num_numeric, ontology
+        ),
+        ontology,
+    )
+
+    tasks = femr.models.tasks.get_motor_tasks(tokenizer, num_tasks)
+    histogram, stats = statistics["survival"].get_task_stats(tasks)
+
+    time_bins = _get_histogram_percentiles(histogram, np.linspace(0, 100, num_bins + 1))
+
+    motor_task = femr.models.tasks.MOTORTask(
+        femr.models.tasks.get_motor_task_info(tasks, stats),
+        femr.models.tasks.finalize_time_bins(time_bins),
+        final_layer_size,
+    )
+
+    return tokenizer, motor_task
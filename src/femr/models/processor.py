@@ -13,6 +13,7 @@ import torch.utils.data
 import femr.hf_utils
 import femr.models.tokenizer
 import femr.pat_utils
+import femr.tracing
 
 
 def map_preliminary_batch_stats(batch, indices, *, processor: FEMRBatchProcessor, max_length: int):
@@ -36,10 +37,18 @@ def map_preliminary_batch_stats(batch, indices, *, processor: FEMRBatchProcessor
 
     For these patients we only generate one tuple for them, and drop some labels.
 
-    Later code will then take [(patient_id, start_index, length)], and create actual batches.
+    Tasks that label (nearly) every token instead cover patients with overlapping windows
+    (get_window_overlap in tasks.py). Each tuple then gets a fourth value, the label offset,
+    which skips labels in the overlap that were already produced by the previous window.
+
+    Later code will then take [(patient_id, start_index, length, label_offset)], and create actual batches.
     """
     lengths = []
 
+    window_overlap = processor.creator.task.get_window_overlap() if processor.creator.task is not None else None
+    if window_overlap is not None:
+        assert 0 <= window_overlap < max_length, f"Window overlap {window_overlap} must be less than {max_length}"
+
     for patient_index, patient_id, events in zip(indices, batch["patient_id"], batch["events"]):
         patient = {
             "patient_id": patient_id,
@@ -51,24 +60,36 @@ def map_preliminary_batch_stats(batch, indices, *, processor: FEMRBatchProcessor
         if data["transformer"]["label_indices"].shape[0] == 0:
             continue
 
+        if window_overlap is not None:
+            # Slide a window over the patient, with every window after the first keeping only its new labels
+            num_tokens = data["transformer"]["label_indices"][-1] + 1
+            current_start = 0
+            while True:
+                length = min(max_length, num_tokens - current_start)
+                label_offset = 0 if current_start == 0 else window_overlap
+                lengths.append((patient_index, current_start, length, label_offset))
+                if current_start + length >= num_tokens:
+                    break
+                current_start += max_length - window_overlap
+
         # We need exact batching, so we need an algorithm that precisely covers every label in the batch
-        if data["needs_exact"]:
+        elif data["needs_exact"]:
             current_start = 0
             current_end = 0
             for label_index in data["transformer"]["label_indices"]:
                 if (label_index - current_start + 1) >= max_length:
                     if current_start != current_end:
-                        lengths.append((patient_index, current_start, current_end - current_start + 1))
+                        lengths.append((patient_index, current_start, current_end - current_start + 1, 0))
                     current_start = label_index - max_length + 1
                     current_end = label_index
                 else:
                     current_end = label_index
 
-            lengths.append((patient_index, current_start, current_end - current_start + 1))
+            lengths.append((patient_index, current_start, current_end - current_start + 1, 0))
         else:
             last_index = data["transformer"]["label_indices"][-1]
             length = min(max_length, last_index + 1)
-            lengths.append((patient_index, last_index + 1 - length, length))
+            lengths.append((patient_index, last_index + 1 - length, length, 0))
     if len(lengths) > 0:
         return [np.array(lengths, dtype=np.int64)]
     else:
@@ -114,18 +135,21 @@ class BatchCreator:
         if self.task is not None:
             self.task.start_batch()
 
-    def add_patient(self, patient: meds.Patient, offset: int = 0, max_length: Optional[int] = None):
+    def add_patient(
+        self, patient: meds.Patient, offset: int = 0, max_length: Optional[int] = None, label_offset: int = 0
+    ):
         """Add a patient to the current batch.
 
-        Note that the two optional parameters are used to add a subset of a patient to a batch.
+        Note that the optional parameters are used to add a subset of a patient to a batch.
 
-        It is generally recommended to never manually use offset or max_length as
+        It is generally recommended to never manually use offset, max_length or label_offset as
         you should rely on FEMRBatchProcessor.convert_dataset.
 
         Arguments:
             patient: The patient to add.
             offset: The offset into the patient to featurize.
             max_length: The maximum length of the batch sequence. There is no max when left at None.
+            label_offset: Labels within the first label_offset tokens of the subset are skipped.
 
         """
         current_date = None
@@ -261,7 +285,7 @@ class BatchCreator:
         for i, label_index in enumerate(per_patient_label_indices):
             corrected_label = label_index - offset
 
-            if 0 <= corrected_label < length_to_add:
+            if label_offset <= corrected_label < length_to_add:
                 labels_to_add.append(i)
                 self.label_indices.append(start_index + corrected_label)
 
@@ -333,8 +357,8 @@ def _batch_generator(batch_data: Tuple[np.ndarray, np.ndarray], *, creator: Batc
         offsets = list(offsets)
         for start, end in zip(offsets, offsets[1:]):
             creator.start_batch()
-            for patient_index, offset, length in lengths[start:end, :]:
-                creator.add_patient(dataset[patient_index.item()], offset, length)
+            for patient_index, offset, length, label_offset in lengths[start:end, :]:
+                creator.add_patient(dataset[patient_index.item()], offset, length, label_offset)
 
             result = creator.get_batch_data()
             assert "task" in result, f"No task present in {lengths[start:end,:]}"
@@ -400,7 +424,15 @@ class FEMRBatchProcessor:
         assert len(batches) == 1, "Can only have one batch when collating"
         return {"batch": _add_dimension(self.creator.cleanup_batch(batches[0]))}
 
-    def convert_dataset(self, dataset, tokens_per_batch: int, min_patients_per_batch: int = 4, num_proc: int = 1):
+    @femr.tracing.traced()
+    def convert_dataset(
+        self,
+        dataset,
+        tokens_per_batch: int,
+        min_patients_per_batch: int = 4,
+        num_proc: int = 1,
+        cache_dir: Optional[str] = None,
+    ):
         """Convert an entire dataset to batches.
 
         Arguments:
@@ -408,6 +440,8 @@ class FEMRBatchProcessor:
             tokens_per_batch: The number of tokens allowed per batch
             min_patients_per_batch: The minimum number of patients per batch
             num_proc: The number of processers to use when converting
+            cache_dir: Where datasets writes the batches, by default its cache. Batches that are already in that
+                cache for the same inputs are reused instead of converted again
 
         Returns:
             A huggingface dataset object containing batches
@@ -415,7 +449,7 @@ class FEMRBatchProcessor:
         if isinstance(dataset, datasets.DatasetDict):
             return datasets.DatasetDict(
                 {
-                    k: self.convert_dataset(v, tokens_per_batch, min_patients_per_batch, num_proc)
+                    k: self.convert_dataset(v, tokens_per_batch, min_patients_per_batch, num_proc, cache_dir)
                     for k, v in dataset.items()
                 }
             )
@@ -428,6 +462,7 @@ class FEMRBatchProcessor:
             num_proc=num_proc,
             batch_size=1_000,
             with_indices=True,
+            stage="convert_dataset",
         )
 
         lengths = np.concatenate(lengths)
@@ -469,7 +504,10 @@ class FEMRBatchProcessor:
                 )
             )
 
-        print("Creating batches", len(batches))
+        femr.tracing.count("patients", len(dataset))
+        femr.tracing.count("subsequences", len(lengths))
+        femr.tracing.count("tokens", int(lengths[:, 2].sum()))
+        femr.tracing.count("batches", len(batches))
 
         batch_func = functools.partial(
             _batch_generator,
@@ -484,6 +522,7 @@ class FEMRBatchProcessor:
             },
             num_proc=num_proc,
             writer_batch_size=8,
+            cache_dir=cache_dir,
         )
 
         return batch_dataset
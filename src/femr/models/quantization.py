@@ -0,0 +1,41 @@
+"""Reduced precision CPU inference for FEMR models."""
+
+from __future__ import annotations
+
+import torch
+import torch.ao.nn.quantized
+import torch.ao.quantization
+from torch import nn
+
+
+def _quantize_embeddings(module: nn.Module) -> None:
+    for name, child in module.named_children():
+        if isinstance(child, (nn.Embedding, nn.EmbeddingBag)):
+            # Embeddings have no activations to quantize, so they use per row weight only quantization
+            child.qconfig = torch.ao.quantization.float_qparams_weight_only_qconfig
+            if isinstance(child, nn.Embedding):
+                quantized: nn.Module = torch.ao.nn.quantized.Embedding.from_float(child)
+            else:
+                quantized = torch.ao.nn.quantized.EmbeddingBag.from_float(child)
+            setattr(module, name, quantized)
+        else:
+            _quantize_embeddings(child)
+
+
+def quantize_dynamic_int8(model: nn.Module) -> nn.Module:
+    """Convert a model, such as one loaded with FEMRModel.from_pretrained, for int8 CPU inference.
+
+    Linear layers (most importantly input_proj and output_proj in every FEMREncoderLayer) get int8 weights
+    and quantize their activations dynamically per batch. Embedding and EmbeddingBag layers get int8 weights.
+    Norms, rotary embeddings and attention stay in float32.
+
+    The model is modified in place and can only be used for inference on CPU.
+    """
+    model = model.to("cpu")
+    model.eval()
+
+    _quantize_embeddings(model)
+
+    return torch.ao.quantization.quantize_dynamic(
+        model, {nn.Linear: torch.ao.quantization.default_dynamic_qconfig}, dtype=torch.qint8, inplace=True
+    )
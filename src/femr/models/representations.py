@@ -0,0 +1,318 @@
+"""Storage for transformer representations, either in memory or streamed to memory-mapped arrays on disk."""
+
+from __future__ import annotations
+
+import json
+import os
+from typing import Any, Dict, Mapping, Optional, Sequence, Union
+
+import meds
+import numpy as np
+import torch
+
+# numpy has no bfloat16 type, so bfloat16 representations are stored as their raw 16 bit patterns
+_STORAGE_DTYPES = {
+    "float32": (torch.float32, np.float32),
+    "float16": (torch.float16, np.float16),
+    "bfloat16": (torch.bfloat16, np.uint16),
+}
+
+_ARRAY_NAMES = ("patient_ids", "feature_times", "features")
+
+
+def _bfloat16_to_float32(raw: np.ndarray) -> np.ndarray:
+    return (raw.astype(np.uint32) << 16).view(np.float32)
+
+
+class RepresentationWriter:
+    """Collects representations into arrays that are allocated up front and filled in one batch at a time.
+
+    With a path, the arrays are memory-mapped .npy files in that directory, which lets the representations
+    for very large cohorts be written without ever being held in RAM.
+    Without a path, the arrays are in-memory torch tensors that can be moved into shared memory.
+
+    The writer is picklable, so several processes can each write disjoint row ranges.
+    """
+
+    def __init__(
+        self,
+        num_rows: int,
+        hidden_size: int,
+        dtype: str = "float32",
+        path: Optional[str] = None,
+        metadata: Optional[Mapping[str, Any]] = None,
+    ):
+        assert dtype in _STORAGE_DTYPES, f"Unsupported representation dtype {dtype}"
+        assert path is not None or dtype != "bfloat16", "bfloat16 representations require an output path"
+
+        self.num_rows = num_rows
+        self.hidden_size = hidden_size
+        self.dtype = dtype
+        self.path = path
+
+        self._arrays: Optional[Dict[str, Any]] = None
+
+        if self.path is None:
+            torch_dtype, _ = _STORAGE_DTYPES[self.dtype]
+            self._arrays = {
+                "patient_ids": torch.empty(num_rows, dtype=torch.int64),
+                "feature_times": torch.empty(num_rows, dtype=torch.int64),
+                "features": torch.empty((num_rows, hidden_size), dtype=torch_dtype),
+            }
+        else:
+            os.makedirs(self.path, exist_ok=True)
+            _, np_dtype = _STORAGE_DTYPES[self.dtype]
+            shapes = {
+                "patient_ids": ((num_rows,), np.int64),
+                "feature_times": ((num_rows,), np.int64),
+                "features": ((num_rows, hidden_size), np_dtype),
+            }
+            for name, (shape, array_dtype) in shapes.items():
+                # Creating the memory map allocates the file, the actual writes happen in write()
+                np.lib.format.open_memmap(
+                    os.path.join(self.path, name + ".npy"), mode="w+", dtype=array_dtype, shape=shape
+                )
+
+            with open(os.path.join(self.path, "metadata.json"), "w") as f:
+                json.dump({**(metadata or {}), "num_rows": num_rows, "hidden_size": hidden_size, "dtype": dtype}, f)
+
+    def __getstate__(self):
+        state = dict(self.__dict__)
+        if self.path is not None:
+            # Memory maps are reopened lazily in whichever process does the writing
+            state["_arrays"] = None
+        return state
+
+    def _get_arrays(self) -> Dict[str, Any]:
+        if self._arrays is None:
+            assert self.path is not None
+            self._arrays = {
+                name: np.load(os.path.join(self.path, name + ".npy"), mmap_mode="r+") for name in _ARRAY_NAMES
+            }
+        return self._arrays
+
+    def share_memory(self) -> None:
+        """Move in-memory arrays to shared memory so that they can be written by other processes."""
+        if self.path is None:
+            for v in self._get_arrays().values():
+                v.share_memory_()
+
+    def write(
+        self, start: int, patient_ids: torch.Tensor, feature_times: torch.Tensor, representations: torch.Tensor
+    ) -> None:
+        """Write a batch of representations at the given row offset. All inputs must be CPU tensors."""
+        arrays = self._get_arrays()
+        end = start + patient_ids.shape[0]
+        assert end <= self.num_rows, f"Writing past the end of the output {end} {self.num_rows}"
+
+        torch_dtype, _ = _STORAGE_DTYPES[self.dtype]
+        representations = representations.to(dtype=torch_dtype)
+
+        if self.path is None:
+            arrays["patient_ids"][start:end] = patient_ids
+            arrays["feature_times"][start:end] = feature_times
+            arrays["features"][start:end, :] = representations
+        else:
+            if self.dtype == "bfloat16":
+                features = representations.view(torch.int16).numpy().view(np.uint16)
+            else:
+                features = representations.numpy()
+            arrays["patient_ids"][start:end] = patient_ids.numpy()
+            arrays["feature_times"][start:end] = feature_times.numpy()
+            arrays["features"][start:end, :] = features
+
+    def flush(self) -> None:
+        if self.path is not None and self._arrays is not None:
+            for v in self._arrays.values():
+                v.flush()
+
+    def finish(self) -> Union[Dict[str, np.ndarray], RepresentationReader]:
+        """Finalize the output.
+
+        Returns:
+            For in-memory outputs, a dictionary with "patient_ids", "feature_times" and "features".
+            For on-disk outputs, a RepresentationReader over the written directory.
+        """
+        if self.path is None:
+            arrays = self._get_arrays()
+            return {
+                "patient_ids": arrays["patient_ids"].numpy(),
+                "feature_times": arrays["feature_times"].numpy().astype("datetime64[s]"),
+                "features": arrays["features"].numpy(),
+            }
+        else:
+            self.flush()
+            self._arrays = None
+            return RepresentationReader(self.path)
+
+
+class RepresentationReader:
+    """Read representations that were written to disk by RepresentationWriter.
+
+    All arrays are memory-mapped, so only the rows that are actually requested are read from disk.
+    """
+
+    def __init__(self, path: str):
+        self.path = path
+
+        with open(os.path.join(self.path, "metadata.json")) as f:
+            self.metadata = json.load(f)
+
+        self.dtype = self.metadata["dtype"]
+        self.hidden_size = self.metadata["hidden_size"]
+
+        self.patient_ids = np.load(os.path.join(self.path, "patient_ids.npy"), mmap_mode="r")
+        self.feature_times = np.load(os.path.join(self.path, "feature_times.npy"), mmap_mode="r").view("datetime64[s]")
+        # The raw stored features. Use get_features to obtain them as float32.
+        self.raw_features = np.load(os.path.join(self.path, "features.npy"), mmap_mode="r")
+
+    def __len__(self) -> int:
+        return self.patient_ids.shape[0]
+
+    def get_features(self, rows: Union[Sequence[int], np.ndarray, slice], chunk_size: int = 65_536) -> np.ndarray:
+        """Load the given rows as a float32 array, converting from the storage type in chunks."""
+        if isinstance(rows, slice):
+            rows = np.arange(len(self))[rows]
+        rows = np.asarray(rows, dtype=np.int64)
+
+        result = np.empty((rows.shape[0], self.hidden_size), dtype=np.float32)
+        for start in range(0, rows.shape[0], chunk_size):
+            chunk_rows = rows[start : start + chunk_size]
+            # Reading in sorted order keeps the memory-mapped reads sequential
+            order = np.argsort(chunk_rows, kind="stable")
+            raw = self.raw_features[chunk_rows[order], :]
+            if self.dtype == "bfloat16":
+                raw = _bfloat16_to_float32(raw)
+            result[start + order] = raw
+
+        return result
+
+    def join_labels(self, labels: Sequence[meds.Label]) -> Mapping[str, np.ndarray]:
+        """Find the representation for each label, which is the last feature at or before its prediction time.
+
+        Only the matched feature rows are loaded. The result follows femr.featurizers.join_labels, with the
+        labels sorted by patient id and prediction time.
+        """
+        return join_representations(self.patient_ids, self.feature_times, labels, self.get_features)
+
+
+def join_representations(
+    patient_ids: np.ndarray, feature_times: np.ndarray, labels: Sequence[meds.Label], get_features: Any
+) -> Mapping[str, np.ndarray]:
+    """Match every label to the last representation of its patient at or before the label's prediction time.
+
+    Arguments:
+        patient_ids: The patient id of each representation
+        feature_times: The time of each representation, as datetime64[s]
+        labels: The labels to match
+        get_features: A function that loads the feature rows for an array of row indices
+
+    Returns:
+        A dictionary with "boolean_values", "patient_ids", "times" (the label prediction times),
+        "feature_rows" and "features"
+    """
+    labels = sorted(labels, key=lambda a: (a["patient_id"], a["prediction_time"]))
+
+    label_patient_ids = np.array([label["patient_id"] for label in labels], dtype=np.int64)
+    label_times = np.array([label["prediction_time"] for label in labels], dtype="datetime64[s]").view(np.int64)
+
+    times = np.asarray(feature_times).astype("datetime64[s]").view(np.int64)
+    patient_ids = np.asarray(patient_ids)
+
+    unique_patient_ids, patient_rank = np.unique(patient_ids, return_inverse=True)
+
+    label_rank = np.searchsorted(unique_patient_ids, label_patient_ids)
+    label_rank = np.minimum(label_rank, max(len(unique_patient_ids) - 1, 0))
+    has_patient = (len(unique_patient_ids) > 0) & (unique_patient_ids[label_rank] == label_patient_ids)
+    if not np.all(has_patient):
+        missing = labels[int(np.argmin(has_patient))]
+        raise ValueError(f"Missing features for label {missing}")
+
+    # Combine (patient, time) into a single sortable key so the lookup can be done with one searchsorted
+    min_time = min(times.min(initial=0), label_times.min(initial=0))
+    span = int(max(times.max(initial=0), label_times.max(initial=0)) - min_time) + 1
+    assert len(unique_patient_ids) * span < 2**62, "Time range is too large to combine with patient ids"
+
+    keys = patient_rank.astype(np.int64) * span + (times - min_time)
+    order = np.argsort(keys, kind="stable")
+    sorted_keys = keys[order]
+
+    label_keys = label_rank.astype(np.int64) * span + (label_times - min_time)
+    positions = np.searchsorted(sorted_keys, label_keys, side="right") - 1
+
+    valid = positions >= 0
+    valid[valid] = patient_rank[order[positions[valid]]] == label_rank[valid]
+    if not np.all(valid):
+        missing = labels[int(np.argmin(valid))]
+        raise ValueError(f"Missing features for label {missing}")
+
+    rows = order[positions]
+
+    return {
+        "boolean_values": np.array([label.get("boolean_value") for label in labels]),
+        "patient_ids": label_patient_ids,
+        "times": label_times.view("datetime64[s]"),
+        "feature_rows": rows,
+        "features": get_features(rows),
+    }
+
+
+def load_representations(path: str) -> RepresentationReader:
+    """Open a directory of representations written by compute_features(..., output_path=path)."""
+    return RepresentationReader(path)
+
+
+def _get_arrays(representations: Union[Mapping[str, np.ndarray], RepresentationReader]) -> Mapping[str, np.ndarray]:
+    if isinstance(representations, RepresentationReader):
+        return {
+            "patient_ids": np.asarray(representations.patient_ids),
+            "feature_times": np.asarray(representations.feature_times),
+            "features": representations.get_features(slice(None)),
+        }
+    else:
+        return representations
+
+
+def compare_representations(
+    reference: Union[Mapping[str, np.ndarray], RepresentationReader],
+    candidate: Union[Mapping[str, np.ndarray], RepresentationReader],
+) -> Dict[str, float]:
+    """Measure how far candidate representations drift from reference ones, such as after quantization.
+
+    Both inputs are outputs of compute_features for the same labels. They are aligned by patient id and feature time,
+    as batches are shuffled differently on every run.
+
+    Returns:
+        A dictionary with the max and mean absolute error, the relative error of the whole feature matrix
+        and the mean and min cosine similarity between matching rows
+    """
+    reference = _get_arrays(reference)
+    candidate = _get_arrays(candidate)
+
+    assert len(reference["patient_ids"]) == len(candidate["patient_ids"]), "Representations cover different labels"
+
+    def sorted_features(r):
+        order = np.lexsort((np.asarray(r["feature_times"]).view(np.int64), r["patient_ids"]))
+        return r["patient_ids"][order], np.asarray(r["feature_times"])[order], r["features"][order].astype(np.float32)
+
+    reference_ids, reference_times, reference_features = sorted_features(reference)
+    candidate_ids, candidate_times, candidate_features = sorted_features(candidate)
+
+    assert np.array_equal(reference_ids, candidate_ids), "Representations cover different patients"
+    assert np.array_equal(reference_times, candidate_times), "Representations cover different times"
+
+    error = np.abs(reference_features - candidate_features)
+
+    reference_norms = np.linalg.norm(reference_features, axis=-1)
+    candidate_norms = np.linalg.norm(candidate_features, axis=-1)
+    cosine = np.sum(reference_features * candidate_features, axis=-1) / np.maximum(
+        reference_norms * candidate_norms, np.finfo(np.float32).tiny
+    )
+
+    return {
+        "max_abs_error": float(error.max(initial=0)),
+        "mean_abs_error": float(error.mean()) if error.size > 0 else 0.0,
+        "relative_error": float(np.linalg.norm(error) / max(float(np.linalg.norm(reference_features)), 1e-30)),
+        "mean_cosine_similarity": float(cosine.mean()) if cosine.size > 0 else 1.0,
+        "min_cosine_similarity": float(cosine.min(initial=1.0)),
+    }
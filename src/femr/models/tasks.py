@@ -51,6 +51,13 @@ class Task(abc.ABC):
     def cleanup(self, batch: Mapping[str, torch.Tensor]) -> Mapping[str, torch.Tensor]:
         return batch
 
+    def get_window_overlap(self) -> Optional[int]:
+        """Tasks that label (nearly) every token can return a number of tokens here.
+
+        Patients are then covered by windows that overlap by that many tokens, instead of by one window per label.
+        """
+        return None
+
 
 class LabeledPatientTask(Task):
     def __init__(self, labels: Sequence[meds.Label]):
@@ -124,14 +131,99 @@ class LabeledPatientTask(Task):
         return {}
 
 
+class TimelineTask(Task):
+    """Label every position of every patient timeline, so representations can be reused across label sets.
+
+    With granularity "token", the last token at every distinct time is labeled.
+    Tokens that share a time are collapsed as a label can only ever resolve to the last of them.
+    With granularity "day", only the last token of every day is labeled.
+    """
+
+    def __init__(self, granularity: str = "token", window_overlap: int = 0):
+        super().__init__()
+        assert granularity in ("token", "day"), f"Unknown timeline granularity {granularity}"
+        self.granularity = granularity
+        self.window_overlap = window_overlap
+
+    def get_task_config(self) -> femr.models.config.FEMRTaskConfig:
+        return femr.models.config.FEMRTaskConfig(task_type="labeled_patients")
+
+    def get_window_overlap(self) -> Optional[int]:
+        return self.window_overlap
+
+    def start_patient(self, _patient: meds.Patient, _ontology: Optional[femr.ontology.Ontology]) -> None:
+        pass
+
+    def needs_exact(self) -> bool:
+        return True
+
+    def start_batch(self) -> None:
+        """TimelineTask has no per label state."""
+        pass
+
+    def add_patient_labels(self, _patient_label_offsets: List[int]) -> None:
+        """As there is no per label state, this is ignored"""
+        pass
+
+    def add_event(
+        self,
+        current_date: datetime.datetime,
+        next_date: Optional[datetime.datetime],
+        next_features: Optional[Sequence[int]] = None,
+    ) -> int:
+        if next_date is None:
+            return 1
+
+        if self.granularity == "token":
+            return 1 if current_date != next_date else 0
+        else:
+            return 1 if current_date.date() != next_date.date() else 0
+
+    def get_batch_data(self) -> Mapping[str, np.ndarray]:
+        return {}
+
+
 class CLMBRTask(Task):
-    def __init__(self, clmbr_vocab_size: int):
+    @classmethod
+    def with_adaptive_softmax(
+        cls,
+        tokenizer: femr.models.tokenizer.FEMRTokenizer,
+        clmbr_vocab_size: int,
+        weight_fractions: Sequence[float] = (0.8, 0.95),
+    ) -> CLMBRTask:
+        """Create a CLMBR task that trains with an adaptive softmax.
+
+        The tokenizer vocabulary is sorted by weight, so token ids are already ordered from frequent to rare.
+        Clusters are cut where the cumulative absolute weight of the vocabulary reaches each of weight_fractions.
+        If no cluster would contain any tokens, such as for tiny vocabularies, the full softmax is used instead.
+        """
+        weights = np.abs([entry["weight"] for entry in tokenizer.dictionary["vocab"][:clmbr_vocab_size]])
+        cumulative = np.cumsum(weights) / weights.sum()
+
+        cutoffs: List[int] = []
+        for fraction in weight_fractions:
+            cutoff = int(np.searchsorted(cumulative, fraction)) + 1
+            if (len(cutoffs) == 0 or cutoff > cutoffs[-1]) and cutoff < clmbr_vocab_size:
+                cutoffs.append(cutoff)
+
+        # An adaptive softmax needs at least one cutoff, otherwise the task falls back to the full softmax
+        return cls(clmbr_vocab_size, adaptive_cutoffs=cutoffs if cutoffs else None)
+
+    def __init__(self, clmbr_vocab_size: int, adaptive_cutoffs: Optional[List[int]] = None):
+        """A CLMBR next code prediction task.
+
+        Arguments:
+            clmbr_vocab_size: The number of tokens to predict, which are the first tokens of the vocabulary
+            adaptive_cutoffs: If provided, CLMBRTaskHead trains with an adaptive softmax with these cluster cutoffs
+        """
         self.clmbr_vocab_size = clmbr_vocab_size
+        self.adaptive_cutoffs = adaptive_cutoffs
 
     def get_task_config(self) -> femr.models.config.FEMRTaskConfig:
-        return femr.models.config.FEMRTaskConfig(
-            task_type="clmbr", task_kwargs=dict(clmbr_vocab_size=self.clmbr_vocab_size)
-        )
+        task_kwargs: Dict[str, Any] = dict(clmbr_vocab_size=self.clmbr_vocab_size)
+        if self.adaptive_cutoffs is not None:
+            task_kwargs["adaptive_cutoffs"] = self.adaptive_cutoffs
+        return femr.models.config.FEMRTaskConfig(task_type="clmbr", task_kwargs=task_kwargs)
 
     def start_patient(self, _patient: meds.Patient, _ontology: Optional[femr.ontology.Ontology]) -> None:
         self.per_patient_batch_labels: List[int] = []
@@ -220,15 +312,133 @@ class SurvivalCalculator:
         return (delta, {k: v[-1] - time for k, v in self.future_times.items()})
 
 
+class IndexedSurvivalCalculator:
+    """A SurvivalCalculator that works with task indices and returns sparse rows instead of dictionaries.
+
+    Task occurrences are precomputed into time sorted arrays, where every occurrence points to the next
+    occurrence of the same task. Each query then only updates the tasks that occurred since the previous query.
+    """
+
+    def __init__(
+        self,
+        ontology: femr.ontology.Ontology,
+        patient: meds.Patient,
+        task_to_index_map: Dict[str, int],
+        code_cache: Optional[Dict[str, List[int]]] = None,
+        add_missing_tasks: bool = False,
+    ):
+        """Create a calculator for a single patient.
+
+        Arguments:
+            ontology: The ontology used to map codes to their parents
+            patient: The patient, with events sorted by time
+            task_to_index_map: The index of every task code
+            code_cache: An optional dictionary from code to task indices, shared between patients
+                so that every code is only expanded with the ontology once
+            add_missing_tasks: Whether to treat every code as a task, adding unknown codes to task_to_index_map
+        """
+        if code_cache is None:
+            code_cache = {}
+
+        self.start_date = patient["events"][0]["time"]
+        self.final_date = patient["events"][-1]["time"]
+
+        occurrence_seconds = []
+        occurrence_tasks = []
+
+        for event in patient["events"]:
+            tasks = set()
+            for measurement in event["measurements"]:
+                code_tasks = code_cache.get(measurement["code"])
+                if code_tasks is None:
+                    code_tasks = []
+                    for parent in ontology.get_all_parents(measurement["code"]):
+                        if parent not in task_to_index_map and add_missing_tasks:
+                            task_to_index_map[parent] = len(task_to_index_map)
+                        if parent in task_to_index_map:
+                            code_tasks.append(task_to_index_map[parent])
+                    code_cache[measurement["code"]] = code_tasks
+                tasks.update(code_tasks)
+
+            if len(tasks) > 0:
+                seconds = (event["time"] - self.start_date).total_seconds()
+                for task in tasks:
+                    occurrence_seconds.append(seconds)
+                    occurrence_tasks.append(task)
+
+        # Intern the tasks of this patient, so the per patient state only covers tasks that actually occur
+        self.task_indices, local_tasks = np.unique(np.array(occurrence_tasks, dtype=np.int64), return_inverse=True)
+        self.occurrence_seconds = np.array(occurrence_seconds, dtype=np.float64)
+        self.occurrence_tasks = local_tasks
+
+        num_occurrences = len(self.occurrence_seconds)
+
+        # Sorting by task keeps the occurrences of each task in time order
+        order = np.argsort(local_tasks, kind="stable")
+        is_same_task = local_tasks[order[1:]] == local_tasks[order[:-1]]
+
+        self.next_occurrence = np.full(num_occurrences, num_occurrences, dtype=np.int64)
+        self.next_occurrence[order[:-1][is_same_task]] = order[1:][is_same_task]
+
+        # The time of the next occurrence of every task, with one trailing infinite entry for "no next occurrence"
+        self.next_occurrence_seconds = np.append(self.occurrence_seconds, np.inf)
+
+        first_occurrences = order[np.concatenate(([True], ~is_same_task))] if num_occurrences > 0 else order
+        self.next_seconds = np.full(len(self.task_indices), np.inf)
+        self.next_seconds[local_tasks[first_occurrences]] = self.occurrence_seconds[first_occurrences]
+
+        self.position = 0
+
+    def get_future_events_for_time(self, time: datetime.datetime) -> Tuple[float, np.ndarray, np.ndarray]:
+        """Get the censor time and the time until the next occurrence of every task after the given time.
+
+        Times must not decrease between calls.
+
+        Returns:
+            The censor time in seconds, the task indices of the future events and the seconds until each of them
+        """
+        seconds = (time - self.start_date).total_seconds()
+        end = np.searchsorted(self.occurrence_seconds, seconds, side="right")
+
+        if end > self.position:
+            passed = np.arange(self.position, end)
+            next_occurrence = self.next_occurrence[passed]
+
+            # Only the last passed occurrence of each task points beyond end
+            is_last = next_occurrence >= end
+            self.next_seconds[self.occurrence_tasks[passed[is_last]]] = self.next_occurrence_seconds[
+                next_occurrence[is_last]
+            ]
+
+            self.position = end
+
+        censor_seconds = (self.final_date - time).total_seconds()
+
+        future = np.flatnonzero(self.next_seconds != np.inf)
+        return censor_seconds, self.task_indices[future], self.next_seconds[future] - seconds
+
+
 def _prefit_motor_map(batch, *, tasks: List[str], ontology: femr.ontology.Ontology) -> Any:
-    task_time_stats: List[Any] = [[0, 0, femr.stat_utils.OnlineStatistics()] for _ in range(len(tasks))]
     event_times = femr.stat_utils.ReservoirSampler(100_000)
-    task_set = set(tasks)
+    task_to_index_map = {task: i for i, task in enumerate(tasks)}
+    code_cache: Dict[str, List[int]] = {}
+
+    # Every prediction time is censored for all tasks except those with an event, so the per task statistics
+    # are accumulated as totals over all prediction times, corrected for the sparse event entries.
+    # The totals are relative to the first censor time, so the variances do not cancel catastrophically.
+    num_predictions = 0
+    shift = 0.0
+    censor_sum = 0.0
+    censor_square_sum = 0.0
+
+    num_events = np.zeros(len(tasks), dtype=np.int64)
+    correction_sum = np.zeros(len(tasks), dtype=np.float64)
+    correction_square_sum = np.zeros(len(tasks), dtype=np.float64)
 
     for patient_id, events in zip(batch["patient_id"], batch["events"]):
         patient = {"patient_id": patient_id, "events": events}
 
-        calculator = SurvivalCalculator(ontology, patient, task_set)
+        calculator = IndexedSurvivalCalculator(ontology, patient, task_to_index_map, code_cache)
 
         birth = femr.pat_utils.get_patient_birthdate(patient)
 
@@ -236,22 +446,36 @@ def _prefit_motor_map(batch, *, tasks: List[str], ontology: femr.ontology.Ontolo
             if (event["time"] - birth).days <= 1:
                 continue
             if should_make_survival_prediction(event["time"], next_event["time"]):
-                censor_time, tte = calculator.get_future_events_for_time(event["time"])
-
-                for i, task in enumerate(tasks):
-                    if task in tte:
-                        time = tte[task]
-                        is_censored = False
-                    else:
-                        time = censor_time
-                        is_censored = True
-
-                    if is_censored:
-                        task_time_stats[i][0] += 1
-                    else:
-                        event_times.add(time.total_seconds(), 1)
-                        task_time_stats[i][1] += 1
-                    task_time_stats[i][2].add(1, time.total_seconds())
+                censor_seconds, task_indices, event_seconds = calculator.get_future_events_for_time(event["time"])
+
+                if num_predictions == 0:
+                    shift = censor_seconds
+                shifted_censor = censor_seconds - shift
+                shifted_events = event_seconds - shift
+
+                num_predictions += 1
+                censor_sum += shifted_censor
+                censor_square_sum += shifted_censor**2
+
+                num_events[task_indices] += 1
+                correction_sum[task_indices] += shifted_events - shifted_censor
+                correction_square_sum[task_indices] += shifted_events**2 - shifted_censor**2
+
+                for seconds in event_seconds:
+                    event_times.add(seconds, 1)
+
+    task_time_stats: List[Any] = []
+    for i in range(len(tasks)):
+        time_stats = femr.stat_utils.OnlineStatistics()
+        if num_predictions > 0:
+            shifted_mean = float((censor_sum + correction_sum[i]) / num_predictions)
+            time_stats.count = num_predictions
+            time_stats.current_mean = shift + shifted_mean
+            time_stats.variance = max(
+                float(censor_square_sum + correction_square_sum[i]) - num_predictions * shifted_mean**2, 0
+            )
+
+        task_time_stats.append([num_predictions - int(num_events[i]), int(num_events[i]), time_stats])
 
     return (event_times, task_time_stats)
 
@@ -265,6 +489,39 @@ def _prefit_motor_agg(first: Any, second: Any) -> Any:
     return first
 
 
+def get_motor_tasks(tokenizer: femr.models.tokenizer.FEMRTokenizer, num_tasks: int) -> List[str]:
+    """Use the most informative codes in the tokenizer vocabulary as MOTOR pretraining tasks."""
+    tasks = []
+    for dict_entry in tokenizer.dictionary["vocab"]:
+        if dict_entry["type"] == "code":
+            tasks.append(dict_entry["code_string"])
+            if len(tasks) == num_tasks:
+                break
+
+    assert len(tasks) == num_tasks, "Could not find enough tasks in the provided tokenizer"
+
+    return tasks
+
+
+def get_motor_task_info(tasks: List[str], stats: List[Any]) -> List[Tuple[str, float]]:
+    """Compute the base event rate of every task from its censored count, event count and time statistics."""
+    task_data = []
+
+    for task, task_stats in zip(tasks, stats):
+        frac_events = task_stats[1] / (task_stats[0] + task_stats[1])
+        rate = frac_events / task_stats[2].mean()
+        task_data.append((task, rate))
+
+    return task_data
+
+
+def finalize_time_bins(time_bins: np.ndarray) -> List[float]:
+    """Turn percentiles of the event times into time bins that cover all times."""
+    time_bins[0] = 0
+    time_bins[-1] = float("inf")
+    return list(time_bins)
+
+
 class MOTORTask(Task):
     @classmethod
     def fit_pretraining_task_info(
@@ -276,14 +533,7 @@ class MOTORTask(Task):
         final_layer_size: int,
         num_proc: int = 1,
     ) -> MOTORTask:
-        tasks = []
-        for dict_entry in tokenizer.dictionary["vocab"]:
-            if dict_entry["type"] == "code":
-                tasks.append(dict_entry["code_string"])
-                if len(tasks) == num_tasks:
-                    break
-
-        assert len(tasks) == num_tasks, "Could not find enough tasks in the provided tokenizer"
+        tasks = get_motor_tasks(tokenizer, num_tasks)
 
         length_samples, stats = femr.hf_utils.aggregate_over_dataset(
             dataset,
@@ -291,26 +541,34 @@ class MOTORTask(Task):
             _prefit_motor_agg,
             1_000,
             num_proc=num_proc,
+            stage="MOTORTask.fit_pretraining_task_info",
         )
 
         time_bins = np.percentile(length_samples.samples, np.linspace(0, 100, num_bins + 1))
-        time_bins[0] = 0
-        time_bins[-1] = float("inf")
-        time_bins = list(time_bins)
-
-        task_data = []
 
-        for task, task_stats in zip(tasks, stats):
-            frac_events = task_stats[1] / (task_stats[0] + task_stats[1])
-            rate = frac_events / task_stats[2].mean()
-            task_data.append((task, rate))
+        return MOTORTask(get_motor_task_info(tasks, stats), finalize_time_bins(time_bins), final_layer_size)
 
-        return MOTORTask(task_data, time_bins, final_layer_size)
-
-    def __init__(self, pretraining_task_info: List[Tuple[str, float]], time_bins: List[float], final_layer_size: int):
+    def __init__(
+        self,
+        pretraining_task_info: List[Tuple[str, float]],
+        time_bins: List[float],
+        final_layer_size: int,
+        sparse_loss: bool = True,
+    ):
+        """A MOTOR pretraining task.
+
+        Arguments:
+            pretraining_task_info: The code and the base event rate of every pretraining task
+            time_bins: The boundaries of the piecewise exponential time bins
+            final_layer_size: The size of the per time bin representation in MOTORTaskHead
+            sparse_loss: Whether batches contain censor times and sparse event times, which MOTORTaskHead uses to
+                compute the loss without dense (indices x time bins x tasks) tensors.
+                If False, batches contain the dense log_time and is_event tensors instead.
+        """
         self.pretraining_task_info = pretraining_task_info
         self.time_bins = time_bins
         self.final_layer_size = final_layer_size
+        self.sparse_loss = sparse_loss
 
         self.pretraining_task_codes = set()
         self.task_to_index_map = {}
@@ -318,6 +576,9 @@ class MOTORTask(Task):
             self.pretraining_task_codes.add(task[0])
             self.task_to_index_map[task[0]] = i
 
+        # Maps codes to task indices, shared between patients to avoid repeated ontology lookups
+        self.code_cache: Dict[str, List[int]] = {}
+
     def get_task_config(self) -> femr.models.config.FEMRTaskConfig:
         return femr.models.config.FEMRTaskConfig(
             task_type="motor",
@@ -330,7 +591,7 @@ class MOTORTask(Task):
 
     def start_patient(self, patient: meds.Patient, ontology: Optional[femr.ontology.Ontology]) -> None:
         assert ontology
-        self.calculator = SurvivalCalculator(ontology, patient, self.pretraining_task_codes)
+        self.calculator = IndexedSurvivalCalculator(ontology, patient, self.task_to_index_map, self.code_cache)
 
         self.per_patient_censor_time: List[float] = []
         self.per_patient_time_sparse: Dict[str, List[float]] = {
@@ -372,21 +633,15 @@ class MOTORTask(Task):
         if not should_make_survival_prediction(current_date, next_date):
             return 0
 
-        censor_time, tte = self.calculator.get_future_events_for_time(current_date)
+        censor_seconds, task_indices, event_seconds = self.calculator.get_future_events_for_time(current_date)
 
-        if len(tte) == 0:
+        if len(task_indices) == 0:
             return 0
 
-        censor_seconds = censor_time.total_seconds()
         self.per_patient_censor_time.append(censor_seconds)
 
-        for event_name, time in tte.items():
-            j = self.task_to_index_map[event_name]
-            seconds = time.total_seconds()
-
-            self.per_patient_time_sparse["data"].append(seconds)
-            self.per_patient_time_sparse["indices"].append(j)
-
+        self.per_patient_time_sparse["data"].extend(event_seconds.tolist())
+        self.per_patient_time_sparse["indices"].extend(task_indices.tolist())
         self.per_patient_time_sparse["indptr"].append(len(self.per_patient_time_sparse["data"]))
 
         return 1
@@ -405,38 +660,53 @@ class MOTORTask(Task):
         }
 
     def cleanup(self, batch: Mapping[str, torch.Tensor]) -> Mapping[str, torch.Tensor]:
-        num_time_bins = len(self.time_bins) - 1
-        num_tasks = len(self.pretraining_task_info)
-        num_indices = len(batch["censor_time"])
+        if self.sparse_loss:
+            return self._cleanup_sparse(batch)
+        else:
+            return self._cleanup_dense(batch)
 
-        def h(a):
-            shape = (num_indices, num_tasks)
-            a = {k: v.numpy() for k, v in batch[a].items()}
-            s = scipy.sparse.csr_array((a["data"], a["indices"], a["indptr"]), shape=shape)
-            return torch.from_numpy(s.toarray())
+    def _cleanup_sparse(self, batch: Mapping[str, torch.Tensor]) -> Mapping[str, torch.Tensor]:
+        time_sparse = batch["time_sparse"]
 
-        time = h("time_sparse")
+        indptr = time_sparse["indptr"].to(torch.int64)
+        event_indices = torch.repeat_interleave(torch.arange(len(indptr) - 1), indptr[1:] - indptr[:-1])
+        event_tasks = time_sparse["indices"].to(torch.int64)
+        event_times = time_sparse["data"]
 
-        log_time = torch.zeros(size=(num_time_bins, num_indices, num_tasks), dtype=torch.float16)
-        is_event = torch.zeros(size=(num_time_bins, num_indices, num_tasks), dtype=torch.bool)
+        # Events at time zero are treated as censored, matching the dense formulation
+        is_event = event_times != 0
 
-        is_event_global = time != 0
+        return {
+            "censor_time": batch["censor_time"],
+            "event_indices": event_indices[is_event],
+            "event_tasks": event_tasks[is_event],
+            "event_times": event_times[is_event],
+        }
 
-        def inf_log(arr):
-            mask = arr != 0
-            arr[mask] = torch.log2(arr[mask])
-            arr[~mask] = -torch.inf
+    def _cleanup_dense(self, batch: Mapping[str, torch.Tensor]) -> Mapping[str, torch.Tensor]:
+        num_tasks = len(self.pretraining_task_info)
+        num_indices = len(batch["censor_time"])
+
+        a = {k: v.numpy() for k, v in batch["time_sparse"].items()}
+        time = scipy.sparse.csr_array((a["data"], a["indices"], a["indptr"]), shape=(num_indices, num_tasks)).toarray()
+        censor_time = batch["censor_time"].numpy()
 
-            return arr
+        # Everything is computed directly in the final (indices, time bins, tasks) layout
+        time_bins = np.array(self.time_bins, dtype=np.float32)
+        starts = time_bins[:-1].reshape(1, -1, 1)
+        ends = time_bins[1:].reshape(1, -1, 1)
 
-        for i, (start, end) in enumerate(zip(self.time_bins, self.time_bins[1:])):
-            censor_time_in_bin = torch.unsqueeze(torch.clip(batch["censor_time"] - start, 0, float(end - start)), -1)
-            event_time_in_bin = torch.clip(time - start, 0, float(end - start))
-            time_in_bin = torch.where(is_event_global, event_time_in_bin, censor_time_in_bin)
-            log_time[i, :] = inf_log(time_in_bin)
-            is_event[i, :] = is_event_global & (start <= time) & (time < end)
+        is_event_global = time != 0
+        end_time = np.where(is_event_global, time, censor_time.reshape(-1, 1)).reshape(num_indices, 1, num_tasks)
+
+        time_in_bin = np.clip(end_time - starts, 0, ends - starts)
+        with np.errstate(divide="ignore"):
+            # Zero time in a bin becomes -inf
+            log_time = torch.from_numpy(np.log2(time_in_bin).astype(np.float16))
 
-        log_time = torch.transpose(log_time, 0, 1).contiguous()
-        is_event = torch.transpose(is_event, 0, 1).contiguous()
+        time = time.reshape(num_indices, 1, num_tasks)
+        is_event = torch.from_numpy(
+            is_event_global.reshape(num_indices, 1, num_tasks) & (starts <= time) & (time < ends)
+        )
 
         return {"is_event": is_event, "log_time": log_time}
@@ -14,9 +14,12 @@ import numpy as np
 import transformers
 
 import femr.hf_utils
+import femr.shared
 import femr.stat_utils
+import femr.tracing
 
 
+@femr.tracing.traced()
 def train_tokenizer(
     dataset,
     vocab_size: int,
@@ -26,6 +29,7 @@ def train_tokenizer(
     num_proc: int = 1,
 ) -> FEMRTokenizer:
     """Train a FEMR tokenizer from the given dataset"""
+    femr.tracing.count("patients", len(dataset))
     statistics = femr.hf_utils.aggregate_over_dataset(
         dataset,
         functools.partial(
@@ -34,6 +38,7 @@ def train_tokenizer(
         agg_statistics,
         num_proc=num_proc,
         batch_size=1_000,
+        stage="train_tokenizer",
     )
     return FEMRTokenizer(
         convert_statistics_to_msgpack(statistics, vocab_size, is_hierarchical, num_numeric, ontology), ontology
@@ -260,7 +265,7 @@ def convert_statistics_to_msgpack(
     return result
 
 
-class FEMRTokenizer(transformers.utils.PushToHubMixin):
+class FEMRTokenizer(transformers.utils.PushToHubMixin, femr.shared.Shareable):
     def __init__(self, dictionary: Mapping[str, Any], ontology: Optional[femr.ontology.Ontology] = None):
         self.dictionary = dictionary
 
@@ -1,25 +1,31 @@
 from __future__ import annotations
 
 import collections
+import functools
 import math
-from typing import Any, Dict, List, Mapping, Optional, Tuple
+from typing import Any, Dict, List, Mapping, Optional, Tuple, Union
 
 import datasets
 import meds
 import numpy as np
 import torch
 import torch.nn.functional as F
+import torch.utils.checkpoint
 import transformers
 import xformers.ops
 from torch import nn
 from tqdm import tqdm
 
+import femr.memory
 import femr.models.config
 import femr.models.processor
+import femr.models.quantization
+import femr.models.representations
 import femr.models.rmsnorm
 import femr.models.tasks
 import femr.models.tokenizer
 import femr.models.xformers
+import femr.tracing
 
 
 # From https://github.com/kingoflolz/mesh-transformer-jax
@@ -72,6 +78,27 @@ def apply_rotary_pos_emb(x, sincos):
     return (x * cos) + (rotate_every_two_v2(x) * sin)
 
 
+def apply_rotary_pos_emb_(x, sincos):
+    """An in-place version of apply_rotary_pos_emb that only allocates a temporary for half of x.
+
+    As this overwrites x, it can only be used when no gradients are needed.
+    """
+    sin, cos = sincos
+
+    # fixed_pos_embedding repeats every value twice, once for each member of a rotated pair
+    sin = sin[..., ::2].to(dtype=x.dtype)
+    cos = cos[..., ::2].to(dtype=x.dtype)
+
+    x1 = x[..., ::2]
+    x2 = x[..., 1::2]
+    original_x1 = x1.clone()
+
+    x1.mul_(cos).addcmul_(x2, sin, value=-1)
+    x2.mul_(cos).addcmul_(original_x1, sin)
+
+    return x
+
+
 class FEMREncoderLayer(nn.Module):
     def __init__(self, config: femr.models.config.FEMRTransformerConfig):
         super().__init__()
@@ -82,35 +109,122 @@ class FEMREncoderLayer(nn.Module):
         else:
             hidden_mult = 1
 
+        self.head_size = self.config.hidden_size // self.config.n_heads
+        self.kv_size = self.config.n_kv_heads * self.head_size
+
         self.input_proj = nn.Linear(
             self.config.hidden_size,
-            self.config.hidden_size * 3 + hidden_mult * self.config.intermediate_size,
+            self.config.hidden_size + 2 * self.kv_size + hidden_mult * self.config.intermediate_size,
             bias=self.config.use_bias,
         )
         self.output_proj = nn.Linear(
             self.config.hidden_size + self.config.intermediate_size, self.config.hidden_size, bias=self.config.use_bias
         )
 
-    def forward(self, x, normed_ages, pos_embed, attn_bias):
-        x = self.norm(x)
+        # Lazily compiled versions of project and output, see FEMRTransformerConfig.layer_implementation
+        self._compiled_project = None
+        self._compiled_output = None
+
+        # Set by FEMRModel.gradient_checkpointing_enable, see FEMRTransformerConfig.checkpoint_blocks
+        self.gradient_checkpointing = False
+
+    def fused_norm_input_proj(self, x, normed_ages):
+        """Compute input_proj(norm(x)) without materializing the normalized x.
+
+        RMSNorm scales every row by a scalar, which commutes with the projection, and its weight is folded into the
+        projection weight. The normed age columns replace the normalized values, so they are projected separately.
+        """
+        weight = self.input_proj.weight * self.norm.weight.to(dtype=self.input_proj.weight.dtype)
+
+        variance = x.to(torch.float32).pow(2).mean(-1, keepdim=True)
+        scale = torch.rsqrt(variance + self.norm.variance_epsilon).to(dtype=x.dtype)
 
         if self.config.use_normed_ages:
-            x[:, -2] = normed_ages.to(dtype=x.dtype)
-            x[:, -1] = (normed_ages**2).to(dtype=x.dtype)
+            transformed = torch.mm(x[:, :-2], weight[:, :-2].t()) * scale
+            ages = torch.stack((normed_ages, normed_ages**2), dim=-1).to(dtype=x.dtype)
+            transformed = transformed.addmm_(ages, self.input_proj.weight[:, -2:].t())
+        else:
+            transformed = torch.mm(x, weight.t()) * scale
 
-        transformed = self.input_proj(x)
+        if self.input_proj.bias is not None:
+            transformed = transformed.add_(self.input_proj.bias)
 
-        ff = transformed[:, : -self.config.hidden_size * 3]
-        qkv = transformed[:, -self.config.hidden_size * 3 :]
+        return transformed
 
-        head_size = self.config.hidden_size // self.config.n_heads
+    def project(self, x, normed_ages, pos_embed, in_place_rotary: bool = False, fused_norm: bool = False):
+        """Compute the rotated queries and keys, the values and the feed forward input."""
+        if fused_norm and isinstance(self.input_proj, nn.Linear):
+            transformed = self.fused_norm_input_proj(x, normed_ages)
+        else:
+            # Quantized input projections don't expose a float weight to fold the norm into
+            x = self.norm(x)
+
+            if self.config.use_normed_ages:
+                x[:, -2] = normed_ages.to(dtype=x.dtype)
+                x[:, -1] = (normed_ages**2).to(dtype=x.dtype)
+
+            transformed = self.input_proj(x)
 
-        qkv = qkv.reshape(x.shape[0], 3, self.config.n_heads, head_size)
+        qkv_size = self.config.hidden_size + 2 * self.kv_size
 
-        q = apply_rotary_pos_emb(qkv[:, 0, :, :], pos_embed)
-        k = apply_rotary_pos_emb(qkv[:, 1, :, :], pos_embed)
-        v = qkv[:, 2, :, :]
+        ff = transformed[:, :-qkv_size]
+        qkv = transformed[:, -qkv_size:]
 
+        # With grouped query attention, keys and values have fewer heads than queries
+        q = qkv[:, : self.config.hidden_size].reshape(x.shape[0], self.config.n_heads, self.head_size)
+        k = qkv[:, self.config.hidden_size : -self.kv_size].reshape(x.shape[0], self.config.n_kv_heads, self.head_size)
+        v = qkv[:, -self.kv_size :].reshape(x.shape[0], self.config.n_kv_heads, self.head_size)
+
+        if in_place_rotary:
+            q = apply_rotary_pos_emb_(q, pos_embed)
+            k = apply_rotary_pos_emb_(k, pos_embed)
+        else:
+            q = apply_rotary_pos_emb(q, pos_embed)
+            k = apply_rotary_pos_emb(k, pos_embed)
+
+        return q, k, v, ff
+
+    def output(self, attn, ff, fused_concat: bool = False):
+        """Apply the feed forward activation and project the concatenated attention and feed forward outputs."""
+        if self.config.hidden_act == "gelu":
+            ff = F.gelu(ff)
+        elif self.config.hidden_act == "swiglu":
+            x1, x2 = ff.chunk(2, dim=-1)
+            ff = F.silu(x1) * x2
+
+        if fused_concat and isinstance(self.output_proj, nn.Linear):
+            # Project both halves separately and accumulate, instead of materializing the concatenation
+            weight = self.output_proj.weight
+            attn_weight = weight[:, : self.config.hidden_size].t()
+            ff_weight = weight[:, self.config.hidden_size :].t()
+            if self.output_proj.bias is not None:
+                result = torch.addmm(self.output_proj.bias, attn, attn_weight)
+            else:
+                result = torch.mm(attn, attn_weight)
+            return result.addmm_(ff, ff_weight)
+        else:
+            combined = torch.concatenate((attn, ff), axis=-1)
+            return self.output_proj(combined)
+
+    def _get_implementation(self):
+        if self.config.layer_implementation == "compiled":
+            if self._compiled_project is None:
+                # Dynamic shapes avoid recompiling for every new number of tokens in a batch
+                self._compiled_project = torch.compile(self.project, dynamic=True)
+                self._compiled_output = torch.compile(self.output, dynamic=True)
+            return self._compiled_project, self._compiled_output
+        else:
+            return self.project, self.output
+
+    def attention_block(self, x, normed_ages, pos_embed, attn_bias):
+        """Compute the attention output and the feed forward input."""
+        project, _ = self._get_implementation()
+
+        is_fused = self.config.layer_implementation == "fused"
+        in_place_rotary = is_fused and not torch.is_grad_enabled()
+        q, k, v, ff = project(x, normed_ages, pos_embed, in_place_rotary=in_place_rotary, fused_norm=is_fused)
+
+        # The attention call is excluded from compilation, so compiled layers break their graph around it
         attn = femr.models.xformers.memory_efficient_attention_wrapper(
             q.unsqueeze(0),
             k.unsqueeze(0),
@@ -120,16 +234,38 @@ class FEMREncoderLayer(nn.Module):
 
         attn = attn.reshape(x.shape)
 
-        if self.config.hidden_act == "gelu":
-            ff = F.gelu(ff)
-        elif self.config.hidden_act == "swiglu":
-            x1, x2 = ff.chunk(2, dim=-1)
-            ff = F.silu(x1) * x2
+        return attn, ff
 
-        combined = torch.concatenate((attn, ff), axis=-1)
-        result = self.output_proj(combined)
+    def feed_forward_block(self, attn, ff):
+        """Compute the final layer output from the attention output and the feed forward input."""
+        _, output = self._get_implementation()
+        return output(attn, ff, fused_concat=self.config.layer_implementation == "fused")
 
-        return result
+    def _forward(self, x, normed_ages, pos_embed, attn_bias):
+        attn, ff = self.attention_block(x, normed_ages, pos_embed, attn_bias)
+        return self.feed_forward_block(attn, ff)
+
+    def forward(self, x, normed_ages, pos_embed, attn_bias):
+        if not (self.gradient_checkpointing and self.training):
+            return self._forward(x, normed_ages, pos_embed, attn_bias)
+
+        # Set by gradient_checkpointing_enable, but layers can also be enabled directly
+        checkpoint = getattr(self, "_gradient_checkpointing_func", None)
+        if checkpoint is None:
+            checkpoint = functools.partial(torch.utils.checkpoint.checkpoint, use_reentrant=False)
+        blocks = self.config.checkpoint_blocks
+
+        if blocks == "layer":
+            # Only the layer input is saved, everything else is recomputed during the backward pass
+            return checkpoint(self._forward, x, normed_ages, pos_embed, attn_bias)
+        elif blocks == "attention":
+            attn, ff = checkpoint(self.attention_block, x, normed_ages, pos_embed, attn_bias)
+            return self.feed_forward_block(attn, ff)
+        elif blocks == "feed_forward":
+            attn, ff = self.attention_block(x, normed_ages, pos_embed, attn_bias)
+            return checkpoint(self.feed_forward_block, attn, ff)
+        else:
+            raise RuntimeError("Unknown checkpoint blocks " + blocks)
 
 
 class FEMRTransformer(nn.Module):
@@ -156,7 +292,9 @@ class FEMRTransformer(nn.Module):
         if not self.config.is_hierarchical:
             x = self.embed(batch["tokens"])
         else:
-            x = self.embed_bag(batch["hierarchical_tokens"], batch["token_indices"], batch["hierarchical_weights"])
+            # The weights have to match the dtype of the model, which is bfloat16 for reduced precision inference
+            weights = batch["hierarchical_weights"].to(self.in_norm.weight.dtype)
+            x = self.embed_bag(batch["hierarchical_tokens"], batch["token_indices"], weights)
 
         x = self.in_norm(x)
         normed_ages = batch["normalized_ages"]
@@ -183,14 +321,32 @@ class LabeledPatientTaskHead(nn.Module):
 
 
 class CLMBRTaskHead(nn.Module):
-    def __init__(self, hidden_size: int, clmbr_vocab_size: int):
+    def __init__(self, hidden_size: int, clmbr_vocab_size: int, adaptive_cutoffs: Optional[List[int]] = None):
         super().__init__()
 
-        self.final_layer = nn.Linear(hidden_size, clmbr_vocab_size)
+        self.use_adaptive_softmax = adaptive_cutoffs is not None
+
+        if not self.use_adaptive_softmax:
+            self.final_layer = nn.Linear(hidden_size, clmbr_vocab_size)
+        else:
+            # Rare tokens are projected to smaller dimensions, so most of the vocabulary is cheap to train
+            self.adaptive_softmax = nn.AdaptiveLogSoftmaxWithLoss(hidden_size, clmbr_vocab_size, adaptive_cutoffs)
 
     def forward(self, features: torch.Tensor, batch: Mapping[str, torch.Tensor], return_logits=False):
-        logits = self.final_layer(features)
         labels = batch["labels"]
+
+        if self.use_adaptive_softmax:
+            # The adaptive softmax requires int64 targets
+            loss = self.adaptive_softmax(features, labels.to(torch.int64)).loss
+            if return_logits:
+                # The full softmax is only computed when needed, such as for evaluation
+                logits = self.adaptive_softmax.log_prob(features)
+            else:
+                logits = None
+
+            return loss, {"logits": logits}
+
+        logits = self.final_layer(features)
         loss = F.cross_entropy(logits, labels)
 
         if not return_logits:
@@ -219,6 +375,11 @@ class MOTORTaskHead(nn.Module):
         start_bias = torch.log2(torch.tensor([a[1] for a in pretraining_task_info], dtype=torch.float32))
         self.task_layer.bias.data = start_bias
 
+        # Not persistent as these are fully defined by the config
+        time_bins_tensor = torch.tensor(time_bins, dtype=torch.float32)
+        self.register_buffer("time_bin_starts", time_bins_tensor[:-1], persistent=False)
+        self.register_buffer("time_bin_widths", time_bins_tensor[1:] - time_bins_tensor[:-1], persistent=False)
+
     def forward(self, features: torch.Tensor, batch: Mapping[str, torch.Tensor], return_logits=False):
         time_independent_features = self.final_layer(features).reshape(
             features.shape[0], self.num_time_bins, self.final_layer_size
@@ -226,6 +387,57 @@ class MOTORTaskHead(nn.Module):
 
         time_dependent_logits = self.task_layer(time_independent_features)
 
+        if "log_time" in batch:
+            loss = self._dense_loss(time_dependent_logits, batch)
+        else:
+            loss = self._sparse_loss(time_dependent_logits, batch)
+
+        if not return_logits:
+            time_dependent_logits = None
+
+        return loss, {"time_dependent_logits": time_dependent_logits}
+
+    def _sparse_loss(self, time_dependent_logits: torch.Tensor, batch: Mapping[str, torch.Tensor]) -> torch.Tensor:
+        """Compute the same loss as _dense_loss from censor times and the sparse event times.
+
+        Every (index, task) pair is at risk until its censor time, except for the pairs with an event,
+        so the survival term is the dense censored term plus a correction for the sparse event entries.
+        """
+        num_elements = time_dependent_logits.numel()
+
+        censor_time_in_bin = torch.clip(
+            batch["censor_time"].unsqueeze(-1) - self.time_bin_starts,
+            torch.zeros_like(self.time_bin_widths),
+            self.time_bin_widths,
+        )
+
+        hazards = torch.exp2(time_dependent_logits)
+
+        survival = (hazards.sum(dim=-1) * censor_time_in_bin).sum()
+
+        event_indices = batch["event_indices"]
+        event_tasks = batch["event_tasks"]
+        event_times = batch["event_times"]
+
+        event_time_in_bin = torch.clip(
+            event_times.unsqueeze(-1) - self.time_bin_starts,
+            torch.zeros_like(self.time_bin_widths),
+            self.time_bin_widths,
+        )
+        event_hazards = hazards[event_indices, :, event_tasks]
+        survival = survival + (event_hazards * (event_time_in_bin - censor_time_in_bin[event_indices, :])).sum()
+
+        event_bins = torch.clip(
+            torch.searchsorted(self.time_bin_starts, event_times, right=True) - 1, 0, self.num_time_bins - 1
+        )
+        event_logits = time_dependent_logits[event_indices, event_bins, event_tasks]
+
+        survival_loss = survival / num_elements
+        event_loss = -math.log(2) * event_logits.sum() / num_elements
+
+        return survival_loss + event_loss
+
+    def _dense_loss(self, time_dependent_logits: torch.Tensor, batch: Mapping[str, torch.Tensor]) -> torch.Tensor:
         assert (
             batch["log_time"].shape == time_dependent_logits.shape
         ), f"{time_dependent_logits.shape} {batch['log_time'].shape}"
@@ -236,12 +448,7 @@ class MOTORTaskHead(nn.Module):
         survival_loss = torch.exp2(time_dependent_logits + batch["log_time"]).mean()
         event_loss = -math.log(2) * torch.where(batch["is_event"], time_dependent_logits, 0).mean()
 
-        loss = survival_loss + event_loss
-
-        if not return_logits:
-            time_dependent_logits = None
-
-        return loss, {"time_dependent_logits": time_dependent_logits}
+        return survival_loss + event_loss
 
 
 def remove_first_dimension(data: Any) -> Any:
@@ -261,6 +468,7 @@ def remove_first_dimension(data: Any) -> Any:
 
 class FEMRModel(transformers.PreTrainedModel):
     config_class = femr.models.config.FEMRModelConfig
+    supports_gradient_checkpointing = True
 
     def __init__(self, config: femr.models.config.FEMRModelConfig, **kwargs):
         # Allow the task config to be ovewritten
@@ -321,6 +529,222 @@ class FEMRModel(transformers.PreTrainedModel):
             return loss, result
 
 
+def convert_to_grouped_query_attention(model: FEMRModel, n_kv_heads: int) -> FEMRModel:
+    """Convert a model to grouped query attention by mean pooling the key and value heads of every layer.
+
+    Query heads are split into n_kv_heads contiguous groups, and each group shares the mean of its key and value
+    projections. This trades some accuracy for cheaper inference, and the model can be finetuned afterwards.
+    The model is modified in place.
+    """
+    config = model.config.transformer_config
+    assert (
+        config.n_kv_heads % n_kv_heads == 0
+    ), f"{config.n_kv_heads} key and value heads can't be pooled into {n_kv_heads} heads"
+
+    head_size = config.hidden_size // config.n_heads
+    old_kv_size = config.n_kv_heads * head_size
+    group_size = config.n_kv_heads // n_kv_heads
+
+    def pool(values: torch.Tensor) -> torch.Tensor:
+        pooled = values.reshape(n_kv_heads, group_size, head_size, *values.shape[1:]).mean(dim=1)
+        return pooled.reshape(n_kv_heads * head_size, *values.shape[1:])
+
+    def convert(values: torch.Tensor) -> torch.Tensor:
+        k_start = values.shape[0] - 2 * old_kv_size
+        return torch.concatenate(
+            (
+                values[:k_start],
+                pool(values[k_start : k_start + old_kv_size]),
+                pool(values[k_start + old_kv_size :]),
+            )
+        )
+
+    for layer in model.transformer.layers:
+        old_proj = layer.input_proj
+        new_weight = convert(old_proj.weight.data)
+
+        new_proj = nn.Linear(
+            old_proj.in_features,
+            new_weight.shape[0],
+            bias=old_proj.bias is not None,
+            device=new_weight.device,
+            dtype=new_weight.dtype,
+        )
+        new_proj.weight.data = new_weight
+        if old_proj.bias is not None:
+            new_proj.bias.data = convert(old_proj.bias.data)
+
+        layer.input_proj = new_proj
+        layer.kv_size = n_kv_heads * head_size
+
+    # The transformer config object is shared by every layer
+    config.n_kv_heads = n_kv_heads
+
+    return model
+
+
+def _move_to_device(data: Any, device: Optional[torch.device], non_blocking: bool = False) -> Any:
+    if isinstance(data, collections.abc.Mapping):
+        return {k: _move_to_device(v, device, non_blocking) for k, v in data.items()}
+    elif isinstance(data, torch.Tensor):
+        return data.to(device, non_blocking=non_blocking)
+    else:
+        return data
+
+
+def _compute_features_shard(
+    rank: int,
+    num_shards: int,
+    model_path: str,
+    task_config: femr.models.config.FEMRTaskConfig,
+    processor: femr.models.processor.FEMRBatchProcessor,
+    batches: datasets.Dataset,
+    batch_offsets: np.ndarray,
+    writer: femr.models.representations.RepresentationWriter,
+    device: Optional[torch.device],
+    num_loader_workers: int,
+    precision: str,
+    num_threads: Optional[int],
+) -> None:
+    """Run inference over one contiguous shard of the batches, writing results into the preallocated outputs.
+
+    This is used both in-process (with a single shard) and as the entry point of torch.multiprocessing.spawn.
+    """
+    if num_threads is not None:
+        torch.set_num_threads(num_threads)
+
+    model = FEMRModel.from_pretrained(model_path, task_config=task_config)
+    if precision == "int8":
+        model = femr.models.quantization.quantize_dynamic_int8(model)
+    elif precision == "bfloat16":
+        # Norm statistics, rotary embeddings and the attention softmax are still computed in float32
+        model = model.to(dtype=torch.bfloat16)
+    if device:
+        model = model.to(device)
+    model.eval()
+
+    is_cuda = device is not None and torch.device(device).type == "cuda"
+
+    shard = np.array_split(np.arange(len(batches)), num_shards)[rank]
+    loader = torch.utils.data.DataLoader(
+        torch.utils.data.Subset(batches, shard.tolist()),
+        batch_size=1,
+        shuffle=False,
+        collate_fn=processor.collate,
+        num_workers=num_loader_workers,
+        pin_memory=is_cuda,
+    )
+
+    def write(pending):
+        start, result, event = pending
+        if event is not None:
+            event.synchronize()
+        writer.write(start, result["patient_ids"], result["timestamps"], result["representations"])
+
+    # We keep the device -> host copy of the previous batch in flight while the next batch runs
+    pending = None
+    for batch_index, batch in zip(shard, tqdm(loader, total=len(shard), disable=rank != 0)):
+        batch = batch["batch"]
+        if device:
+            batch = _move_to_device(batch, device, non_blocking=is_cuda)
+
+        with torch.no_grad():
+            _, result = model(batch, return_reprs=True)
+
+        result = {
+            k: result[k].to("cpu", non_blocking=is_cuda) for k in ("patient_ids", "timestamps", "representations")
+        }
+
+        event = None
+        if is_cuda:
+            event = torch.cuda.Event()
+            event.record()
+
+        if pending is not None:
+            write(pending)
+        pending = (batch_offsets[batch_index], result, event)
+
+    if pending is not None:
+        write(pending)
+
+    writer.flush()
+
+
+def _compute_representations(
+    dataset: datasets.Dataset,
+    model_path: str,
+    config: femr.models.config.FEMRModelConfig,
+    processor: femr.models.processor.FEMRBatchProcessor,
+    task: femr.models.tasks.Task,
+    num_proc: int,
+    tokens_per_batch: int,
+    device: Optional[torch.device],
+    num_loader_workers: int,
+    num_inference_proc: int,
+    output_path: Optional[str],
+    output_dtype: str,
+    precision: str,
+    metadata: Optional[Mapping[str, Any]] = None,
+) -> Union[Dict[str, np.ndarray], femr.models.representations.RepresentationReader]:
+    """Run the model over every label of the task, writing the representations with a RepresentationWriter."""
+    is_cpu = device is None or torch.device(device).type == "cpu"
+    assert num_inference_proc == 1 or is_cpu, "Multiple inference processes are only supported on CPU"
+    assert precision in ("float32", "bfloat16", "int8"), f"Unknown inference precision {precision}"
+    assert precision != "int8" or is_cpu, "int8 inference is only supported on CPU"
+
+    batches = processor.convert_dataset(
+        dataset, tokens_per_batch=tokens_per_batch, min_patients_per_batch=1, num_proc=num_proc
+    )
+
+    # Every batch knows how many representations it produces, so the output can be allocated up front
+    num_indices = np.array(batches["num_indices"], dtype=np.int64)
+    batch_offsets = np.concatenate(([0], np.cumsum(num_indices)))
+    total = int(batch_offsets[-1])
+
+    if output_path is None:
+        # Without an output_path, the representations are held in memory
+        itemsize = 4 if output_dtype == "float32" else 2
+        femr.memory.record("representations", total * config.transformer_config.hidden_size * itemsize)
+    femr.memory.check("compute_features", context=f"before computing {total} representations")
+
+    batches.set_format("pt")
+
+    writer = femr.models.representations.RepresentationWriter(
+        total, config.transformer_config.hidden_size, dtype=output_dtype, path=output_path, metadata=metadata
+    )
+
+    shard_args = (
+        model_path,
+        task.get_task_config(),
+        processor,
+        batches,
+        batch_offsets,
+        writer,
+        device,
+        num_loader_workers,
+        precision,
+    )
+
+    with femr.tracing.span("inference") as span:
+        span.count("batches", len(batches))
+        span.count("representations", total)
+        if num_inference_proc == 1:
+            _compute_features_shard(0, 1, *shard_args, None)
+        else:
+            writer.share_memory()
+            num_threads = max(1, torch.get_num_threads() // num_inference_proc)
+            torch.multiprocessing.spawn(
+                _compute_features_shard,
+                args=(num_inference_proc, *shard_args, num_threads),
+                nprocs=num_inference_proc,
+                join=True,
+            )
+
+    with femr.tracing.span("write representations"):
+        return writer.finish()
+
+
+@femr.tracing.traced()
 def compute_features(
     dataset: datasets.Dataset,
     model_path: str,
@@ -329,7 +753,12 @@ def compute_features(
     tokens_per_batch: int = 1024,
     device: Optional[torch.device] = None,
     ontology: Optional[femr.ontology.Ontology] = None,
-) -> Dict[str, np.ndarray]:
+    num_loader_workers: int = 0,
+    num_inference_proc: int = 1,
+    output_path: Optional[str] = None,
+    output_dtype: str = "float32",
+    precision: str = "float32",
+) -> Union[Dict[str, np.ndarray], femr.models.representations.RepresentationReader]:
     """ "Compute features for a set of labels given a dataset and a model.
 
     Arguments:
@@ -340,54 +769,122 @@ def compute_features(
         tokens_per_batch: The maximum number of tokens per batch
         device: Which type of compute to use
         ontology: A FEMR ontology object, which is necessary for models that use a hierarchical tokenizer
+        num_loader_workers: The number of DataLoader workers used to collate batches ahead of the model
+        num_inference_proc: The number of CPU processes to shard inference over.
+            Values above one use torch.multiprocessing.spawn, so callers need an `if __name__ == "__main__"` guard.
+        output_path: If provided, representations are streamed into memory-mapped arrays in this directory
+        output_dtype: The storage type of the representations, one of "float32", "float16" or "bfloat16".
+            bfloat16 requires an output_path.
+        precision: "float32", "bfloat16" (which uses the bfloat16 matrix units of recent CPUs),
+            or "int8" for dynamically quantized CPU inference (see femr.models.quantization).
+            Use femr.models.representations.compare_representations to check the drift against float32.
 
     Returns:
         A dictionary of numpy arrays, with three keys, "patient_ids", "feature_times" and "features"
          -  "patient_ids" and "feature_times" define the patient and time each feature refers to
          -  "features" provides the representations at each patient id and feature time
+        If output_path is provided, a RepresentationReader over the written arrays is returned instead.
     """
+    femr.tracing.count("labels", len(labels))
     task = femr.models.tasks.LabeledPatientTask(labels)
 
     index = femr.index.PatientIndex(dataset, num_proc=num_proc)
 
-    model = femr.models.transformer.FEMRModel.from_pretrained(model_path, task_config=task.get_task_config())
+    config = femr.models.config.FEMRModelConfig.from_pretrained(model_path)
     tokenizer = femr.models.tokenizer.FEMRTokenizer.from_pretrained(model_path, ontology=ontology)
     processor = femr.models.processor.FEMRBatchProcessor(tokenizer, task=task)
 
     filtered_data = task.filter_dataset(dataset, index)
 
-    if device:
-        model = model.to(device)
-
-    batches = processor.convert_dataset(
-        filtered_data, tokens_per_batch=tokens_per_batch, min_patients_per_batch=1, num_proc=num_proc
+    return _compute_representations(
+        filtered_data,
+        model_path,
+        config,
+        processor,
+        task,
+        num_proc=num_proc,
+        tokens_per_batch=tokens_per_batch,
+        device=device,
+        num_loader_workers=num_loader_workers,
+        num_inference_proc=num_inference_proc,
+        output_path=output_path,
+        output_dtype=output_dtype,
+        precision=precision,
     )
 
-    batches.set_format("pt")
 
-    all_patient_ids = []
-    all_feature_times = []
-    all_representations = []
+@femr.tracing.traced()
+def compute_timeline_features(
+    dataset: datasets.Dataset,
+    model_path: str,
+    output_path: str,
+    granularity: str = "token",
+    window_overlap: Optional[int] = None,
+    num_proc: int = 1,
+    tokens_per_batch: int = 1024,
+    device: Optional[torch.device] = None,
+    ontology: Optional[femr.ontology.Ontology] = None,
+    num_loader_workers: int = 0,
+    num_inference_proc: int = 1,
+    output_dtype: str = "float32",
+    precision: str = "float32",
+) -> femr.models.representations.RepresentationReader:
+    """Compute and persist representations for every position of every patient timeline.
+
+    Any later label set can then be answered without running the model again,
+    using RepresentationReader.join_labels, which looks up the last stored position at or before each prediction time.
 
-    for batch in tqdm(batches, total=len(batches)):
-        batch = processor.collate([batch])["batch"]
+    Patients are covered by windows of tokens_per_batch tokens that overlap by window_overlap tokens,
+    so every position sees at least window_overlap tokens of history (or all of its history if shorter).
+    When window_overlap covers the model's receptive field, the representations match compute_features.
 
-        # Move to device
-        for key, val in batch.items():
-            if isinstance(val, torch.Tensor):
-                batch[key] = batch[key].to(device)
-        for key, val in batch["transformer"].items():
-            if isinstance(val, torch.Tensor):
-                batch["transformer"][key] = batch["transformer"][key].to(device)
+    Arguments:
+        dataset: A HuggingFace dataset containing MEDS patients
+        model_path: A path to a saved pretrained model, including a saved tokenizer
+        output_path: The directory to write the representations to
+        granularity: "token" for the last token at every distinct time, or "day" for the last token of every day.
+            With "day", labels resolve to the end of the last day that finished at or before their prediction time.
+        window_overlap: The number of tokens of history each window shares with the previous one.
+            Defaults to the model's receptive field, capped at half of tokens_per_batch.
+        num_proc: The number of processors to use
+        tokens_per_batch: The maximum number of tokens per batch
+        device: Which type of compute to use
+        ontology: A FEMR ontology object, which is necessary for models that use a hierarchical tokenizer
+        num_loader_workers: The number of DataLoader workers used to collate batches ahead of the model
+        num_inference_proc: The number of CPU processes to shard inference over
+        output_dtype: The storage type of the representations, one of "float32", "float16" or "bfloat16"
+        precision: The inference precision, see compute_features
 
-        with torch.no_grad():
-            _, result = model(batch, return_reprs=True)
-            all_patient_ids.append(result["patient_ids"].cpu().numpy())
-            all_feature_times.append(result["timestamps"].cpu().numpy())
-            all_representations.append(result["representations"].cpu().numpy())
-
-    return {
-        "patient_ids": np.concatenate(all_patient_ids),
-        "feature_times": np.concatenate(all_feature_times).astype("datetime64[s]"),
-        "features": np.concatenate(all_representations),
-    }
+    Returns:
+        A RepresentationReader over the written representations
+    """
+    config = femr.models.config.FEMRModelConfig.from_pretrained(model_path)
+
+    if window_overlap is None:
+        transformer_config = config.transformer_config
+        receptive_field = transformer_config.n_layers * (transformer_config.attention_width - 1)
+        window_overlap = min(receptive_field, tokens_per_batch // 2)
+
+    task = femr.models.tasks.TimelineTask(granularity=granularity, window_overlap=window_overlap)
+
+    tokenizer = femr.models.tokenizer.FEMRTokenizer.from_pretrained(model_path, ontology=ontology)
+    processor = femr.models.processor.FEMRBatchProcessor(tokenizer, task=task)
+
+    result = _compute_representations(
+        dataset,
+        model_path,
+        config,
+        processor,
+        task,
+        num_proc=num_proc,
+        tokens_per_batch=tokens_per_batch,
+        device=device,
+        num_loader_workers=num_loader_workers,
+        num_inference_proc=num_inference_proc,
+        output_path=output_path,
+        output_dtype=output_dtype,
+        precision=precision,
+        metadata={"granularity": granularity, "window_overlap": window_overlap, "model_path": str(model_path)},
+    )
+    assert isinstance(result, femr.models.representations.RepresentationReader)
+    return result
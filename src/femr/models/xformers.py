@@ -5,14 +5,16 @@ import xformers.ops
 
 
 def ref_attention(q, k, v, attn_bias=None, drop_mask=None, p=0.0, scale=None):
-    q = q.float()
-    k = k.float()
-    v = v.float()
+    # bfloat16 inputs keep their matrix multiplies in bfloat16, but the softmax is always computed in float32
+    compute_dtype = torch.bfloat16 if q.dtype == torch.bfloat16 else torch.float32
+    q = q.to(compute_dtype)
+    k = k.to(compute_dtype)
+    v = v.to(compute_dtype)
 
     scale = scale if scale is not None else (1 / q.shape[-1] ** 0.5)
     q = q * scale
 
-    attn = q @ k.transpose(-2, -1)
+    attn = (q @ k.transpose(-2, -1)).float()
     if attn_bias is not None:
         if isinstance(attn_bias, xformers.ops.AttentionBias):
             # Always create in B,H,Mq,Mk format
@@ -30,28 +32,53 @@ def ref_attention(q, k, v, attn_bias=None, drop_mask=None, p=0.0, scale=None):
     attn = attn.softmax(-1)
     if drop_mask is not None:
         attn = attn * (drop_mask / (1 - p))
-    return attn @ v
+    return attn.to(compute_dtype) @ v
 
 
 def ref_attention_bmhk(q, k, v, attn_bias, scale=None) -> torch.Tensor:
+    # k and v can have fewer heads than q, in which case each of them is shared by a contiguous group of q heads.
+    # The queries of a group are attended together, which broadcasts k and v over the group instead of copying them
     assert q.ndim == 4
+    batch_size, num_queries, n_heads, head_size = q.shape
+    n_kv_heads = k.shape[2]
+    group_size = n_heads // n_kv_heads
 
     def T(t):
         return t.permute((0, 2, 1, 3)).reshape([t.shape[0] * t.shape[2], t.shape[1], t.shape[3]])
 
+    grouped_q = (
+        q.reshape([batch_size, num_queries, n_kv_heads, group_size, head_size])
+        .permute((0, 2, 3, 1, 4))
+        .reshape([batch_size * n_kv_heads, group_size * num_queries, head_size])
+    )
+
     if isinstance(attn_bias, xformers.ops.AttentionBias):
         attn_bias = attn_bias.materialize(
-            (q.shape[0], q.shape[2], q.shape[1], k.shape[1]),
+            (batch_size, n_heads, num_queries, k.shape[1]),
             device=q.device,
             dtype=torch.float32,
-        ).reshape([q.shape[0] * q.shape[2], q.shape[1], k.shape[1]])
-    out = ref_attention(T(q), T(k), T(v), attn_bias, scale=scale)
-    out = out.reshape([q.shape[0], q.shape[2], q.shape[1], v.shape[3]])
-    return out.permute((0, 2, 1, 3))
+        ).reshape([batch_size * n_kv_heads, group_size * num_queries, k.shape[1]])
+    out = ref_attention(grouped_q, T(k), T(v), attn_bias, scale=scale)
+    out = out.reshape([batch_size, n_kv_heads, group_size, num_queries, v.shape[3]])
+    return out.permute((0, 3, 1, 2, 4)).reshape([batch_size, num_queries, n_heads, v.shape[3]])
 
 
+# xformers kernels can't be traced, so compiled code always calls this eagerly
+@torch.compiler.disable
 def memory_efficient_attention_wrapper(q, k, v, attn_bias):
+    # k and v can have fewer heads than q, in which case each of them is shared by a contiguous group of q heads
+    batch_size, num_tokens, n_heads, head_size = q.shape
+    n_kv_heads = k.shape[2]
+    group_size = n_heads // n_kv_heads
+
     if q.device.type == "cpu":
         return ref_attention_bmhk(q, k, v, attn_bias)
+    elif group_size != 1:
+        # The BMGHK format shares k and v across a group without copying them
+        q = q.reshape(batch_size, num_tokens, n_kv_heads, group_size, head_size)
+        k = k.unsqueeze(3).expand(batch_size, num_tokens, n_kv_heads, group_size, head_size)
+        v = v.unsqueeze(3).expand(batch_size, num_tokens, n_kv_heads, group_size, head_size)
+        result = xformers.ops.memory_efficient_attention(q, k, v, attn_bias)
+        return result.reshape(batch_size, num_tokens, n_heads, head_size)
     else:
         return xformers.ops.memory_efficient_attention(q, k, v, attn_bias)
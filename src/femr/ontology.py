@@ -10,6 +10,8 @@ import meds
 import polars as pl
 
 import femr.hf_utils
+import femr.shared
+import femr.tracing
 
 
 def _get_all_codes_map(batch) -> Set[str]:
@@ -26,7 +28,7 @@ def _get_all_codes_agg(first: Set[str], second: Set[str]) -> Set[str]:
     return first
 
 
-class Ontology:
+class Ontology(femr.shared.Shareable):
     def __init__(self, athena_path: str, code_metadata: meds.CodeMetadata = {}):
         """Create an Ontology from an Athena download and an optional meds Code Metadata structure.
 
@@ -104,6 +106,7 @@ class Ontology:
         self.all_parents_map: Dict[str, Set[str]] = {}
         self.all_children_map: Dict[str, Set[str]] = {}
 
+    @femr.tracing.traced()
     def prune_to_dataset(
         self,
         dataset: datasets.Dataset,
@@ -117,6 +120,7 @@ class Ontology:
             _get_all_codes_agg,
             num_proc=num_proc,
             batch_size=1_000,
+            stage="Ontology.prune_to_dataset",
         )
 
         if prune_all_descriptions:
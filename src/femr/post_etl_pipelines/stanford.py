@@ -1,50 +1,292 @@
 """An ETL script for doing an end to end transform of Stanford data into a PatientDatabase."""
 
 import argparse
-import functools
+import hashlib
 import json
+import multiprocessing
 import os
-from typing import Callable, Sequence
-
-import datasets
-import meds
-
-from femr.transforms import delta_encode, remove_nones
-from femr.transforms.stanford import (
-    move_billing_codes,
-    move_pre_birth,
-    move_to_day_end,
-    move_visit_start_to_first_event_start,
-    switch_to_icd10cm,
-)
-
-
-def _is_visit_measurement(e: meds.Measurement) -> bool:
-    return e["metadata"]["table"] == "visit"
-
-
-def _get_stanford_transformations() -> Callable[[meds.Patient], meds.Patient]:
-    """Get the list of current OMOP transformations."""
-    # All of these transformations are information preserving
-    transforms: Sequence[Callable[[meds.Patient], meds.Patient]] = [
-        move_pre_birth,
-        move_visit_start_to_first_event_start,
-        move_to_day_end,
-        switch_to_icd10cm,
-        move_billing_codes,
-        functools.partial(
-            remove_nones,  # We have to keep visits in order to sync up visit_ids later in the process
-            # If we ever remove or revisit visit_id, we would want to revisit this
-            do_not_apply_to_filter=_is_visit_measurement,
-        ),
-        functools.partial(
-            delta_encode,  # We have to keep visits in order to sync up visit_ids later in the process
-            # If we ever remove or revisit visit_id, we would want to revisit this
-            do_not_apply_to_filter=_is_visit_measurement,
-        ),
-    ]
+from typing import Any, Callable, Dict, List, Optional, Tuple
+
+import numpy as np
+import pyarrow as pa
+import pyarrow.compute as pc
+import pyarrow.parquet as pq
+
+import femr.index
+import femr.transforms.columnar
+import femr.transforms.stanford_columnar
+
+POST_ETL_NAME = "femr_stanford_omop_fixer"
+POST_ETL_VERSION = "0.1"
+
+# Output shards can have a parquet file with the content hash of each source patient, in the same order
+PATIENT_HASHES_DIR = "patient_hashes"
+
+
+def _get_stanford_transformations() -> Callable[[pa.Table], pa.Table]:
+    """Get the current OMOP transformations, which work on a table of patients."""
+    # All of these transformations are information preserving.
+    # This applies move_pre_birth, move_visit_start_to_first_event_start, move_to_day_end, switch_to_icd10cm,
+    # move_billing_codes, remove_nones and delta_encode to whole batches in the columnar layout.
+    # remove_nones and delta_encode skip visits in order to sync up visit_ids later in the process
+    return femr.transforms.stanford_columnar.apply_stanford_transforms
+
+
+_NULL_HASH = np.uint64(0x9E3779B97F4A7C15)
+
+
+def _mix(values: np.ndarray) -> np.ndarray:
+    """The splitmix64 hash of 64 bit integers, which spreads every input bit over the whole output."""
+    values = values.astype(np.uint64) + _NULL_HASH
+    values ^= values >> np.uint64(30)
+    values *= np.uint64(0xBF58476D1CE4E5B9)
+    values ^= values >> np.uint64(27)
+    values *= np.uint64(0x94D049BB133111EB)
+    values ^= values >> np.uint64(31)
+    return values
+
+
+def _hash_bytes(value: bytes) -> np.uint64:
+    return np.frombuffer(hashlib.blake2b(value, digest_size=8).digest(), dtype="<u8").astype(np.uint64)[0]
+
+
+def _hash_array(array: pa.Array, salt: np.uint64) -> np.ndarray:
+    """Get a 64 bit hash of every value of an Arrow array, which only depends on the value and the salt."""
+    if isinstance(array, pa.ChunkedArray):
+        array = array.combine_chunks()
+    if pa.types.is_dictionary(array.type):
+        array = array.cast(array.type.value_type)
+
+    if pa.types.is_null(array.type):
+        return np.full(len(array), _NULL_HASH, dtype=np.uint64)
+    elif pa.types.is_struct(array.type):
+        hashes = np.full(len(array), salt, dtype=np.uint64)
+        for field in array.type:
+            hashes = _mix(hashes ^ _hash_array(pc.struct_field(array, field.name), _hash_bytes(field.name.encode())))
+    elif any(
+        is_type(array.type)
+        for is_type in (pa.types.is_string, pa.types.is_large_string, pa.types.is_binary, pa.types.is_large_binary)
+    ):
+        # Every distinct value is hashed once
+        encoded = array.dictionary_encode()
+        value_hashes = np.array(
+            [
+                _hash_bytes(value if isinstance(value, bytes) else value.encode("utf8"))
+                for value in encoded.dictionary.to_pylist()
+            ],
+            dtype=np.uint64,
+        )
+        indices = pc.fill_null(encoded.indices, 0).to_numpy()
+        hashes = _mix(value_hashes[indices] ^ salt) if len(value_hashes) > 0 else np.zeros(len(array), np.uint64)
+    elif pa.types.is_floating(array.type):
+        values = pc.fill_null(array.cast(pa.float64()), 0).to_numpy()
+        hashes = _mix(values.view(np.uint64) ^ salt)
+    elif pa.types.is_integer(array.type) or pa.types.is_boolean(array.type) or pa.types.is_temporal(array.type):
+        if pa.types.is_temporal(array.type):
+            array = array.cast(pa.int64() if array.type.bit_width == 64 else pa.int32())
+        if not pa.types.is_unsigned_integer(array.type):
+            array = array.cast(pa.int64())
+        hashes = _mix(pc.fill_null(array, 0).to_numpy().astype(np.uint64) ^ salt)
+    else:
+        raise TypeError(f"Cannot hash a value of type {array.type}")
+
+    return np.where(array.is_null().to_numpy(zero_copy_only=False), _NULL_HASH, hashes)
+
+
+def _get_patient_hashes(patients: pa.Table) -> np.ndarray:
+    """Get a 64 bit hash of the content of every source patient, used to detect changed patients between runs.
+
+    The hash is computed from the columns of the flattened measurements, so patients are never converted to Python
+    objects. Every measurement is hashed together with the position of its event and its position in the patient,
+    and the hashes of the measurements of a patient are summed.
+    """
+    measurements = femr.transforms.columnar.flatten_patients(patients)
+    patient_indices = measurements.column("patient_index").to_numpy()
+
+    num_events = pc.fill_null(pc.list_value_length(patients.column("events")), 0).to_numpy()
+    first_events = np.cumsum(num_events) - num_events
+
+    event_positions = measurements.column("event_index").to_numpy() - first_events[patient_indices]
+    measurement_positions = np.arange(len(measurements)) - np.searchsorted(patient_indices, patient_indices)
+
+    hashes = _mix(_mix(event_positions) ^ measurement_positions.astype(np.uint64))
+    for name in measurements.column_names:
+        if name not in ("patient_index", "patient_id", "event_index"):
+            hashes = _mix(hashes ^ _hash_array(measurements.column(name), _hash_bytes(name.encode())))
+
+    patient_hashes = np.zeros(len(patients), dtype=np.uint64)
+    np.add.at(patient_hashes, patient_indices, hashes)
+
+    patient_hashes = _mix(patient_hashes ^ num_events.astype(np.uint64))
+    for name in patients.column_names:
+        if name != "events":
+            patient_hashes = _mix(patient_hashes ^ _hash_array(patients.column(name), _hash_bytes(name.encode())))
+    return patient_hashes
+
+
+class _PreviousRun:
+    """The output rows and patient hashes of a previous run, for the shards overlapping a range of patient ids."""
+
+    def __init__(self, path: str, schema: pa.Schema, min_patient_id: int, max_patient_id: int):
+        self.path = path
+        self.files: List[str] = []
+        self.row_groups: Dict[Tuple[int, int], pa.Table] = {}
+
+        patient_ids = []
+        patient_hashes = []
+        files = []
+        for shard in femr.index.read_shard_manifest(path)["shards"]:
+            if shard["num_patients"] == 0:
+                continue
+            if shard["max_patient_id"] < min_patient_id or shard["min_patient_id"] > max_patient_id:
+                continue
+            # Rows can only be copied between files with the same schema
+            if not pq.read_schema(os.path.join(path, "data", shard["file"])).equals(schema):
+                continue
+
+            hashes = pq.read_table(os.path.join(path, PATIENT_HASHES_DIR, shard["file"]))
+            if hashes.schema.field("patient_hash").type != pa.uint64():
+                # Hashes of an older version, which can't be compared
+                continue
+
+            patient_ids.append(hashes.column("patient_id").to_numpy())
+            patient_hashes.append(hashes.column("patient_hash").to_numpy())
+            files.append(np.full(len(hashes), len(self.files), dtype=np.int64))
+            self.files.append(shard["file"])
+
+        patient_ids.append(np.zeros(0, dtype=np.int64))
+        patient_hashes.append(np.zeros(0, dtype=np.uint64))
+        files.append(np.zeros(0, dtype=np.int64))
+
+        # Sorted by patient id for lookups, with the row of every patient within its file
+        rows = np.concatenate([np.arange(len(ids)) for ids in patient_ids])
+        order = np.argsort(np.concatenate(patient_ids), kind="stable")
+        self.patient_ids = np.concatenate(patient_ids)[order]
+        self.patient_hashes = np.concatenate(patient_hashes)[order]
+        self.locations = np.stack([np.concatenate(files), rows], axis=1)[order]
+
+    def find_unchanged(self, patient_ids: np.ndarray, patient_hashes: np.ndarray) -> np.ndarray:
+        """Get the file index and row of the previous output of every patient, or -1 if its source has changed."""
+        if len(self.patient_ids) == 0:
+            return np.full((len(patient_ids), 2), -1, dtype=np.int64)
+
+        positions = np.minimum(np.searchsorted(self.patient_ids, patient_ids), len(self.patient_ids) - 1)
+        is_unchanged = (self.patient_ids[positions] == patient_ids) & (self.patient_hashes[positions] == patient_hashes)
+        return np.where(is_unchanged[:, None], self.locations[positions], -1)
+
+    def take(self, locations: np.ndarray) -> pa.Table:
+        """Get the previous output rows at the given file index and row locations, in order.
+
+        Only the row groups that contain the rows are read. They are kept until the next call, as consecutive batches
+        of a shard usually need the same row groups.
+        """
+        tables = []
+        indices = np.zeros(len(locations), dtype=np.int64)
+        num_rows = 0
+        row_groups = {}
+
+        for file_index in np.unique(locations[:, 0]):
+            parquet_file = pq.ParquetFile(os.path.join(self.path, "data", self.files[file_index]))
+            row_group_sizes = [parquet_file.metadata.row_group(i).num_rows for i in range(parquet_file.num_row_groups)]
+            row_group_starts = np.cumsum(row_group_sizes) - row_group_sizes
+
+            is_in_file = locations[:, 0] == file_index
+            rows = locations[is_in_file, 1]
+            rows_row_groups = np.searchsorted(row_group_starts, rows, side="right") - 1
+
+            offsets = np.zeros(len(row_group_sizes), dtype=np.int64)
+            for row_group in np.unique(rows_row_groups):
+                key = (int(file_index), int(row_group))
+                if key not in self.row_groups:
+                    self.row_groups[key] = parquet_file.read_row_group(int(row_group))
+                row_groups[key] = self.row_groups[key]
 
-    return lambda patient: functools.reduce(lambda r, f: f(r), transforms, patient)
+                tables.append(row_groups[key])
+                offsets[row_group] = num_rows
+                num_rows += len(row_groups[key])
+
+            indices[is_in_file] = offsets[rows_row_groups] + rows - row_group_starts[rows_row_groups]
+
+        self.row_groups = row_groups
+        return pa.concat_tables(tables).take(pa.array(indices))
+
+
+def _process_shard(args: Tuple[str, str, int, Optional[str], bool]) -> Dict[str, Any]:
+    """Transform a single parquet shard, streaming it one row group at a time.
+
+    The output shard is written with the same file name into the data folder of the target dataset.
+    If a previous run is given, patients with unchanged source data are copied from its output instead of transformed.
+    Patient hashes are only computed for incremental runs, or if write_patient_hashes is set. They are written with the
+    same file name into the patient hashes folder, so the output can be the previous run of a later incremental run.
+    """
+    source_path, target_path, row_group_size, previous_path, write_patient_hashes = args
+
+    transform = _get_stanford_transformations()
+
+    source = pq.ParquetFile(source_path)
+    schema = source.schema_arrow
+
+    previous = None
+    if previous_path is not None:
+        source_patient_ids = source.read(columns=["patient_id"]).column("patient_id")
+        if len(source_patient_ids) > 0:
+            previous = _PreviousRun(
+                previous_path, schema, pc.min(source_patient_ids).as_py(), pc.max(source_patient_ids).as_py()
+            )
+
+    file = os.path.basename(source_path)
+    patient_ids: List[pa.Array] = []
+    patient_hashes: List[np.ndarray] = []
+    num_transformed = 0
+
+    with pq.ParquetWriter(os.path.join(target_path, "data", file), schema) as writer:
+        for batch in source.iter_batches(batch_size=row_group_size):
+            table = pa.Table.from_batches([batch])
+            patient_ids.append(batch.column("patient_id"))
+
+            if previous_path is None and not write_patient_hashes:
+                writer.write_table(transform(table), row_group_size=row_group_size)
+                num_transformed += len(table)
+                continue
+
+            batch_hashes = _get_patient_hashes(table)
+            patient_hashes.append(batch_hashes)
+
+            if previous is not None:
+                locations = previous.find_unchanged(batch.column("patient_id").to_numpy(), batch_hashes)
+            else:
+                locations = np.full((len(table), 2), -1, dtype=np.int64)
+
+            is_reused = locations[:, 0] != -1
+            transformed_positions = np.flatnonzero(~is_reused)
+            reused_positions = np.flatnonzero(is_reused)
+
+            table = transform(table.take(pa.array(transformed_positions)))
+            if len(reused_positions) > 0:
+                # Combine both parts and restore the source order of the patients
+                assert previous is not None
+                table = pa.concat_tables([table, previous.take(locations[reused_positions])])
+                table = table.take(pa.array(np.argsort(np.concatenate([transformed_positions, reused_positions]))))
+
+            writer.write_table(table, row_group_size=row_group_size)
+            num_transformed += len(transformed_positions)
+
+    all_patient_ids = pa.concat_arrays([pa.array([], type=pa.int64())] + [ids.cast(pa.int64()) for ids in patient_ids])
+
+    if previous_path is not None or write_patient_hashes:
+        all_patient_hashes = np.concatenate([np.zeros(0, dtype=np.uint64)] + patient_hashes)
+        pq.write_table(
+            pa.table({"patient_id": all_patient_ids, "patient_hash": pa.array(all_patient_hashes)}),
+            os.path.join(target_path, PATIENT_HASHES_DIR, file),
+        )
+
+    return {
+        "file": file,
+        "num_patients": len(all_patient_ids),
+        "min_patient_id": pc.min(all_patient_ids).as_py(),
+        "max_patient_id": pc.max(all_patient_ids).as_py(),
+        "num_transformed": num_transformed,
+    }
 
 
 def femr_stanford_omop_fixer_program() -> None:
@@ -66,27 +308,101 @@ def femr_stanford_omop_fixer_program() -> None:
     parser.add_argument(
         "--num_proc",
         type=int,
-        help="The number of threads to use",
+        help="The number of processes to use, each of which transforms one shard at a time",
         default=1,
     )
 
+    parser.add_argument(
+        "--row_group_size",
+        type=int,
+        help="The number of patients in each parquet row group of the output",
+        default=1_000,
+    )
+
+    parser.add_argument(
+        "--previous_dataset",
+        type=str,
+        help="The output of a previous run. Only patients that are new or changed since then are transformed again",
+        default=None,
+    )
+
+    parser.add_argument(
+        "--write_patient_hashes",
+        action="store_true",
+        help="Write the patient hashes, so that the output can be the --previous_dataset of a later run. "
+        "Incremental runs always write them",
+    )
+
     args = parser.parse_args()
 
-    os.mkdir(args.target_dataset)
+    previous_metadata = None
+    if args.previous_dataset is not None:
+        with open(os.path.join(args.previous_dataset, "metadata.json")) as f:
+            previous_metadata = json.load(f)
 
-    dataset = datasets.Dataset.from_parquet(os.path.join(args.source_dataset, "data", "*"))
+        # Unchanged patients are copied, so the previous run must have used the same transformations
+        if (
+            previous_metadata.get("post_etl_name") != POST_ETL_NAME
+            or previous_metadata.get("post_etl_version") != POST_ETL_VERSION
+            or not os.path.exists(os.path.join(args.previous_dataset, PATIENT_HASHES_DIR))
+        ):
+            raise RuntimeError(
+                f"{args.previous_dataset} was not created by version {POST_ETL_VERSION} of {POST_ETL_NAME} "
+                "with patient hashes, so it cannot be used for an incremental run"
+            )
 
-    fixed_patient = dataset.map(_get_stanford_transformations(), num_proc=args.num_proc)
+    write_patient_hashes = args.previous_dataset is not None or args.write_patient_hashes
 
+    os.mkdir(args.target_dataset)
     os.mkdir(os.path.join(args.target_dataset, "data"))
-    fixed_patient.to_parquet(os.path.join(args.target_dataset, "data", "data.parquet"))
+    if write_patient_hashes:
+        os.mkdir(os.path.join(args.target_dataset, PATIENT_HASHES_DIR))
+
+    # Every source shard is transformed into an output shard with the same name
+    shard_names = sorted(os.listdir(os.path.join(args.source_dataset, "data")))
+    tasks = [
+        (
+            os.path.join(args.source_dataset, "data", shard_name),
+            args.target_dataset,
+            args.row_group_size,
+            args.previous_dataset,
+            write_patient_hashes,
+        )
+        for shard_name in shard_names
+    ]
+
+    if args.num_proc == 1:
+        shards = [_process_shard(task) for task in tasks]
+    else:
+        with multiprocessing.Pool(args.num_proc) as pool:
+            shards = list(pool.imap(_process_shard, tasks))
+
+    femr.index.write_shard_manifest(args.target_dataset, shards)
 
     with open(os.path.join(args.source_dataset, "metadata.json")) as f:
         metadata = json.load(f)
 
     # Let's mark that we modified this dataset
-    metadata["post_etl_name"] = "femr_stanford_omop_fixer"
-    metadata["post_etl_version"] = "0.1"
+    metadata["post_etl_name"] = POST_ETL_NAME
+    metadata["post_etl_version"] = POST_ETL_VERSION
+
+    num_patients = sum(shard["num_patients"] for shard in shards)
+    num_transformed = sum(shard["num_transformed"] for shard in shards)
+
+    lineage = {
+        "source_dataset": os.path.abspath(args.source_dataset),
+        "previous_dataset": None,
+        "num_patients": num_patients,
+        "num_transformed": num_transformed,
+        "num_reused": num_patients - num_transformed,
+    }
+
+    metadata["post_etl_lineage"] = []
+    if previous_metadata is not None:
+        lineage["previous_dataset"] = os.path.abspath(args.previous_dataset)
+        metadata["post_etl_lineage"] = previous_metadata.get("post_etl_lineage", [])
+
+    metadata["post_etl_lineage"].append(lineage)
 
     with open(os.path.join(args.target_dataset, "metadata.json"), "w") as f:
         json.dump(metadata, f)
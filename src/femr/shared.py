@@ -0,0 +1,166 @@
+"""Sharing large read-only objects, such as an Ontology, with the worker processes of femr.hf_utils.
+
+Map functions get their arguments through functools.partial, which datasets.map(num_proc=...) pickles for every job.
+Every worker then unpickles its own copy, which for an ontology takes seconds and several GB per worker.
+
+Classes that derive from Shareable are instead sent as a small SharedHandle while sharing() is active,
+which femr.hf_utils.aggregate_over_dataset does for the duration of the map.
+The object is registered in this process before the workers start, so forked workers attach to the parent's copy,
+which the operating system shares between processes until a page is written.
+Only when workers might not inherit the registry, because they are not forked or because the object was registered
+after they started, is the object pickled to a file (in /dev/shm when it exists), which every worker maps and
+unpickles once. That saves pickling the object for every job, but each of those workers still holds its own
+unpickled copy, so with a spawn or forkserver start method the memory use is the same as without sharing.
+
+Shared objects must not be mutated while they are shared. Mutations in workers are not seen by the parent.
+"""
+
+from __future__ import annotations
+
+import contextlib
+import functools
+import mmap
+import os
+import shutil
+import tempfile
+import uuid
+from typing import Any, Dict, Iterator, Optional
+
+import dill
+
+try:
+    # datasets starts its workers with multiprocess, the dill based fork of multiprocessing that it depends on
+    import multiprocess as _multiprocessing
+except ImportError:
+    import multiprocessing as _multiprocessing  # type: ignore[no-redef]
+
+# Objects registered in this process (or inherited from the parent by forking), by token
+_objects: Dict[str, Any] = {}
+
+# The handles of the active sharing() call, by object id
+_handles: Optional[Dict[int, SharedHandle]] = None
+_directory: Optional[str] = None
+
+# The id of the object that is being written, which has to be pickled by value
+_writing: Optional[int] = None
+
+# The process that is sharing, as forked workers inherit the state above
+_owner_pid: Optional[int] = None
+
+
+class SharedHandle:
+    """A reference to a shared object, which is cheap to pickle."""
+
+    def __init__(self, token: str, path: str):
+        self.token = token
+        self.path = path
+
+    def get(self) -> Any:
+        """Get the object, from the registry of this process or else from its file."""
+        obj = _objects.get(self.token)
+        if obj is None:
+            with open(self.path, "rb") as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as m:
+                obj = dill.loads(m)
+            _objects[self.token] = obj
+        return obj
+
+
+def _attach(handle: SharedHandle) -> Any:
+    return handle.get()
+
+
+class Shareable:
+    """A mixin for large, read-only classes, whose instances are pickled as a SharedHandle while sharing."""
+
+    def __reduce_ex__(self, protocol):
+        if _handles is None or _writing == id(self) or os.getpid() != _owner_pid:
+            return super().__reduce_ex__(protocol)
+        return (_attach, (share(self),))
+
+
+def _workers_are_forked() -> bool:
+    """Whether the worker processes of datasets.map are forked, and so inherit the registry of this process."""
+    method = _multiprocessing.get_start_method(allow_none=True) or _multiprocessing.get_all_start_methods()[0]
+    return method == "fork"
+
+
+def share(obj: Any, before_workers_start: bool = False) -> SharedHandle:
+    """Register an object for the active sharing() call.
+
+    The object is also written to its file, once per call, unless forked workers are started after this call,
+    in which case they find the object in the registry.
+    """
+    global _writing
+    assert _handles is not None and _directory is not None, "share can only be called within sharing()"
+
+    handle = _handles.get(id(obj))
+    if handle is None:
+        token = uuid.uuid4().hex
+        handle = SharedHandle(token, os.path.join(_directory, token))
+        _objects[token] = obj
+        _handles[id(obj)] = handle
+
+        if not (before_workers_start and _workers_are_forked()):
+            previous, _writing = _writing, id(obj)
+            try:
+                with open(handle.path, "wb") as f:
+                    # Shareable objects inside obj are written to their own file and sent as handles
+                    dill.dump(obj, f, protocol=5)
+            finally:
+                _writing = previous
+
+    return handle
+
+
+def _find_shareables(obj: Any, max_depth: int = 4) -> Iterator[Shareable]:
+    """Find the Shareable objects among the arguments of a functools.partial.
+
+    This looks inside lists, tuples and the attributes of objects, but not inside dictionaries,
+    which tend to be large and to hold plain data, such as a label_map.
+    """
+    pending = [(obj, 0)]
+    while pending:
+        current, depth = pending.pop()
+        if isinstance(current, Shareable):
+            yield current
+        elif depth == max_depth:
+            continue
+        elif isinstance(current, (list, tuple)):
+            pending.extend((child, depth + 1) for child in current if not isinstance(child, (str, int, float, dict)))
+        elif isinstance(current, functools.partial):
+            pending.extend((child, depth + 1) for child in current.args)
+            pending.extend((child, depth + 1) for child in current.keywords.values())
+        elif hasattr(current, "__dict__") and not isinstance(current, type):
+            pending.extend((child, depth + 1) for child in vars(current).values())
+
+
+@contextlib.contextmanager
+def sharing(*roots: Any) -> Iterator[None]:
+    """Pickle Shareable objects as handles for the duration of this context.
+
+    The Shareable objects found in roots are registered immediately, so that workers that are forked within
+    this context inherit them without a file. The others are registered and written when they are first pickled.
+    """
+    global _handles, _directory, _owner_pid
+    if _handles is not None and _owner_pid == os.getpid():
+        # Already sharing, for instance in a nested aggregation
+        for obj in _find_shareables(roots):
+            share(obj, before_workers_start=True)
+        yield
+        return
+
+    base = "/dev/shm" if os.path.isdir("/dev/shm") else None
+    _directory = tempfile.mkdtemp(prefix="femr_shared_", dir=base)
+    _handles = {}
+    _owner_pid = os.getpid()
+    try:
+        for obj in _find_shareables(roots):
+            share(obj, before_workers_start=True)
+        yield
+    finally:
+        for handle in _handles.values():
+            _objects.pop(handle.token, None)
+        shutil.rmtree(_directory, ignore_errors=True)
+        _handles = None
+        _directory = None
+        _owner_pid = None
@@ -0,0 +1,415 @@
+"""Generate large synthetic MEDS datasets for load testing.
+
+Patients are generated with numpy in chunks and written straight to sharded MEDS parquet.
+Every chunk has its own seed derived from the dataset seed, the shard and the chunk, so the output does not depend on
+the number of processes.
+"""
+
+from __future__ import annotations
+
+import argparse
+import dataclasses
+import datetime
+import json
+import multiprocessing
+import os
+import pickle
+from typing import Any, Dict, List, Optional, Sequence, Tuple, get_type_hints
+
+import meds
+import numpy as np
+import pyarrow as pa
+import pyarrow.parquet as pq
+
+import femr.index
+import femr.ontology
+import femr.transforms.columnar
+
+_METADATA_TYPE = pa.struct([("visit_id", pa.int64()), ("table", pa.string()), ("end", pa.timestamp("us"))])
+
+_VISIT_CODES = ["Visit/IP", "Visit/OP", "Visit/ER"]
+_SPECIAL_CODES = [meds.birth_code, "Gender/F", "Gender/M", "Race/White", "Race/Non-White"] + _VISIT_CODES
+_TEXT_VALUES = ["negative", "positive", "normal", "abnormal", "high", "low"]
+
+# The number of visits a single patient can have, used to make visit ids unique over the dataset
+_MAX_VISITS_PER_PATIENT = 1 << 20
+
+_EPOCH = np.datetime64("1930-01-01T00:00:00", "us")
+_SECONDS_PER_DAY = 24 * 60 * 60
+
+
+@dataclasses.dataclass
+class SyntheticDataConfig:
+    """The distributions used to generate synthetic patients.
+
+    The number of events per patient follows event_distribution, which is one of "poisson", "lognormal" or "pareto"
+    with a mean of mean_events. Lower values of event_sigma (for lognormal) or pareto_shape (for pareto) give heavier
+    tails. Codes are drawn from a Zipf distribution with exponent code_exponent, and every code consistently has a
+    numeric value, a text value or no value.
+    """
+
+    seed: int = 0
+    event_distribution: str = "lognormal"
+    mean_events: float = 50.0
+    event_sigma: float = 1.0
+    pareto_shape: float = 1.5
+    max_events: int = 100_000
+    mean_measurements_per_event: float = 2.0
+    mean_days_between_events: float = 30.0
+    new_visit_probability: float = 0.3
+    code_exponent: float = 1.1
+    numeric_fraction: float = 0.2
+    text_fraction: float = 0.05
+
+    def __post_init__(self):
+        if self.event_distribution not in ("poisson", "lognormal", "pareto"):
+            raise ValueError(f"Unknown event distribution {self.event_distribution}")
+        if self.event_distribution == "pareto" and self.pareto_shape <= 1:
+            raise ValueError("The pareto distribution needs a shape above 1 to have a mean")
+        if self.mean_measurements_per_event < 1:
+            raise ValueError("Every event has at least one measurement, so mean_measurements_per_event must be >= 1")
+
+
+def get_synthetic_codes(ontology: femr.ontology.Ontology, vocabularies: Optional[Sequence[str]] = None) -> List[str]:
+    """Get the codes to generate from an ontology, which is typically pruned to a real dataset.
+
+    Only the leaves of the ontology are used, as those are the codes that occur in data.
+
+    Arguments:
+        ontology: The ontology to draw codes from
+        vocabularies: If given, only codes from these vocabularies are used, such as ["ICD10CM", "RxNorm"]
+
+    Returns:
+        The sorted codes
+    """
+    codes = set(ontology.description_map) | set(ontology.parents_map)
+    codes = {code for code in codes if len(ontology.get_children(code)) == 0}
+    if vocabularies is not None:
+        codes = {code for code in codes if code.split("/")[0] in vocabularies}
+    return sorted(codes)
+
+
+def get_default_codes(num_codes: int = 10_000) -> List[str]:
+    """Get made up ICD9CM and RxNorm codes, for when no ontology is available."""
+    codes = []
+    for i in range(num_codes // 2):
+        diagnosis = str(i)
+        if len(diagnosis) > 3:
+            diagnosis = diagnosis[:3] + "." + diagnosis[3:]
+        codes.append("ICD9CM/" + diagnosis)
+        codes.append("RxNorm/" + str(i))
+    return codes
+
+
+class _CodeDistribution:
+    """The frequency and value type of every code, which are shared by all shards."""
+
+    def __init__(self, codes: List[str], config: SyntheticDataConfig):
+        rng = np.random.default_rng([config.seed, 0])
+
+        self.codes = pa.array(codes, type=pa.string())
+
+        # The most frequent codes are a random subset of the codes
+        ranks = rng.permutation(len(codes))
+        weights = 1 / (ranks + 1.0) ** config.code_exponent
+        self.cumulative_probabilities = np.cumsum(weights / weights.sum())
+
+        self.value_types = rng.choice(
+            3,
+            size=len(codes),
+            p=[1 - config.numeric_fraction - config.text_fraction, config.numeric_fraction, config.text_fraction],
+        )
+        self.numeric_means = rng.lognormal(mean=2, sigma=1.5, size=len(codes))
+
+
+def _get_num_events(rng: np.random.Generator, num_patients: int, config: SyntheticDataConfig) -> np.ndarray:
+    if config.event_distribution == "poisson":
+        num_events = rng.poisson(config.mean_events, size=num_patients)
+    elif config.event_distribution == "lognormal":
+        mu = np.log(config.mean_events) - config.event_sigma**2 / 2
+        num_events = rng.lognormal(mu, config.event_sigma, size=num_patients)
+    elif config.event_distribution == "pareto":
+        scale = config.mean_events * (config.pareto_shape - 1) / config.pareto_shape
+        num_events = scale * (1 + rng.pareto(config.pareto_shape, size=num_patients))
+    else:
+        raise ValueError(f"Unknown event distribution {config.event_distribution}")
+
+    return np.clip(np.round(num_events), 1, config.max_events).astype(np.int64)
+
+
+def _get_offsets(counts: np.ndarray) -> np.ndarray:
+    return (np.cumsum(counts) - counts).astype(np.int64)
+
+
+def generate_patients(
+    code_distribution: _CodeDistribution,
+    config: SyntheticDataConfig,
+    first_patient_id: int,
+    num_patients: int,
+    seed: Sequence[int],
+) -> pa.Table:
+    """Generate a table of MEDS patients with consecutive patient ids."""
+    rng = np.random.default_rng(list(seed))
+
+    patient_ids = np.arange(first_patient_id, first_patient_id + num_patients, dtype=np.int64)
+    births = _EPOCH + (rng.integers(0, 80 * 365, size=num_patients) * _SECONDS_PER_DAY * 1_000_000).astype(
+        "timedelta64[us]"
+    )
+
+    # Events after birth, which are ordered by patient
+    num_events = _get_num_events(rng, num_patients, config)
+    event_patients = np.repeat(np.arange(num_patients), num_events)
+    event_offsets = _get_offsets(num_events)
+
+    # Times are the cumulative sums of the gaps between events within every patient
+    gaps = 1 + rng.exponential(config.mean_days_between_events * _SECONDS_PER_DAY, size=len(event_patients)).astype(
+        np.int64
+    )
+    elapsed = np.cumsum(gaps)
+    elapsed -= np.repeat(elapsed[event_offsets] - gaps[event_offsets], num_events)
+    event_times = births[event_patients] + (elapsed * 1_000_000).astype("timedelta64[us]")
+
+    # The birth event of a patient comes right before its other events
+    birth_event_indices = event_offsets + np.arange(num_patients)
+    event_indices = np.arange(len(event_patients)) + event_patients + 1
+
+    # Every event belongs to a visit, where the first event of a visit has the visit measurement
+    is_visit_start = rng.random(len(event_patients)) < config.new_visit_probability
+    is_visit_start[event_offsets] = True
+    visit_numbers = np.cumsum(is_visit_start) - 1
+    visit_numbers_within_patient = visit_numbers - visit_numbers[event_offsets][event_patients]
+    visit_ids = patient_ids[event_patients] * _MAX_VISITS_PER_PATIENT + visit_numbers_within_patient
+
+    # Visits end some time after their last event
+    visit_starts = np.flatnonzero(is_visit_start)
+    visit_last_events = np.append(visit_starts[1:], len(event_patients)) - 1
+    visit_ends = event_times[visit_last_events] + (
+        rng.integers(0, _SECONDS_PER_DAY, size=len(visit_starts)) * 1_000_000
+    ).astype("timedelta64[us]")
+
+    # Measurements within events
+    num_measurements = 1 + rng.poisson(config.mean_measurements_per_event - 1, size=len(event_patients))
+    measurement_events = np.repeat(np.arange(len(event_patients)), num_measurements)
+    measurement_ranks = np.arange(len(measurement_events)) - np.repeat(_get_offsets(num_measurements), num_measurements)
+
+    codes = np.minimum(
+        np.searchsorted(code_distribution.cumulative_probabilities, rng.random(len(measurement_events)), side="right"),
+        len(code_distribution.cumulative_probabilities) - 1,
+    )
+    value_types = code_distribution.value_types[codes]
+
+    numeric_values = rng.normal(code_distribution.numeric_means[codes], code_distribution.numeric_means[codes] / 4)
+    text_values = rng.integers(0, len(_TEXT_VALUES), size=len(measurement_events))
+
+    # Every measurement is either a birth measurement, a visit or a clinical measurement
+    # All columns are built with numpy and indices into the vocabulary, and converted to arrow after sorting
+    num_birth_codes = 3
+    birth_codes = np.stack(
+        [
+            np.full(num_patients, _SPECIAL_CODES.index(meds.birth_code)),
+            np.where(
+                rng.random(num_patients) < 0.5, _SPECIAL_CODES.index("Gender/F"), _SPECIAL_CODES.index("Gender/M")
+            ),
+            np.where(
+                rng.random(num_patients) < 0.6,
+                _SPECIAL_CODES.index("Race/White"),
+                _SPECIAL_CODES.index("Race/Non-White"),
+            ),
+        ],
+        axis=1,
+    ).reshape(-1)
+    visit_codes = _SPECIAL_CODES.index(_VISIT_CODES[0]) + rng.integers(0, len(_VISIT_CODES), size=len(visit_starts))
+
+    num_birth_measurements = num_patients * num_birth_codes
+    num_visit_measurements = len(visit_starts)
+
+    def concatenate(birth_values, visit_values, clinical_values):
+        return np.concatenate(
+            [
+                np.broadcast_to(birth_values, num_birth_measurements),
+                np.broadcast_to(visit_values, num_visit_measurements),
+                np.broadcast_to(clinical_values, len(measurement_events)),
+            ]
+        )
+
+    event_index_column = concatenate(
+        np.repeat(birth_event_indices, num_birth_codes), event_indices[visit_starts], event_indices[measurement_events]
+    )
+    rank_column = concatenate(np.tile(np.arange(num_birth_codes), num_patients), 0, measurement_ranks + 1)
+    order = np.lexsort((rank_column, event_index_column))
+
+    never = np.datetime64("NaT", "us")
+    patient_index_column = concatenate(
+        np.repeat(np.arange(num_patients), num_birth_codes),
+        event_patients[visit_starts],
+        event_patients[measurement_events],
+    )[order]
+    time_column = concatenate(
+        np.repeat(births, num_birth_codes), event_times[visit_starts], event_times[measurement_events]
+    )[order]
+    code_column = concatenate(birth_codes, visit_codes, len(_SPECIAL_CODES) + codes)[order]
+    numeric_column = concatenate(np.nan, np.nan, np.where(value_types == 1, numeric_values, np.nan))[order]
+    text_column = concatenate(-1, -1, np.where(value_types == 2, text_values, -1))[order]
+    visit_id_column = concatenate(-1, visit_ids[visit_starts], visit_ids[measurement_events])[order]
+    end_column = concatenate(never, visit_ends, never)[order]
+    is_visit_column = concatenate(False, True, False)[order]
+
+    vocabulary = pa.concat_arrays([pa.array(_SPECIAL_CODES), code_distribution.codes])
+
+    measurements = pa.table(
+        {
+            "patient_index": patient_index_column,
+            "event_index": event_index_column[order],
+            "time": time_column,
+            "code": vocabulary.take(code_column),
+            "text_value": pa.array(_TEXT_VALUES).take(pa.array(text_column, mask=text_column == -1)),
+            "numeric_value": pa.array(numeric_column.astype(np.float32), mask=np.isnan(numeric_column)),
+            "datetime_value": pa.nulls(len(order), type=pa.timestamp("us")),
+            "metadata": pa.StructArray.from_arrays(
+                [
+                    pa.array(visit_id_column, mask=visit_id_column == -1),
+                    pa.array(["visit"]).take(pa.array(np.zeros(len(order), dtype=np.int64), mask=~is_visit_column)),
+                    pa.array(end_column, mask=np.isnat(end_column)),
+                ],
+                fields=list(_METADATA_TYPE),
+            ),
+        }
+    )
+
+    schema = meds.patient_schema(_METADATA_TYPE)
+    patients = pa.table(
+        {"patient_id": pa.array(patient_ids), "events": pa.nulls(num_patients, type=schema.field("events").type)},
+        schema=schema,
+    )
+    return femr.transforms.columnar.nest_patients(measurements, patients)
+
+
+def _generate_shard(args: Tuple[str, int, int, int, int, List[str], SyntheticDataConfig]) -> Dict[str, Any]:
+    """Generate a single shard, one row group of patients at a time."""
+    path, shard, first_patient_id, num_patients, row_group_size, codes, config = args
+
+    code_distribution = _CodeDistribution(codes, config)
+
+    file = f"{shard:05d}.parquet"
+    with pq.ParquetWriter(os.path.join(path, "data", file), meds.patient_schema(_METADATA_TYPE)) as writer:
+        for chunk, start in enumerate(range(0, num_patients, row_group_size)):
+            patients = generate_patients(
+                code_distribution,
+                config,
+                first_patient_id + start,
+                min(row_group_size, num_patients - start),
+                (config.seed, 1, shard, chunk),
+            )
+            writer.write_table(patients, row_group_size=row_group_size)
+
+    return {
+        "file": file,
+        "num_patients": num_patients,
+        "min_patient_id": first_patient_id if num_patients > 0 else None,
+        "max_patient_id": first_patient_id + num_patients - 1 if num_patients > 0 else None,
+    }
+
+
+def generate_dataset(
+    path: str,
+    codes: List[str],
+    num_patients: int,
+    num_shards: int,
+    config: SyntheticDataConfig,
+    num_proc: int = 1,
+    row_group_size: int = 10_000,
+) -> None:
+    """Generate a sharded synthetic MEDS dataset, with a shard manifest.
+
+    Arguments:
+        path: The folder to create, which will contain the data folder, metadata.json and the shard manifest
+        codes: The codes to generate, see get_synthetic_codes
+        num_patients: The total number of patients
+        num_shards: The number of parquet shards, which are generated in parallel
+        config: The distributions to use
+        num_proc: The number of processes to use
+        row_group_size: The number of patients generated at a time and stored in every parquet row group
+    """
+    os.makedirs(os.path.join(path, "data"))
+
+    tasks = []
+    for shard in range(num_shards):
+        start = num_patients * shard // num_shards
+        end = num_patients * (shard + 1) // num_shards
+        tasks.append((path, shard, start, end - start, row_group_size, codes, config))
+
+    if num_proc == 1:
+        shards = [_generate_shard(task) for task in tasks]
+    else:
+        with multiprocessing.Pool(num_proc) as pool:
+            shards = list(pool.imap(_generate_shard, tasks))
+
+    femr.index.write_shard_manifest(path, shards)
+
+    metadata = {
+        "dataset_name": "femr synthetic data",
+        "dataset_version": "1",
+        "etl_name": "femr.synthetic_data",
+        "etl_version": "1",
+        "code_metadata": {},
+        "synthetic_data_config": dataclasses.asdict(config),
+    }
+
+    with open(os.path.join(path, "metadata.json"), "w") as f:
+        json.dump(metadata, f)
+
+
+def femr_generate_synthetic_data_program() -> None:
+    """Generate a large synthetic MEDS dataset for load testing."""
+    parser = argparse.ArgumentParser(description="Generate a large synthetic MEDS dataset for load testing")
+    parser.add_argument("destination", type=str, help="The folder to create")
+    parser.add_argument("--num_patients", type=int, default=1_000_000, help="The number of patients to generate")
+    parser.add_argument(
+        "--num_shards", type=int, default=None, help="The number of shards, by default 1 per 100k patients"
+    )
+    parser.add_argument("--num_proc", type=int, default=1, help="The number of processes to use")
+    parser.add_argument(
+        "--ontology",
+        type=str,
+        default=None,
+        help="A pickled, typically pruned, ontology to draw codes from. Made up codes are used otherwise",
+    )
+    parser.add_argument("--vocabularies", type=str, nargs="+", default=None, help="Only use codes from these")
+    parser.add_argument("--row_group_size", type=int, default=10_000, help="The number of patients per row group")
+
+    # Parse with the annotated types, so that float fields with round defaults still accept fractional values
+    field_types = get_type_hints(SyntheticDataConfig)
+    for field in dataclasses.fields(SyntheticDataConfig):
+        parser.add_argument("--" + field.name, type=field_types[field.name], default=None)
+
+    args = parser.parse_args()
+
+    config = SyntheticDataConfig(
+        **{
+            field.name: getattr(args, field.name)
+            for field in dataclasses.fields(SyntheticDataConfig)
+            if getattr(args, field.name) is not None
+        }
+    )
+
+    if args.ontology is not None:
+        with open(args.ontology, "rb") as f:
+            ontology = pickle.load(f)
+        codes = get_synthetic_codes(ontology, args.vocabularies)
+    else:
+        codes = get_default_codes()
+
+    # The shards determine the seeds, so the default must not depend on the number of processes
+    num_shards = args.num_shards or max(1, args.num_patients // 100_000)
+
+    start = datetime.datetime.now()
+    generate_dataset(
+        args.destination,
+        codes,
+        args.num_patients,
+        num_shards,
+        config,
+        num_proc=args.num_proc,
+        row_group_size=args.row_group_size,
+    )
+    print(f"Generated {args.num_patients} patients in {num_shards} shards in {datetime.datetime.now() - start}")
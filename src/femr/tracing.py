@@ -0,0 +1,265 @@
+"""Lightweight tracing of femr stages, with spans, counters, a Chrome trace export and a summary table.
+
+Tracing is off by default, in which case span and count do almost nothing. It is turned on with enable(), or by
+setting the FEMR_TRACE environment variable to a path, in which case a Chrome trace is written there and a summary
+is printed to stderr when the program exits.
+
+Spans in the workers of femr.hf_utils.aggregate_over_dataset are recorded in the worker and sent back with its
+results, so every worker shows up as its own process in the trace. Timestamps come from the system wide monotonic
+clock, so the spans of different processes line up.
+
+Example:
+    femr.tracing.enable()
+    labels = labeler.apply(dataset, num_proc=4)
+    print(femr.tracing.get_summary())
+    femr.tracing.write_chrome_trace("trace.json")  # Open in https://ui.perfetto.dev or chrome://tracing
+"""
+
+from __future__ import annotations
+
+import atexit
+import collections
+import contextlib
+import functools
+import json
+import multiprocessing
+import os
+import sys
+import threading
+import time
+from typing import Any, Callable, Dict, Iterator, List, Optional, Tuple, TypeVar
+
+# A finished span: name, start in ns, duration in ns, process id, thread id and counters
+Event = Tuple[str, int, int, int, int, Dict[str, int]]
+
+F = TypeVar("F", bound=Callable[..., Any])
+
+
+class Tracer:
+    """A buffer of finished spans, together with running per span name statistics.
+
+    Only the first max_events spans are kept for the Chrome trace, which bounds the memory use of long jobs.
+    The summary statistics cover every span.
+    """
+
+    def __init__(self, max_events: int = 1_000_000):
+        self.max_events = max_events
+        self.events: List[Event] = []
+        self.num_dropped_events = 0
+
+        # For every span name, the number of calls, the total and the maximum duration in ns and the counters
+        self.stats: Dict[str, List[Any]] = {}
+        self.lock = threading.Lock()
+
+    def add(self, event: Event) -> None:
+        name, _, duration, _, _, counters = event
+        with self.lock:
+            if len(self.events) < self.max_events:
+                self.events.append(event)
+            else:
+                self.num_dropped_events += 1
+
+            stats = self.stats.get(name)
+            if stats is None:
+                stats = self.stats[name] = [0, 0, 0, collections.Counter()]
+            stats[0] += 1
+            stats[1] += duration
+            stats[2] = max(stats[2], duration)
+            stats[3].update(counters)
+
+
+_tracer: Optional[Tracer] = None
+_local = threading.local()
+
+
+def _get_stack() -> List[Span]:
+    stack = getattr(_local, "stack", None)
+    if stack is None:
+        stack = _local.stack = []
+    return stack
+
+
+class Span:
+    """A timed region, which records a single event when it is exited."""
+
+    __slots__ = ("name", "counters", "start")
+
+    def __init__(self, name: str):
+        self.name = name
+        self.counters: Dict[str, int] = {}
+        self.start = 0
+
+    def count(self, name: str, value: int) -> None:
+        """Add to a counter of this span, such as "patients" or "bytes"."""
+        self.counters[name] = self.counters.get(name, 0) + value
+
+    def __enter__(self) -> Span:
+        _get_stack().append(self)
+        self.start = time.monotonic_ns()
+        return self
+
+    def __exit__(self, *exc_info) -> None:
+        duration = time.monotonic_ns() - self.start
+        _get_stack().pop()
+        tracer = _tracer
+        if tracer is not None:
+            tracer.add((self.name, self.start, duration, os.getpid(), threading.get_ident(), self.counters))
+
+
+class _NullSpan:
+    """The span used when tracing is off."""
+
+    def count(self, name: str, value: int) -> None:
+        pass
+
+    def __enter__(self) -> _NullSpan:
+        return self
+
+    def __exit__(self, *exc_info) -> None:
+        pass
+
+
+_NULL_SPAN = _NullSpan()
+
+
+def is_enabled() -> bool:
+    return _tracer is not None
+
+
+def enable(max_events: int = 1_000_000) -> None:
+    """Start tracing, discarding anything recorded before."""
+    global _tracer
+    _tracer = Tracer(max_events)
+
+
+def disable() -> None:
+    global _tracer
+    _tracer = None
+
+
+def span(name: str) -> Any:
+    """Get a context manager that traces a region of code under the given name."""
+    if _tracer is None:
+        return _NULL_SPAN
+    return Span(name)
+
+
+def count(name: str, value: int) -> None:
+    """Add to a counter of the innermost open span of this thread."""
+    if _tracer is None:
+        return
+    stack = _get_stack()
+    if stack:
+        stack[-1].count(name, value)
+
+
+def traced(name: Optional[str] = None) -> Callable[[F], F]:
+    """A decorator that traces every call of a function, by default under its qualified name."""
+
+    def decorator(func: F) -> F:
+        span_name = name or func.__qualname__
+
+        @functools.wraps(func)
+        def wrapper(*args, **kwargs):
+            if _tracer is None:
+                return func(*args, **kwargs)
+            with Span(span_name):
+                return func(*args, **kwargs)
+
+        return wrapper  # type: ignore
+
+    return decorator
+
+
+def add_span(name: str, start: int, duration: int, counters: Optional[Dict[str, int]] = None) -> None:
+    """Record a span that was timed by other means, with times in ns from time.monotonic_ns."""
+    if _tracer is not None:
+        _tracer.add((name, start, duration, os.getpid(), threading.get_ident(), counters or {}))
+
+
+def add_events(events: List[Event]) -> None:
+    """Add the events recorded in another process, such as a worker."""
+    if _tracer is not None:
+        for event in events:
+            _tracer.add(event)
+
+
+@contextlib.contextmanager
+def capture() -> Iterator[Tracer]:
+    """Record into a fresh tracer, for instance in a worker process that sends its events back to the parent."""
+    global _tracer
+    previous = _tracer
+    _tracer = Tracer()
+    try:
+        yield _tracer
+    finally:
+        _tracer = previous
+
+
+def write_chrome_trace(path: str) -> None:
+    """Write the recorded spans in the Chrome trace event format."""
+    assert _tracer is not None, "Tracing is not enabled"
+
+    with _tracer.lock:
+        events = list(_tracer.events)
+        num_dropped_events = _tracer.num_dropped_events
+
+    trace_events = [
+        {
+            "name": name,
+            "ph": "X",
+            "ts": start / 1000,
+            "dur": duration / 1000,
+            "pid": pid,
+            "tid": tid,
+            "args": counters,
+        }
+        for name, start, duration, pid, tid, counters in events
+    ]
+
+    with open(path, "w") as f:
+        json.dump({"traceEvents": trace_events, "otherData": {"num_dropped_events": num_dropped_events}}, f)
+
+
+def get_stats() -> Dict[str, Tuple[int, int, int, Dict[str, int]]]:
+    """Get the number of calls, the total and maximum duration in ns and the counters of every span name."""
+    assert _tracer is not None, "Tracing is not enabled"
+
+    with _tracer.lock:
+        return {
+            name: (calls, total, maximum, dict(counters))
+            for name, (calls, total, maximum, counters) in _tracer.stats.items()
+        }
+
+
+def get_summary() -> str:
+    """Get a table with the calls, time and counters of every span name, sorted by total time."""
+    stats = get_stats()
+
+    lines = [
+        "{:<48} {:>8} {:>10} {:>10} {:>10}  {}".format("span", "calls", "total s", "mean ms", "max ms", "counters")
+    ]
+    for name, (calls, total, maximum, counters) in sorted(stats.items(), key=lambda item: -item[1][1]):
+        seconds = total / 1e9
+        counter_text = ", ".join(
+            f"{key}={value:,} ({value / seconds:,.0f}/s)" if seconds > 0 else f"{key}={value:,}"
+            for key, value in sorted(counters.items())
+        )
+        lines.append(
+            "{:<48} {:>8} {:>10.3f} {:>10.3f} {:>10.3f}  {}".format(
+                name, calls, seconds, total / calls / 1e6, maximum / 1e6, counter_text
+            )
+        )
+    return "\n".join(lines)
+
+
+def _write_on_exit(path: str) -> None:
+    if _tracer is None:
+        return
+    write_chrome_trace(path)
+    print(get_summary(), file=sys.stderr)
+
+
+if os.environ.get("FEMR_TRACE") and multiprocessing.parent_process() is None:
+    enable()
+    atexit.register(_write_on_exit, os.environ["FEMR_TRACE"])
@@ -0,0 +1,338 @@
+"""Vectorized versions of the general use transforms, which work on many patients at once in a columnar layout.
+
+The columnar layout is a table with one row per measurement. It has a patient_index column with the position of the
+patient in the original table, a patient_id column, an event_index column that identifies the event of the
+measurement, the time of the event and one column for every field of the measurement. Rows are sorted by patient and
+the rows of an event are contiguous, in the order of the events of the patient.
+
+Transforms that reorder events do not sort the rows themselves. They record sort keys with defer_sort_events, and
+apply_transforms sorts once by all recorded keys with sort_events before nesting the patients again. Until then, an
+event is identified by its event_index together with the recorded split keys.
+
+The kernels in this module have the same semantics as their counterparts in femr.transforms, applied to every patient.
+Instead of a callable on a single measurement, do_not_apply_to_filter is a pyarrow compute expression on the columns,
+such as pc.field("metadata", "table") == "visit". Measurements where it evaluates to null are not excluded.
+
+Events without any measurements cannot be represented, so they are dropped by flatten_patients.
+"""
+
+from __future__ import annotations
+
+from typing import Callable, List, Optional, Tuple
+
+import numpy as np
+import pyarrow as pa
+import pyarrow.compute as pc
+
+_VALUE_COLUMNS = ["numeric_value", "text_value", "datetime_value"]
+
+_SORT_KEY_PREFIX = "_sort_"
+
+
+def _to_array(column) -> pa.Array:
+    if isinstance(column, pa.ChunkedArray):
+        return column.combine_chunks()
+    return column
+
+
+def _get_run_starts(keys: List[np.ndarray]) -> np.ndarray:
+    """Find the rows where any of the keys differs from the previous row."""
+    is_start = np.ones(len(keys[0]), dtype=bool)
+    is_start[1:] = np.any([key[1:] != key[:-1] for key in keys], axis=0)
+    return is_start
+
+
+def get_groups(keys: List[np.ndarray]) -> np.ndarray:
+    """Get a group id for every row, such that rows have the same group id if all of their keys are equal.
+
+    Groups are numbered in sorted order of the keys, where the last key is the primary sort key as in np.lexsort.
+    """
+    order = np.lexsort(keys)
+
+    groups = np.empty(len(keys[0]), dtype=np.int64)
+    groups[order] = np.cumsum(_get_run_starts([key[order] for key in keys])) - 1
+    return groups
+
+
+def get_metadata_field(measurements: pa.Table, name: str) -> pa.Array:
+    """Get a metadata field as a typed column, which is all null if the field does not exist."""
+    metadata = _to_array(measurements.column("metadata"))
+    if not pa.types.is_struct(metadata.type) or metadata.type.get_field_index(name) == -1:
+        return pa.nulls(len(measurements))
+    return pc.struct_field(metadata, name)
+
+
+def set_metadata_field(measurements: pa.Table, name: str, values: pa.Array) -> pa.Table:
+    """Replace an existing metadata field, keeping its type."""
+    metadata = _to_array(measurements.column("metadata"))
+    fields = list(metadata.type)
+    arrays = [
+        values.cast(field.type) if field.name == name else pc.struct_field(metadata, field.name) for field in fields
+    ]
+    return measurements.set_column(
+        measurements.schema.get_field_index("metadata"),
+        measurements.schema.field("metadata"),
+        pa.StructArray.from_arrays(arrays, fields=fields, mask=metadata.is_null()),
+    )
+
+
+def flatten_patients(patients: pa.Table) -> pa.Table:
+    """Convert a table of MEDS patients into the columnar layout, with one row per measurement."""
+    events = _to_array(patients.column("events"))
+    event_patients = pc.list_parent_indices(events)
+    flat_events = events.flatten()
+
+    measurements = pc.struct_field(flat_events, "measurements")
+    measurement_events = pc.list_parent_indices(measurements)
+    flat_measurements = measurements.flatten()
+
+    patient_indices = event_patients.take(measurement_events).cast(pa.int64())
+    columns = {
+        "patient_index": patient_indices,
+        "patient_id": _to_array(patients.column("patient_id")).take(patient_indices),
+        "event_index": measurement_events.cast(pa.int64()),
+        "time": pc.struct_field(flat_events, "time").take(measurement_events),
+    }
+    for field in flat_measurements.type:
+        columns[field.name] = pc.struct_field(flat_measurements, field.name)
+
+    return pa.table(columns)
+
+
+def nest_patients(measurements: pa.Table, patients: pa.Table) -> pa.Table:
+    """Convert the columnar layout back into MEDS patients.
+
+    Arguments:
+        measurements: Measurements in the columnar layout
+        patients: The table the measurements were flattened from, which supplies the patients and the schema
+
+    Returns:
+        The patients table, with events replaced by the given measurements
+    """
+    events_type = patients.schema.field("events").type
+    measurement_type = events_type.value_type.field("measurements").type.value_type
+
+    patient_indices = _to_array(measurements.column("patient_index")).to_numpy()
+    event_indices = _to_array(measurements.column("event_index")).to_numpy()
+
+    event_starts = np.flatnonzero(_get_run_starts([patient_indices, event_indices]))
+
+    flat_measurements = pa.StructArray.from_arrays(
+        [_to_array(measurements.column(field.name)).cast(field.type) for field in measurement_type],
+        fields=list(measurement_type),
+    )
+    measurement_offsets = np.append(event_starts, len(measurements)).astype(np.int32)
+
+    event_type = events_type.value_type
+    flat_events = pa.StructArray.from_arrays(
+        [
+            _to_array(measurements.column("time")).take(event_starts).cast(event_type.field("time").type),
+            pa.ListArray.from_arrays(
+                measurement_offsets, flat_measurements, type=event_type.field("measurements").type
+            ),
+        ],
+        fields=list(event_type),
+    )
+
+    events_per_patient = np.bincount(patient_indices[event_starts], minlength=len(patients))
+    event_offsets = np.append(0, np.cumsum(events_per_patient)).astype(np.int32)
+
+    return patients.set_column(
+        patients.schema.get_field_index("events"),
+        patients.schema.field("events"),
+        pa.ListArray.from_arrays(event_offsets, flat_events, type=events_type),
+    )
+
+
+def _evaluate_filter(measurements: pa.Table, do_not_apply_to_filter: Optional[pc.Expression]) -> np.ndarray:
+    mask = np.zeros(len(measurements), dtype=bool)
+    if do_not_apply_to_filter is not None:
+        rows = measurements.append_column("_row", pa.array(np.arange(len(measurements))))
+        mask[rows.filter(do_not_apply_to_filter).column("_row").to_numpy()] = True
+    return mask
+
+
+def _get_key_groups(measurements: pa.Table) -> np.ndarray:
+    """Get a group id for every (patient, code, date) key."""
+    return get_groups(
+        [
+            _to_array(measurements.column("time")).cast(pa.date32()).cast(pa.int32()).to_numpy(),
+            _to_array(measurements.column("code")).dictionary_encode().indices.to_numpy(),
+            _to_array(measurements.column("patient_index")).to_numpy(),
+        ]
+    )
+
+
+def _has_value(measurements: pa.Table) -> np.ndarray:
+    has_value = np.zeros(len(measurements), dtype=bool)
+    for name in _VALUE_COLUMNS:
+        has_value |= _to_array(measurements.column(name)).is_valid().to_numpy(zero_copy_only=False)
+    return has_value
+
+
+def _values_equal(first: pa.Table, second: pa.Table) -> np.ndarray:
+    """Elementwise equality of the values of two sets of measurements, where missing values are equal."""
+    equal = np.ones(len(first), dtype=bool)
+    for name in _VALUE_COLUMNS:
+        a = _to_array(first.column(name))
+        b = _to_array(second.column(name))
+        if pa.types.is_null(a.type):
+            continue
+        both_null = pc.and_(a.is_null(), b.is_null())
+        equal &= pc.or_(both_null, pc.fill_null(pc.equal(a, b), False)).to_numpy(zero_copy_only=False)
+    return equal
+
+
+def _get_sort_key_columns(measurements: pa.Table) -> Tuple[List[str], List[str]]:
+    """Get the names of the time and split key columns recorded by defer_sort_events, in the order they were added."""
+    names = [name for name in measurements.column_names if name.startswith(_SORT_KEY_PREFIX)]
+    return (
+        [name for name in names if name.startswith(_SORT_KEY_PREFIX + "time_")],
+        [name for name in names if name.startswith(_SORT_KEY_PREFIX + "split_")],
+    )
+
+
+def _get_order_keys(measurements: pa.Table) -> List[np.ndarray]:
+    """Get np.lexsort keys that order the rows of every patient as sort_events would, without the patient key."""
+    time_keys, split_keys = _get_sort_key_columns(measurements)
+    if not time_keys:
+        return [np.arange(len(measurements))]
+
+    # Every deferred sort orders by its time first, then by the order before it, then by its split key
+    names = split_keys[::-1] + ["event_index"] + time_keys
+    return [_to_array(measurements.column(name)).to_numpy() for name in names]
+
+
+def get_events(measurements: pa.Table) -> np.ndarray:
+    """Get a group id for every event, including events split by defer_sort_events that are not sorted yet."""
+    _, split_keys = _get_sort_key_columns(measurements)
+    names = split_keys[::-1] + ["event_index", "patient_index"]
+    return get_groups([_to_array(measurements.column(name)).to_numpy() for name in names])
+
+
+def defer_sort_events(measurements: pa.Table, split: Optional[np.ndarray] = None) -> pa.Table:
+    """Record a sort_events call without sorting, by adding its keys as columns.
+
+    The next sort_events sorts by all recorded keys at once, with the same result as sorting every time.
+    """
+    time_keys, split_keys = _get_sort_key_columns(measurements)
+    num_keys = len(time_keys) + len(split_keys)
+
+    # A sort by the same times as the previous one does not change the order
+    times = _to_array(measurements.column("time")).cast(pa.int64())
+    if not time_keys or not times.equals(_to_array(measurements.column(time_keys[-1]))):
+        measurements = measurements.append_column(f"{_SORT_KEY_PREFIX}time_{num_keys}", times)
+        num_keys += 1
+
+    if split is not None:
+        measurements = measurements.append_column(f"{_SORT_KEY_PREFIX}split_{num_keys}", pa.array(split))
+
+    return measurements
+
+
+def sort_events(measurements: pa.Table, split: Optional[np.ndarray] = None) -> pa.Table:
+    """Stable sort of the events of every patient by time, renumbering event_index in the new order.
+
+    Arguments:
+        measurements: Measurements in the columnar layout
+        split: An optional key for every measurement. Measurements of an event with different keys are split into
+            separate events, which are placed in order of the keys before sorting.
+
+    Returns:
+        The sorted measurements, which also applies every sort recorded with defer_sort_events
+    """
+    measurements = defer_sort_events(measurements, split)
+    time_keys, split_keys = _get_sort_key_columns(measurements)
+
+    patient_indices = _to_array(measurements.column("patient_index")).to_numpy()
+
+    # np.lexsort is stable, so measurements keep their order within events
+    order = np.lexsort((*_get_order_keys(measurements), patient_indices))
+
+    event_keys = [patient_indices] + [
+        _to_array(measurements.column(name)).to_numpy() for name in ["event_index"] + split_keys
+    ]
+    event_indices = np.cumsum(_get_run_starts([key[order] for key in event_keys])) - 1
+
+    sort_key_columns = set(time_keys + split_keys)
+    measurements = measurements.select([name for name in measurements.column_names if name not in sort_key_columns])
+    measurements = measurements.take(order)
+    return measurements.set_column(
+        measurements.schema.get_field_index("event_index"), "event_index", pa.array(event_indices)
+    )
+
+
+def remove_nones(measurements: pa.Table, do_not_apply_to_filter: Optional[pc.Expression] = None) -> pa.Table:
+    """Remove duplicate codes w/in same day if duplicate code has None value.
+
+    This is the columnar version of femr.transforms.remove_nones.
+    """
+    has_value = _has_value(measurements)
+    groups = _get_key_groups(measurements)
+
+    group_has_value = np.bincount(groups, weights=has_value) > 0
+    remove = ~has_value & group_has_value[groups] & ~_evaluate_filter(measurements, do_not_apply_to_filter)
+
+    return defer_sort_events(measurements.filter(pa.array(~remove)))
+
+
+def delta_encode(measurements: pa.Table, do_not_apply_to_filter: Optional[pc.Expression] = None) -> pa.Table:
+    """Delta encodes the patients, removing sequential duplicate values within the same day.
+
+    This is the columnar version of femr.transforms.delta_encode.
+    """
+    if len(measurements) == 0:
+        return measurements
+
+    groups = _get_key_groups(measurements)
+
+    # Only the previous measurement with the same key matters, as removed measurements repeat that value anyway
+    order = np.lexsort((*_get_order_keys(measurements), groups))
+    ordered = measurements.take(order)
+
+    is_repeat = (groups[order][1:] == groups[order][:-1]) & _values_equal(
+        ordered.slice(1), ordered.slice(0, len(ordered) - 1)
+    )
+
+    remove = np.zeros(len(measurements), dtype=bool)
+    remove[order[1:]] = is_repeat
+    remove &= ~_evaluate_filter(measurements, do_not_apply_to_filter)
+
+    return defer_sort_events(measurements.filter(pa.array(~remove)))
+
+
+def fix_events(measurements: pa.Table) -> pa.Table:
+    """Sort the events of every patient and merge events with the same time.
+
+    This is the columnar version of femr.transforms.fix_events.
+    """
+    measurements = sort_events(measurements)
+
+    patient_indices = _to_array(measurements.column("patient_index")).to_numpy()
+    times = _to_array(measurements.column("time")).cast(pa.int64()).to_numpy()
+
+    return measurements.set_column(
+        measurements.schema.get_field_index("event_index"),
+        "event_index",
+        pa.array(np.cumsum(_get_run_starts([patient_indices, times])) - 1),
+    )
+
+
+def apply_transforms(patients: pa.Table, transforms: List[Callable[[pa.Table], pa.Table]]) -> pa.Table:
+    """Apply a sequence of columnar transforms to a table of MEDS patients.
+
+    Arguments:
+        patients: A table of MEDS patients
+        transforms: Functions that take and return measurements in the columnar layout
+
+    Returns:
+        The transformed patients
+    """
+    measurements = flatten_patients(patients)
+    for transform in transforms:
+        measurements = transform(measurements)
+
+    if any(name.startswith(_SORT_KEY_PREFIX) for name in measurements.column_names):
+        measurements = sort_events(measurements)
+
+    return nest_patients(measurements, patients)
@@ -15,6 +15,19 @@ def _move_date_to_end(
         return d
 
 
+# List of billing code tables based on the original Clarity queries used to form STRIDE
+_BILLING_CODES = [
+    "pat_enc_dx",
+    "hsp_acct_dx_list",
+    "arpb_transactions",
+]
+
+# The clarity_table values of billing codes, which move_billing_codes moves to the end of their visit
+BILLING_CODE_TABLES = frozenset(
+    (prefix + "_" + billing_code) for billing_code in _BILLING_CODES for prefix in ["shc", "lpch"]
+)
+
+
 def move_visit_start_to_first_event_start(patient: meds.Patient) -> meds.Patient:
     """Assign visit start times to equal start time of first event in visit
 
@@ -161,14 +174,7 @@ def move_billing_codes(patient: meds.Patient) -> meds.Patient:
     end_visits: Dict[int, datetime.datetime] = {}  # Map from visit ID to visit end time
     lowest_visit: Dict[Tuple[datetime.datetime, str], int] = {}  # Map from code/start time pairs to visit ID
 
-    # List of billing code tables based on the original Clarity queries used to form STRIDE
-    billing_codes = [
-        "pat_enc_dx",
-        "hsp_acct_dx_list",
-        "arpb_transactions",
-    ]
-
-    all_billing_codes = {(prefix + "_" + billing_code) for billing_code in billing_codes for prefix in ["shc", "lpch"]}
+    all_billing_codes = BILLING_CODE_TABLES
 
     for event in patient["events"]:
         for measurement in event["measurements"]:
@@ -237,3 +243,4 @@ def move_billing_codes(patient: meds.Patient) -> meds.Patient:
     patient["events"].sort(key=lambda a: a["time"])
 
     return patient
+
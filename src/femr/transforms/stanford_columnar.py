@@ -0,0 +1,309 @@
+"""Vectorized versions of the STARR OMOP transforms, which work on the columnar layout of femr.transforms.columnar.
+
+Every transform has the same semantics as its counterpart in femr.transforms.stanford, applied to every patient.
+Metadata fields are read as typed columns, and visits are matched with sort based joins on (patient, visit_id).
+The transforms defer sorting the events with defer_sort_events, so apply_stanford_transforms sorts only once.
+"""
+
+from __future__ import annotations
+
+import functools
+from typing import List
+
+import meds
+import numpy as np
+import pyarrow as pa
+import pyarrow.compute as pc
+
+import femr.transforms.columnar
+from femr.transforms.columnar import (
+    defer_sort_events,
+    get_events,
+    get_groups,
+    get_metadata_field,
+    set_metadata_field,
+)
+from femr.transforms.stanford import BILLING_CODE_TABLES
+
+_IS_VISIT = pc.field("metadata", "table") == "visit"
+
+
+def _get_times(measurements: pa.Table) -> np.ndarray:
+    return measurements.column("time").to_numpy()
+
+
+def _set_times(measurements: pa.Table, times: np.ndarray) -> pa.Table:
+    index = measurements.schema.get_field_index("time")
+    field = measurements.schema.field(index)
+    return measurements.set_column(index, field, pa.array(times).cast(field.type))
+
+
+def _get_ends(measurements: pa.Table) -> np.ndarray:
+    """Get the end metadata field as datetimes, which are NaT where the end is missing."""
+    ends = get_metadata_field(measurements, "end")
+    if pa.types.is_null(ends.type):
+        return np.full(len(measurements), np.datetime64("NaT"), dtype=_get_times(measurements).dtype)
+    return ends.cast(measurements.schema.field("time").type).to_numpy(zero_copy_only=False)
+
+
+def _set_ends(measurements: pa.Table, ends: np.ndarray) -> pa.Table:
+    if pa.types.is_null(get_metadata_field(measurements, "end").type):
+        # There are no ends to update
+        return measurements
+    return set_metadata_field(measurements, "end", pa.array(ends, mask=np.isnat(ends)))
+
+
+def _get_visit_ids(measurements: pa.Table):
+    """Get the visit_id metadata field as integers, together with a mask of the missing visit ids."""
+    visit_ids = get_metadata_field(measurements, "visit_id")
+    if pa.types.is_null(visit_ids.type):
+        return np.zeros(len(measurements), dtype=np.int64), np.ones(len(measurements), dtype=bool)
+    return (
+        pc.fill_null(visit_ids, 0).cast(pa.int64()).to_numpy(),
+        visit_ids.is_null().to_numpy(zero_copy_only=False),
+    )
+
+
+def _metadata_field_is_in(measurements: pa.Table, name: str, values: List[str]) -> np.ndarray:
+    field = get_metadata_field(measurements, name)
+    if pa.types.is_null(field.type):
+        return np.zeros(len(measurements), dtype=bool)
+    return pc.is_in(field, value_set=pa.array(values, type=field.type)).to_numpy(zero_copy_only=False)
+
+
+def _get_patient_indices(measurements: pa.Table) -> np.ndarray:
+    return measurements.column("patient_index").to_numpy()
+
+
+def _get_patient_id(measurements: pa.Table, row: int) -> int:
+    return measurements.column("patient_id")[row].as_py()
+
+
+def _get_visit_groups(measurements: pa.Table) -> np.ndarray:
+    """Get a group id for every (patient, visit_id) pair, where all missing visit ids of a patient share a group."""
+    visit_ids, is_missing_visit_id = _get_visit_ids(measurements)
+    return get_groups([visit_ids, is_missing_visit_id, _get_patient_indices(measurements)])
+
+
+def _split_moved(measurements: pa.Table, is_moved: np.ndarray) -> np.ndarray:
+    """Get the split key for sort_events that puts every moved measurement into its own event.
+
+    The new events come in order before the remainder of their original event, as in the per patient transforms.
+    """
+    moved_rows = np.flatnonzero(is_moved)
+    moved_events = get_events(measurements)[moved_rows]
+
+    # Number the moved measurements of every event in row order, which is their order within the event
+    order = np.argsort(moved_events, kind="stable")
+    ranks = np.empty(len(moved_rows), dtype=np.int64)
+    ranks[order] = np.arange(len(moved_rows)) - np.searchsorted(moved_events[order], moved_events[order])
+
+    split = np.full(len(measurements), len(measurements), dtype=np.int64)
+    split[moved_rows] = ranks
+    return split
+
+
+def move_pre_birth(measurements: pa.Table) -> pa.Table:
+    """Move all events to after the birth of a patient.
+
+    This is the columnar version of femr.transforms.stanford.move_pre_birth.
+    """
+    patient_indices = _get_patient_indices(measurements)
+    times = _get_times(measurements)
+    ends = _get_ends(measurements)
+
+    # The last birth measurement of every patient determines the birth date.
+    # This runs first, before any sort is deferred, so the rows are still in the order of the events.
+    birth_rows = np.full(patient_indices.max(initial=-1) + 1, -1, dtype=np.int64)
+    is_birth = pc.equal(measurements.column("code"), meds.birth_code).to_numpy()
+    np.maximum.at(birth_rows, patient_indices[is_birth], np.flatnonzero(is_birth))
+
+    assert np.all(birth_rows[patient_indices] != -1)
+    birth_dates = times[birth_rows[patient_indices]]
+
+    is_pre_birth = times < birth_dates
+    keep = ~is_pre_birth | (birth_dates - times <= np.timedelta64(30, "D"))
+
+    times = np.where(is_pre_birth, birth_dates, times)
+    ends = np.where(is_pre_birth & (ends < birth_dates), birth_dates, ends)
+
+    measurements = _set_ends(_set_times(measurements, times), ends)
+    return defer_sort_events(measurements.filter(pa.array(keep)))
+
+
+def move_visit_start_to_first_event_start(measurements: pa.Table) -> pa.Table:
+    """Assign visit start times to equal start time of first event in visit.
+
+    This is the columnar version of femr.transforms.stanford.move_visit_start_to_first_event_start.
+    """
+    times = _get_times(measurements)
+    ends = _get_ends(measurements)
+    _, is_missing_visit_id = _get_visit_ids(measurements)
+    is_visit = _metadata_field_is_in(measurements, "table", ["visit"])
+
+    groups = _get_visit_groups(measurements)
+    num_groups = groups.max(initial=-1) + 1
+
+    # Find the stated start time for each visit
+    never = np.datetime64("NaT")
+    visit_starts = np.full(num_groups, np.iinfo(np.int64).max).astype(times.dtype)
+    last_visit_starts = np.full(num_groups, np.iinfo(np.int64).min + 1).astype(times.dtype)
+    np.minimum.at(visit_starts, groups[is_visit], times[is_visit])
+    np.maximum.at(last_visit_starts, groups[is_visit], times[is_visit])
+
+    has_visit = np.zeros(num_groups, dtype=bool)
+    has_visit[groups[is_visit]] = True
+
+    if np.any(has_visit & (visit_starts != last_visit_starts)):
+        group = np.flatnonzero(has_visit & (visit_starts != last_visit_starts))[0]
+        row = np.flatnonzero(groups == group)[0]
+        raise RuntimeError(
+            f"Multiple visit events with visit ID {get_metadata_field(measurements, 'visit_id')[row]} "
+            + f" for patient ID {_get_patient_id(measurements, row)}"
+        )
+
+    # Find the minimum start time over all non-visit events associated with each visit
+    visit_starts = np.where(has_visit, visit_starts, never)
+    is_after_start = ~is_missing_visit_id & has_visit[groups] & (times > visit_starts[groups])
+
+    first_event_starts = np.full(num_groups, np.iinfo(np.int64).max).astype(times.dtype)
+    np.minimum.at(first_event_starts, groups[is_after_start], times[is_after_start])
+
+    has_first_event_start = np.zeros(num_groups, dtype=bool)
+    has_first_event_start[groups[is_after_start]] = True
+
+    # Reset the visit end to be ≥ the visit start
+    ends = np.where(is_visit & (ends < times), times, ends)
+
+    # Move the visits with a later first event into their own events
+    is_moved = is_visit & ~is_missing_visit_id & has_first_event_start[groups]
+    times = np.where(is_moved, first_event_starts[groups], times)
+
+    measurements = _set_ends(_set_times(measurements, times), ends)
+    return defer_sort_events(measurements, _split_moved(measurements, is_moved))
+
+
+def _move_date_to_end(times: np.ndarray) -> np.ndarray:
+    is_midnight = times == times.astype("datetime64[D]")
+    return np.where(is_midnight, times + np.timedelta64(1, "D") - np.timedelta64(1, "m"), times)
+
+
+def move_to_day_end(measurements: pa.Table) -> pa.Table:
+    """We assume that everything coded at midnight should actually be moved to the end of the day.
+
+    This is the columnar version of femr.transforms.stanford.move_to_day_end.
+    """
+    times = _move_date_to_end(_get_times(measurements))
+    ends = _get_ends(measurements)
+    ends = np.where(np.isnat(ends), ends, np.maximum(_move_date_to_end(ends), times))
+
+    return defer_sort_events(_set_ends(_set_times(measurements, times), ends))
+
+
+def switch_to_icd10cm(measurements: pa.Table) -> pa.Table:
+    """Switch from ICD10 to ICD10CM.
+
+    This is the columnar version of femr.transforms.stanford.switch_to_icd10cm.
+    """
+    index = measurements.schema.get_field_index("code")
+    codes = pc.replace_substring_regex(measurements.column("code"), pattern="^ICD10/", replacement="ICD10CM/")
+    return measurements.set_column(index, measurements.schema.field(index), codes)
+
+
+def move_billing_codes(measurements: pa.Table) -> pa.Table:
+    """Move billing codes to the end of each visit.
+
+    This is the columnar version of femr.transforms.stanford.move_billing_codes.
+    """
+    patient_indices = _get_patient_indices(measurements)
+    times = _get_times(measurements)
+    ends = _get_ends(measurements)
+    visit_ids, is_missing_visit_id = _get_visit_ids(measurements)
+
+    is_billing = _metadata_field_is_in(measurements, "clarity_table", sorted(BILLING_CODE_TABLES))
+    is_visit_end = _metadata_field_is_in(measurements, "clarity_table", ["lpch_pat_enc", "shc_pat_enc"]) & ~np.isnat(
+        ends
+    )
+
+    # For billing codes that share the same code/start time, we find the lowest visit ID
+    code_groups = get_groups(
+        [
+            measurements.column("code").combine_chunks().dictionary_encode().indices.to_numpy(),
+            times.astype(np.int64),
+            patient_indices,
+        ]
+    )
+    has_visit_id = is_billing & ~is_missing_visit_id
+    lowest_visits = np.full(code_groups.max(initial=-1) + 1, np.iinfo(np.int64).max)
+    np.minimum.at(lowest_visits, code_groups[has_visit_id], visit_ids[has_visit_id])
+
+    has_lowest_visit = np.zeros(len(lowest_visits), dtype=bool)
+    has_lowest_visit[code_groups[has_visit_id]] = True
+
+    # Find the end time of every visit
+    if np.any(is_visit_end & is_missing_visit_id):
+        row = np.flatnonzero(is_visit_end & is_missing_visit_id)[0]
+        # Every event with an end time should have a visit ID associated with it
+        patient_id = _get_patient_id(measurements, row)
+        raise RuntimeError(f"Expected visit id for visit? {patient_id} {measurements.slice(row, 1)}")
+
+    visit_groups = _get_visit_groups(measurements)
+    num_visit_groups = visit_groups.max(initial=-1) + 1
+
+    visit_ends = np.full(num_visit_groups, np.iinfo(np.int64).max).astype(times.dtype)
+    last_visit_ends = np.full(num_visit_groups, np.iinfo(np.int64).min + 1).astype(times.dtype)
+    np.minimum.at(visit_ends, visit_groups[is_visit_end], ends[is_visit_end])
+    np.maximum.at(last_visit_ends, visit_groups[is_visit_end], ends[is_visit_end])
+
+    has_visit_end = np.zeros(num_visit_groups, dtype=bool)
+    has_visit_end[visit_groups[is_visit_end]] = True
+
+    if np.any(has_visit_end & (visit_ends != last_visit_ends)):
+        row = np.flatnonzero(is_visit_end & (visit_ends != last_visit_ends)[visit_groups])[0]
+        # The end times of all events associated with a visit should be the same
+        raise RuntimeError(f"Multiple end visits? {visit_ends[visit_groups[row]]} {measurements.slice(row, 1)}")
+
+    # We only keep the copy of a billing code associated with the lowest visit id,
+    # or billing codes without a visit id if none of the copies have one
+    is_lowest_visit = np.where(
+        is_missing_visit_id,
+        ~has_lowest_visit[code_groups],
+        has_lowest_visit[code_groups] & (visit_ids == lowest_visits[code_groups]),
+    )
+    keep = ~is_billing | is_lowest_visit
+
+    # Billing codes with a visit id move to the end of their visit
+    is_moved = is_billing & is_lowest_visit & ~is_missing_visit_id
+    if np.any(is_moved & ~has_visit_end[visit_groups]):
+        row = np.flatnonzero(is_moved & ~has_visit_end[visit_groups])[0]
+        patient_id = _get_patient_id(measurements, row)
+        raise RuntimeError(f"Expected visit end for code {patient_id} {measurements.slice(row, 1)}")
+
+    moved_visit_ends = visit_ends[visit_groups]
+    ends = np.where(is_moved & ~np.isnat(ends), np.maximum(ends, moved_visit_ends), ends)
+    times = np.where(is_moved, np.maximum(times, moved_visit_ends), times)
+
+    measurements = _set_ends(_set_times(measurements, times), ends)
+    split = _split_moved(measurements, is_moved)
+    return defer_sort_events(measurements.filter(pa.array(keep)), split[keep])
+
+
+def apply_stanford_transforms(patients: pa.Table) -> pa.Table:
+    """Apply all Stanford transforms to a table of MEDS patients.
+
+    This produces the same result as applying move_pre_birth, move_visit_start_to_first_event_start, move_to_day_end,
+    switch_to_icd10cm, move_billing_codes and then remove_nones and delta_encode (both of which skip visit
+    measurements) from femr.transforms.stanford to every patient, but only sorts the events once.
+    """
+    return femr.transforms.columnar.apply_transforms(
+        patients,
+        [
+            move_pre_birth,
+            move_visit_start_to_first_event_start,
+            move_to_day_end,
+            switch_to_icd10cm,
+            move_billing_codes,
+            functools.partial(femr.transforms.columnar.remove_nones, do_not_apply_to_filter=_IS_VISIT),
+            functools.partial(femr.transforms.columnar.delta_encode, do_not_apply_to_filter=_IS_VISIT),
+        ],
+    )
@@ -100,3 +100,44 @@ def run_test_for_labeler(
             true_labels,
             help_text=help_text,
         )
+
+
+def create_test_model(path: str, dataset: datasets.Dataset, ontology: Any = None, **transformer_kwargs: Any) -> str:
+    """Train a tokenizer on `dataset`, and save it together with a small randomly initialized FEMRModel in `path`.
+
+    The model can be loaded with from_pretrained or passed to compute_features.
+    """
+    # The model code is only imported by the tests that need it
+    import femr.models.config
+    import femr.models.tokenizer
+    import femr.models.transformer
+
+    tokenizer = femr.models.tokenizer.train_tokenizer(
+        dataset, vocab_size=100, is_hierarchical=ontology is not None, ontology=ontology
+    )
+
+    config_kwargs = dict(
+        vocab_size=tokenizer.vocab_size,
+        is_hierarchical=tokenizer.is_hierarchical,
+        hidden_size=32,
+        intermediate_size=64,
+        n_heads=4,
+        n_layers=2,
+    )
+    config_kwargs.update(transformer_kwargs)
+    transformer_config = femr.models.config.FEMRTransformerConfig(**config_kwargs)
+    config = femr.models.config.FEMRModelConfig.from_transformer_task_configs(transformer_config, None)
+
+    model = femr.models.transformer.FEMRModel(config)
+    model.save_pretrained(path)
+    tokenizer.save_pretrained(path)
+
+    return str(path)
+
+
+def create_test_labels(num_patients: int) -> List[meds.Label]:
+    """One label per patient of `create_patients_dataset`, after the last event."""
+    return [
+        {"patient_id": patient_id, "prediction_time": datetime.datetime(2016, 3, 2), "boolean_value": False}
+        for patient_id in range(num_patients)
+    ]
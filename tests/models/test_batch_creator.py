@@ -197,3 +197,47 @@ def test_split_patients_concat_task():
     data_for_part2 = creator.get_batch_data()
 
     assert_two_batches_equal_third(data_for_part1, data_for_part2, data_for_patient)
+
+
+def test_timeline_task_windows():
+    tokenizer = DummyTokenizer()
+
+    fake_patients = create_patients_dataset(10)
+
+    fake_patient = fake_patients[1]
+
+    creator = femr.models.processor.BatchCreator(tokenizer, task=femr.models.tasks.TimelineTask("token"))
+    creator.start_batch()
+    creator.add_patient(fake_patient)
+    full = creator.get_batch_data()
+
+    # Every distinct time gets exactly one label, on the last token at that time
+    label_timestamps = full["transformer"]["timestamps"][full["transformer"]["label_indices"]].tolist()
+    assert label_timestamps == sorted(set(full["transformer"]["timestamps"].tolist()))
+
+    day_task = femr.models.tasks.TimelineTask("day")
+    creator = femr.models.processor.BatchCreator(tokenizer, task=day_task)
+    creator.start_batch()
+    creator.add_patient(fake_patient)
+    days = creator.get_batch_data()
+    assert len(days["transformer"]["label_indices"]) == len(
+        {datetime.datetime.fromtimestamp(t, datetime.timezone.utc).date() for t in label_timestamps}
+    )
+
+    # Overlapping windows must reproduce every label exactly once
+    task = femr.models.tasks.TimelineTask("token", window_overlap=2)
+    processor = femr.models.processor.FEMRBatchProcessor(tokenizer, task=task)
+    batch = fake_patients[1:2]
+    lengths = femr.models.processor.map_preliminary_batch_stats(batch, [0], processor=processor, max_length=5)[0]
+
+    assert len(lengths) > 1
+
+    windowed_timestamps = []
+    creator = processor.creator
+    for patient_index, offset, length, label_offset in lengths:
+        creator.start_batch()
+        creator.add_patient(fake_patient, offset, length, label_offset)
+        data = creator.get_batch_data()
+        windowed_timestamps.extend(data["transformer"]["timestamps"][data["transformer"]["label_indices"]].tolist())
+
+    assert windowed_timestamps == label_timestamps
@@ -0,0 +1,53 @@
+import torch
+
+import femr.models.tasks
+import femr.models.transformer
+
+
+class DummyTokenizer:
+    def __init__(self, weights):
+        self.dictionary = {
+            "vocab": [{"type": "code", "code_string": str(i), "weight": w} for i, w in enumerate(weights)]
+        }
+
+
+def test_adaptive_cutoffs():
+    tokenizer = DummyTokenizer([-0.5, -0.3, -0.1, -0.05, -0.03, -0.01, -0.01])
+
+    task = femr.models.tasks.CLMBRTask.with_adaptive_softmax(tokenizer, 6, weight_fractions=(0.8, 0.95))
+
+    # The first two tokens have 80% of the weight of the first six, the first four have 95%
+    assert task.adaptive_cutoffs == [2, 4]
+    assert task.get_task_config().task_kwargs == {"clmbr_vocab_size": 6, "adaptive_cutoffs": [2, 4]}
+
+    plain_task = femr.models.tasks.CLMBRTask(6)
+    assert plain_task.get_task_config().task_kwargs == {"clmbr_vocab_size": 6}
+
+    # Both fractions are only reached by the last token, so no cluster is left
+    tiny_task = femr.models.tasks.CLMBRTask.with_adaptive_softmax(DummyTokenizer([-1.0, -1.0]), 2)
+    assert tiny_task.adaptive_cutoffs is None
+    assert tiny_task.get_task_config().task_kwargs == {"clmbr_vocab_size": 2}
+
+
+def test_adaptive_softmax_head():
+    torch.manual_seed(0)
+    features = torch.randn(12, 8)
+    batch = {"labels": torch.randint(0, 6, (12,), dtype=torch.int32)}
+
+    head = femr.models.transformer.CLMBRTaskHead(8, 6, adaptive_cutoffs=[2, 4])
+
+    loss, result = head(features, batch)
+    assert result["logits"] is None
+    assert loss.shape == () and torch.isfinite(loss)
+
+    loss.backward()
+    assert all(param.grad is not None for param in head.parameters())
+
+    logits_loss, result = head(features, batch, return_logits=True)
+    torch.testing.assert_close(logits_loss, loss)
+
+    # The logits are log probabilities over the full vocabulary, which match the loss
+    log_probs = result["logits"]
+    assert log_probs.shape == (12, 6)
+    torch.testing.assert_close(log_probs.exp().sum(dim=-1), torch.ones(12))
+    torch.testing.assert_close(torch.nn.functional.nll_loss(log_probs, batch["labels"].long()), loss)
@@ -0,0 +1,85 @@
+import torch
+
+import femr.models.config
+import femr.models.transformer
+
+
+def create_model(checkpoint_blocks: str) -> femr.models.transformer.FEMRModel:
+    transformer_config = femr.models.config.FEMRTransformerConfig(
+        vocab_size=10,
+        hidden_size=16,
+        intermediate_size=32,
+        n_heads=4,
+        n_layers=2,
+        checkpoint_blocks=checkpoint_blocks,
+    )
+    task_config = femr.models.config.FEMRTaskConfig(task_type="clmbr", task_kwargs={"clmbr_vocab_size": 10})
+    config = femr.models.config.FEMRModelConfig.from_transformer_task_configs(transformer_config, task_config)
+    return femr.models.transformer.FEMRModel(config)
+
+
+def create_batch():
+    patient_lengths = [5, 3, 8]
+    num_tokens = sum(patient_lengths)
+    ages = torch.cat([torch.arange(length, dtype=torch.float32) * 10 for length in patient_lengths])
+    batch = {
+        "transformer": {
+            "tokens": torch.randint(0, 10, (num_tokens,)),
+            "ages": ages,
+            "normalized_ages": ages / 100,
+            "patient_lengths": torch.tensor(patient_lengths),
+            "label_indices": torch.arange(num_tokens),
+            "timestamps": torch.arange(num_tokens),
+        },
+        "task": {"labels": torch.randint(0, 10, (num_tokens,))},
+        "patient_ids": torch.zeros(num_tokens, dtype=torch.int64),
+    }
+    # FEMRModel removes the batch dimension added by the data loader
+    return {
+        k: {k2: v2.unsqueeze(0) for k2, v2 in v.items()} if isinstance(v, dict) else v.unsqueeze(0)
+        for k, v in batch.items()
+    }
+
+
+def compute_loss_and_gradients(model, batch):
+    model.zero_grad()
+    loss, _ = model(batch)
+    loss.backward()
+    return loss.detach(), {name: param.grad.clone() for name, param in model.named_parameters()}
+
+
+def test_checkpoint_blocks_match_no_checkpointing():
+    torch.manual_seed(0)
+    batch = create_batch()
+
+    reference = create_model("layer")
+    reference.train()
+    expected_loss, expected_gradients = compute_loss_and_gradients(reference, batch)
+
+    for checkpoint_blocks in ("layer", "attention", "feed_forward"):
+        model = create_model(checkpoint_blocks)
+        model.load_state_dict(reference.state_dict())
+        model.gradient_checkpointing_enable(gradient_checkpointing_kwargs={"use_reentrant": False})
+        model.train()
+
+        assert all(layer.gradient_checkpointing for layer in model.transformer.layers)
+
+        loss, gradients = compute_loss_and_gradients(model, batch)
+
+        torch.testing.assert_close(loss, expected_loss, msg=checkpoint_blocks)
+        assert gradients.keys() == expected_gradients.keys()
+        for name, gradient in gradients.items():
+            torch.testing.assert_close(gradient, expected_gradients[name], msg=f"{checkpoint_blocks} {name}")
+
+    # Layers enabled directly fall back to non reentrant torch checkpointing
+    model = create_model("attention")
+    model.load_state_dict(reference.state_dict())
+    for layer in model.transformer.layers:
+        layer.gradient_checkpointing = True
+    model.train()
+
+    loss, gradients = compute_loss_and_gradients(model, batch)
+
+    torch.testing.assert_close(loss, expected_loss)
+    for name, gradient in gradients.items():
+        torch.testing.assert_close(gradient, expected_gradients[name], msg=name)
@@ -0,0 +1,52 @@
+import torch
+import xformers.ops
+
+import femr.models.config
+import femr.models.transformer
+import femr.models.xformers
+
+
+def test_convert_to_grouped_query_attention():
+    transformer_config = femr.models.config.FEMRTransformerConfig(
+        vocab_size=10, hidden_size=8, intermediate_size=4, n_heads=4, n_layers=1
+    )
+    config = femr.models.config.FEMRModelConfig.from_transformer_task_configs(transformer_config, None)
+    model = femr.models.transformer.FEMRModel(config)
+
+    old_weight = model.transformer.layers[0].input_proj.weight.detach().clone()
+    old_bias = model.transformer.layers[0].input_proj.bias.detach().clone()
+
+    femr.models.transformer.convert_to_grouped_query_attention(model, 2)
+
+    assert model.config.transformer_config.n_kv_heads == 2
+
+    new_weight = model.transformer.layers[0].input_proj.weight
+    new_bias = model.transformer.layers[0].input_proj.bias
+
+    # 4 feed forward rows, 8 query rows and 2 heads of size 2 for both keys and values
+    assert new_weight.shape == (4 + 8 + 4 + 4, 8)
+
+    # Feed forward and query projections are unchanged
+    torch.testing.assert_close(new_weight[:12], old_weight[:12])
+    torch.testing.assert_close(new_bias[:12], old_bias[:12])
+
+    # The first key head is the mean of the first two original key heads
+    torch.testing.assert_close(new_weight[12:14], (old_weight[12:14] + old_weight[14:16]) / 2)
+    # The last value head is the mean of the last two original value heads
+    torch.testing.assert_close(new_bias[18:20], (old_bias[24:26] + old_bias[26:28]) / 2)
+
+
+def test_reference_attention_broadcasts_kv_heads():
+    torch.manual_seed(0)
+    q = torch.randn(1, 6, 4, 2)
+    k = torch.randn(1, 6, 2, 2)
+    v = torch.randn(1, 6, 2, 2)
+    attn_bias = xformers.ops.fmha.attn_bias.BlockDiagonalMask.from_seqlens([4, 2])
+
+    actual = femr.models.xformers.memory_efficient_attention_wrapper(q, k, v, attn_bias)
+
+    # Every k and v head is shared by a contiguous group of two q heads
+    expected = femr.models.xformers.ref_attention_bmhk(
+        q, k.repeat_interleave(2, dim=2), v.repeat_interleave(2, dim=2), attn_bias
+    )
+    torch.testing.assert_close(actual, expected)
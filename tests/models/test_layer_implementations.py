@@ -0,0 +1,61 @@
+import torch
+
+import femr.models.config
+import femr.models.transformer
+
+
+def create_batch(patient_lengths):
+    num_tokens = sum(patient_lengths)
+    ages = torch.cat([torch.arange(length, dtype=torch.float32) * 10 for length in patient_lengths])
+    return {
+        "tokens": torch.randint(0, 10, (num_tokens,)),
+        "ages": ages,
+        "normalized_ages": (ages - ages.mean()) / (ages.std() + 1),
+        "patient_lengths": torch.tensor(patient_lengths),
+    }
+
+
+def test_layer_implementations_match():
+    torch.manual_seed(0)
+
+    for use_normed_ages in (False, True):
+        transformers = {}
+        for implementation in ("eager", "fused", "compiled"):
+            config = femr.models.config.FEMRTransformerConfig(
+                vocab_size=10,
+                hidden_size=16,
+                intermediate_size=32,
+                n_heads=4,
+                n_layers=2,
+                use_normed_ages=use_normed_ages,
+                layer_implementation=implementation,
+            )
+            transformers[implementation] = femr.models.transformer.FEMRTransformer(config)
+
+            if implementation == "eager":
+                # A non trivial norm weight checks that it is folded into the input projection correctly
+                for layer in transformers["eager"].layers:
+                    torch.nn.init.uniform_(layer.norm.weight, 0.5, 1.5)
+            else:
+                transformers[implementation].load_state_dict(transformers["eager"].state_dict())
+
+        first_batch = create_batch([5, 3, 8])
+        # A different number of tokens, which must not recompile the compiled layers
+        second_batch = create_batch([7, 6])
+
+        with torch.no_grad():
+            for i, batch in enumerate((first_batch, second_batch)):
+                expected = transformers["eager"](batch)
+                for implementation in ("fused", "compiled"):
+                    if implementation == "compiled" and i > 0:
+                        with torch._dynamo.config.patch(error_on_recompile=True):
+                            actual = transformers[implementation](batch)
+                    else:
+                        actual = transformers[implementation](batch)
+                    torch.testing.assert_close(actual, expected, rtol=1e-4, atol=1e-4, msg=implementation)
+
+        # The fused norm and projection also has to be differentiable
+        batch = create_batch([4, 4])
+        expected_grad = torch.autograd.grad(transformers["eager"](batch).sum(), transformers["eager"].embed.weight)
+        actual_grad = torch.autograd.grad(transformers["fused"](batch).sum(), transformers["fused"].embed.weight)
+        torch.testing.assert_close(actual_grad, expected_grad, rtol=1e-4, atol=1e-4)
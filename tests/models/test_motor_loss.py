@@ -0,0 +1,43 @@
+import math
+
+import torch
+
+import femr.models.tasks
+import femr.models.transformer
+
+
+def test_sparse_loss_matches_dense():
+    time_bins = [0, 10, 100, float("inf")]
+    pretraining_task_info = [("a", 0.1), ("b", 0.2), ("c", 0.3), ("d", 0.01)]
+
+    task = femr.models.tasks.MOTORTask(pretraining_task_info, time_bins, 8)
+
+    batch = {
+        "censor_time": torch.tensor([5, 50, 500], dtype=torch.float32),
+        "time_sparse": {
+            # Includes events exactly on bin boundaries and an event at time zero
+            "data": torch.tensor([3, 10, 40, 0, 100, 1000], dtype=torch.float32),
+            "indices": torch.tensor([0, 2, 1, 3, 0, 2], dtype=torch.int32),
+            "indptr": torch.tensor([0, 2, 2, 6], dtype=torch.int32),
+        },
+    }
+
+    task.sparse_loss = False
+    dense_batch = task.cleanup(batch)
+
+    task.sparse_loss = True
+    sparse_batch = task.cleanup(batch)
+
+    assert sparse_batch["event_indices"].tolist() == [0, 0, 2, 2, 2]
+    assert sparse_batch["event_tasks"].tolist() == [0, 2, 1, 0, 2]
+
+    head = femr.models.transformer.MOTORTaskHead(16, pretraining_task_info, time_bins, 8)
+
+    torch.manual_seed(0)
+    features = torch.randn(3, 16)
+
+    dense_loss, _ = head(features, dense_batch)
+    sparse_loss, _ = head(features, sparse_batch)
+
+    # The dense formulation stores log times as float16
+    assert math.isclose(dense_loss.item(), sparse_loss.item(), rel_tol=1e-2)
@@ -0,0 +1,22 @@
+import pathlib
+
+from femr_test_tools import create_patients_dataset, create_test_labels, create_test_model
+
+import femr.models.representations
+import femr.models.transformer
+
+
+def test_bfloat16_compute_features_drift(tmp_path: pathlib.Path):
+    dataset = create_patients_dataset(10)
+    labels = create_test_labels(10)
+    model_path = create_test_model(str(tmp_path / "model"), dataset)
+
+    reference = femr.models.transformer.compute_features(dataset, model_path, labels)
+    candidate = femr.models.transformer.compute_features(dataset, model_path, labels, precision="bfloat16")
+
+    assert len(candidate["patient_ids"]) == len(labels)
+
+    # bfloat16 keeps about three significant digits
+    metrics = femr.models.representations.compare_representations(reference, candidate)
+    assert metrics["relative_error"] < 0.1, metrics
+    assert metrics["min_cosine_similarity"] > 0.95, metrics
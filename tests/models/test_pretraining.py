@@ -0,0 +1,108 @@
+import math
+import pickle
+from typing import Set
+
+import femr_test_tools
+import numpy as np
+
+import femr.models.pretraining
+import femr.models.tasks
+import femr.models.tokenizer
+
+
+class DummyOntology:
+    def get_all_parents(self, code: str) -> Set[str]:
+        if code == "2":
+            return {"2", "2_parent"}
+        else:
+            return {code}
+
+
+def test_single_pass_matches_separate_passes():
+    dataset = femr_test_tools.create_patients_dataset(10)
+    ontology = DummyOntology()
+
+    tokenizer = femr.models.tokenizer.train_tokenizer(dataset, vocab_size=100, ontology=ontology)
+    motor_task = femr.models.tasks.MOTORTask.fit_pretraining_task_info(
+        dataset, tokenizer, num_tasks=3, num_bins=4, final_layer_size=8
+    )
+
+    combined_tokenizer, combined_motor_task = femr.models.pretraining.train_tokenizer_and_motor_task(
+        dataset, vocab_size=100, num_tasks=3, num_bins=4, final_layer_size=8, ontology=ontology
+    )
+
+    assert combined_tokenizer.dictionary == tokenizer.dictionary
+
+    assert len(combined_motor_task.pretraining_task_info) == 3
+    for (code, rate), (expected_code, expected_rate) in zip(
+        combined_motor_task.pretraining_task_info, motor_task.pretraining_task_info
+    ):
+        assert code == expected_code
+        assert math.isclose(rate, expected_rate, rel_tol=1e-9)
+
+    # Time bins are computed from a histogram, so they only approximately match
+    time_bins = combined_motor_task.time_bins
+    assert len(time_bins) == 5
+    assert time_bins[0] == 0 and time_bins[-1] == float("inf")
+    assert time_bins == sorted(time_bins)
+
+
+def test_survival_statistics_histogram(monkeypatch):
+    # Fold the buffered events into the sparse histogram after every few events
+    monkeypatch.setattr(femr.models.pretraining, "_MAX_PENDING_HISTOGRAM_KEYS", 3)
+
+    first = femr.models.pretraining._SurvivalStatistics()
+    first.resize(2)
+    first.add(100.0, np.array([0, 1]), np.array([4.0, 70.0]))
+    first.add(100.0, np.array([0]), np.array([4.0]))
+    first.add(100.0, np.array([1]), np.array([70.0]))
+    first.codes = ["a", "b"]
+    first.trim()
+
+    second = femr.models.pretraining._SurvivalStatistics()
+    second.resize(2)
+    second.add(50.0, np.array([0, 1]), np.array([20.0, 4.0]))
+    second.codes = ["c", "a"]
+    second.trim()
+
+    first.combine(pickle.loads(pickle.dumps(second)))
+
+    assert first.codes == ["a", "b", "c"]
+    assert first.event_histogram.shape == (3, femr.models.pretraining._NUM_BUCKETS)
+
+    buckets = femr.models.pretraining._get_bucket(np.array([4.0, 20.0, 70.0]))
+    histogram, stats = first.get_task_stats(["a", "c", "missing"])
+
+    expected = np.zeros(femr.models.pretraining._NUM_BUCKETS, dtype=np.int64)
+    np.add.at(expected, buckets[[0, 0, 0, 1]], 1)
+    assert np.array_equal(histogram, expected)
+
+    assert [(censored, events) for censored, events, _ in stats] == [(1, 3), (3, 1), (4, 0)]
+
+    expected_times = [[4.0, 4.0, 100.0, 4.0], [100.0, 100.0, 100.0, 20.0], [100.0, 100.0, 100.0, 50.0]]
+    for (_, _, time_stats), times in zip(stats, expected_times):
+        assert time_stats.count == 4
+        assert math.isclose(time_stats.mean(), np.mean(times), rel_tol=1e-9)
+        assert math.isclose(time_stats.variance, 4 * np.var(times), rel_tol=1e-9)
+
+
+def test_survival_statistics_variance_precision():
+    # Times far from zero with a small spread, where summing raw squares cancels catastrophically
+    offset = 1e9
+    partials = []
+    for censor_times in ([offset + 1, offset + 2], [offset + 3, offset + 5]):
+        partial = femr.models.pretraining._SurvivalStatistics()
+        partial.resize(1)
+        for censor_seconds in censor_times:
+            partial.add(censor_seconds, np.array([0]), np.array([censor_seconds - 1]))
+        partial.codes = ["a"]
+        partial.trim()
+        partials.append(partial)
+
+    partials[0].combine(partials[1])
+    _, stats = partials[0].get_task_stats(["a", "missing"])
+
+    expected_times = [[offset, offset + 1, offset + 2, offset + 4], [offset + 1, offset + 2, offset + 3, offset + 5]]
+    for (_, _, time_stats), times in zip(stats, expected_times):
+        assert math.isclose(time_stats.mean(), np.mean(times), rel_tol=1e-12)
+        assert math.isclose(time_stats.variance, 4 * np.var(times), rel_tol=1e-9)
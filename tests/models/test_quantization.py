@@ -0,0 +1,54 @@
+import pathlib
+from typing import Set
+
+import torch
+from femr_test_tools import create_patients_dataset, create_test_labels, create_test_model
+
+import femr.models.quantization
+import femr.models.representations
+import femr.models.transformer
+
+
+class DummyOntology:
+    def get_all_parents(self, code: str) -> Set[str]:
+        if code == "2":
+            return {"2", "2_parent"}
+        else:
+            return {code}
+
+
+def test_quantize_pretrained_model(tmp_path: pathlib.Path):
+    dataset = create_patients_dataset(10)
+
+    for name, ontology in (("flat", None), ("hierarchical", DummyOntology())):
+        model_path = create_test_model(str(tmp_path / name), dataset, ontology=ontology)
+
+        model = femr.models.transformer.FEMRModel.from_pretrained(model_path)
+        model = femr.models.quantization.quantize_dynamic_int8(model)
+
+        transformer = model.transformer
+        embedding = transformer.embed_bag if ontology is not None else transformer.embed
+        assert isinstance(
+            embedding, (torch.ao.nn.quantized.Embedding, torch.ao.nn.quantized.EmbeddingBag)
+        ), f"{name} embedding was not quantized"
+        assert isinstance(transformer.layers[0].input_proj, torch.ao.nn.quantized.dynamic.Linear)
+        assert isinstance(transformer.layers[0].output_proj, torch.ao.nn.quantized.dynamic.Linear)
+
+
+def test_int8_compute_features_drift(tmp_path: pathlib.Path):
+    dataset = create_patients_dataset(10)
+    labels = create_test_labels(10)
+
+    for name, ontology in (("flat", None), ("hierarchical", DummyOntology())):
+        model_path = create_test_model(str(tmp_path / name), dataset, ontology=ontology)
+
+        reference = femr.models.transformer.compute_features(dataset, model_path, labels, ontology=ontology)
+        quantized = femr.models.transformer.compute_features(
+            dataset, model_path, labels, ontology=ontology, precision="int8"
+        )
+
+        assert len(quantized["patient_ids"]) == len(labels)
+
+        metrics = femr.models.representations.compare_representations(reference, quantized)
+        assert metrics["relative_error"] < 0.1, f"{name}: {metrics}"
+        assert metrics["min_cosine_similarity"] > 0.95, f"{name}: {metrics}"
@@ -0,0 +1,85 @@
+import datetime
+import pathlib
+
+import numpy as np
+import torch
+
+import femr.models.representations
+
+
+def write_representations(path, dtype):
+    writer = femr.models.representations.RepresentationWriter(4, 3, dtype=dtype, path=path)
+
+    features = torch.arange(12, dtype=torch.float32).reshape(4, 3) / 4
+    patient_ids = torch.tensor([10, 11, 10, 12], dtype=torch.int64)
+    timestamps = torch.tensor(
+        [
+            datetime.datetime(2020, 1, 1, tzinfo=datetime.timezone.utc).timestamp(),
+            datetime.datetime(2020, 1, 5, tzinfo=datetime.timezone.utc).timestamp(),
+            datetime.datetime(2020, 3, 1, tzinfo=datetime.timezone.utc).timestamp(),
+            datetime.datetime(2021, 1, 1, tzinfo=datetime.timezone.utc).timestamp(),
+        ],
+        dtype=torch.int64,
+    )
+
+    # Write out of order, as happens when batches are shuffled
+    writer.write(2, patient_ids[2:], timestamps[2:], features[2:])
+    writer.write(0, patient_ids[:2], timestamps[:2], features[:2])
+
+    return writer.finish(), features.numpy()
+
+
+def test_in_memory():
+    result, features = write_representations(None, "float32")
+
+    assert result["patient_ids"].tolist() == [10, 11, 10, 12]
+    assert result["feature_times"][3] == np.datetime64("2021-01-01T00:00:00")
+    np.testing.assert_array_equal(result["features"], features)
+
+
+def test_on_disk_round_trip(tmp_path: pathlib.Path):
+    for dtype in ("float32", "float16", "bfloat16"):
+        reader, features = write_representations(str(tmp_path / dtype), dtype)
+
+        assert len(reader) == 4
+        assert reader.patient_ids.tolist() == [10, 11, 10, 12]
+        # All of the test values are exactly representable in every storage type
+        np.testing.assert_array_equal(reader.get_features([3, 0, 1]), features[[3, 0, 1]])
+
+        reopened = femr.models.representations.load_representations(str(tmp_path / dtype))
+        np.testing.assert_array_equal(reopened.get_features(slice(None)), features)
+
+
+def test_join_labels(tmp_path: pathlib.Path):
+    reader, features = write_representations(str(tmp_path), "bfloat16")
+
+    labels = [
+        {"patient_id": 10, "prediction_time": datetime.datetime(2020, 2, 1), "boolean_value": True},
+        {"patient_id": 12, "prediction_time": datetime.datetime(2021, 1, 1), "boolean_value": False},
+        {"patient_id": 10, "prediction_time": datetime.datetime(2020, 3, 2), "boolean_value": False},
+    ]
+
+    joined = reader.join_labels(labels)
+
+    assert joined["patient_ids"].tolist() == [10, 10, 12]
+    assert joined["boolean_values"].tolist() == [True, False, False]
+    assert joined["feature_rows"].tolist() == [0, 2, 3]
+    np.testing.assert_array_equal(joined["features"], features[[0, 2, 3]])
+
+
+def test_compare_representations():
+    reference, features = write_representations(None, "float32")
+
+    # The same representations in a different row order, with a small amount of noise
+    order = np.array([3, 1, 0, 2])
+    candidate = {
+        "patient_ids": reference["patient_ids"][order],
+        "feature_times": reference["feature_times"][order],
+        "features": reference["features"][order] + 0.01,
+    }
+
+    metrics = femr.models.representations.compare_representations(reference, candidate)
+
+    assert abs(metrics["max_abs_error"] - 0.01) < 1e-6
+    assert abs(metrics["mean_abs_error"] - 0.01) < 1e-6
+    assert metrics["min_cosine_similarity"] > 0.99
@@ -1,5 +1,5 @@
 import datetime
-from typing import Set
+from typing import Dict, List, Set
 
 import femr.models.tasks
 
@@ -67,3 +67,37 @@ def test_calculator():
         datetime.timedelta(days=5),
         {"1": datetime.timedelta(days=5), "3": datetime.timedelta(days=5)},
     )
+
+
+def test_indexed_calculator():
+    patient = {
+        "patient_id": 100,
+        "events": [
+            {"time": datetime.datetime(1990, 1, 10), "measurements": [{"code": "1"}]},
+            {"time": datetime.datetime(1990, 1, 20), "measurements": [{"code": "2"}, {"code": "4"}]},
+            {"time": datetime.datetime(1990, 1, 25), "measurements": [{"code": "3"}]},
+            {"time": datetime.datetime(1990, 1, 25), "measurements": [{"code": "1"}]},
+            {"time": datetime.datetime(1990, 2, 3), "measurements": [{"code": "2"}]},
+        ],
+    }
+
+    task_to_index_map = {"3": 0, "1": 1, "2_parent": 2, "5": 3}
+    code_cache: Dict[str, List[int]] = {}
+
+    calculator = femr.models.tasks.SurvivalCalculator(DummyOntology(), patient, set(task_to_index_map))
+    indexed_calculator = femr.models.tasks.IndexedSurvivalCalculator(
+        DummyOntology(), patient, task_to_index_map, code_cache
+    )
+
+    assert code_cache == {"1": [1], "2": [2], "3": [0], "4": []}
+
+    for day in [1, 10, 11, 20, 25, 26, 33, 34]:
+        time = datetime.datetime(1990, 1, 1) + datetime.timedelta(days=day - 1)
+
+        censor_time, tte = calculator.get_future_events_for_time(time)
+        censor_seconds, task_indices, event_seconds = indexed_calculator.get_future_events_for_time(time)
+
+        assert censor_seconds == censor_time.total_seconds()
+        assert dict(zip(task_indices.tolist(), event_seconds.tolist())) == {
+            task_to_index_map[k]: v.total_seconds() for k, v in tte.items()
+        }
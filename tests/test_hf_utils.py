@@ -0,0 +1,89 @@
+import datetime
+import threading
+import time
+
+import pytest
+from femr_test_tools import create_patients_dataset
+
+import femr.hf_utils
+import femr.index
+import femr.memory
+from femr.labelers import TimeHorizon
+from femr.labelers.omop import CodeLabeler
+
+
+def _slow_ids_map(batch):
+    # Later batches finish first, which the fold has to put back in order
+    time.sleep(0.01 * (10 - batch["patient_id"][0] % 10))
+    return list(batch["patient_id"]), {threading.get_ident()}
+
+
+def _ids_agg(first, second):
+    return first[0] + second[0], first[1] | second[1]
+
+
+def test_thread_backend_keeps_order():
+    dataset = create_patients_dataset(40)
+
+    ids, threads = femr.hf_utils.aggregate_over_dataset(
+        dataset, _slow_ids_map, _ids_agg, batch_size=3, num_proc=4, backend="thread"
+    )
+
+    assert ids == list(range(40))
+    assert len(threads) > 1
+
+
+def test_thread_backend_matches_process_backend():
+    dataset = create_patients_dataset(20)
+    labeler = CodeLabeler(["2"], TimeHorizon(datetime.timedelta(days=0), datetime.timedelta(days=180)), ["3"])
+
+    expected = labeler.apply(dataset, num_proc=2, batch_size=3)
+
+    femr.hf_utils.set_default_backend("thread")
+    try:
+        labels = labeler.apply(dataset, num_proc=4, batch_size=3)
+        index = femr.index.PatientIndex(dataset, num_proc=4)
+    finally:
+        femr.hf_utils.set_default_backend("process")
+
+    assert labels == expected
+    assert index.index_map == {i: i for i in range(20)}
+
+
+def _failing_map(batch):
+    if len(batch["patient_id"]) > 4:
+        raise femr.memory.MemoryBudgetExceeded("Too many patients", can_shrink=True)
+    if 7 in batch["patient_id"]:
+        raise ValueError("Bad patient")
+    return len(batch["patient_id"])
+
+
+def test_thread_backend_errors():
+    dataset = create_patients_dataset(20)
+
+    with pytest.warns(UserWarning, match="batch size of 4"), pytest.raises(ValueError, match="Bad patient"):
+        femr.hf_utils.aggregate_over_dataset(
+            dataset, _failing_map, lambda a, b: a + b, batch_size=8, num_proc=4, backend="thread"
+        )
+
+
+def test_thread_backend_bounds_pending_results():
+    dataset = create_patients_dataset(40)
+    first_done = threading.Event()
+    started_early = []
+
+    def slow_first_map(batch):
+        if batch["patient_id"][0] == 0:
+            time.sleep(0.5)
+            first_done.set()
+        elif not first_done.is_set():
+            started_early.append(batch["patient_id"][0])
+        return list(batch["patient_id"])
+
+    ids = femr.hf_utils.aggregate_over_dataset(
+        dataset, slow_first_map, lambda a, b: a + b, batch_size=2, num_proc=2, backend="thread"
+    )
+
+    assert ids == list(range(40))
+    # The other thread waits once it is 2 * num_proc - 1 batches ahead of the first batch
+    assert len(started_early) == 3
@@ -0,0 +1,48 @@
+import math
+import pathlib
+
+import numpy as np
+import pyarrow.parquet as pq
+from femr_test_tools import create_patients_dataset
+
+import femr.meds_reader
+
+
+def test_meds_reader(tmp_path: pathlib.Path):
+    dataset = create_patients_dataset(25)
+    (tmp_path / "data").mkdir()
+    pq.write_table(dataset.data.table, tmp_path / "data" / "0.parquet", row_group_size=10)
+
+    vocabulary = ["2", "3", "1"]
+    reader = femr.meds_reader.MEDSReader(str(tmp_path), vocabulary=vocabulary, with_text_values=True)
+    assert len(reader) == 25
+
+    row_groups = list(reader.iter_row_groups())
+    assert [len(row_group) for row_group in row_groups] == [10, 10, 5]
+
+    spans = list(reader)
+    assert len(spans) == 25
+
+    for span, patient in zip(spans, dataset):
+        assert span.patient_id == patient["patient_id"]
+        assert span.num_events == len(patient["events"])
+        assert list(span.times.astype("datetime64[us]").tolist()) == [event["time"] for event in patient["events"]]
+
+        measurements = [measurement for event in patient["events"] for measurement in event["measurements"]]
+        assert span.num_measurements == len(measurements)
+        assert span.codes.to_pylist() == [measurement["code"] for measurement in measurements]
+        assert span.text_values.to_pylist() == [measurement["text_value"] for measurement in measurements]
+        assert list(span.code_ids) == [
+            vocabulary.index(m["code"]) if m["code"] in vocabulary else -1 for m in measurements
+        ]
+        for value, measurement in zip(span.numeric_values, measurements):
+            if measurement["numeric_value"] is None:
+                assert math.isnan(value)
+            else:
+                assert value == measurement["numeric_value"]
+
+        assert len(span.measurement_times) == len(measurements)
+
+        # Spans are views into the arrays of their row group
+        assert np.shares_memory(span.times, span.row_group.times)
+        assert np.shares_memory(span.code_ids, span.row_group.code_ids)
@@ -0,0 +1,143 @@
+import datetime
+
+import numpy as np
+import pytest
+from femr_test_tools import create_patients_dataset
+
+import femr.hf_utils
+import femr.memory
+from femr.labelers import TimeHorizon
+from femr.labelers.omop import CodeLabeler
+
+
+def test_memory_collects_worker_records():
+    dataset = create_patients_dataset(20)
+    labeler = CodeLabeler(["2"], TimeHorizon(datetime.timedelta(days=0), datetime.timedelta(days=180)), ["3"])
+
+    expected = labeler.apply(dataset, num_proc=2, batch_size=3)
+
+    femr.memory.enable()
+    try:
+        labels = labeler.apply(dataset, num_proc=2, batch_size=3)
+        records = femr.memory._accounting.records
+        report = femr.memory.get_report()
+    finally:
+        femr.memory.disable()
+
+    assert labels == expected
+
+    rss_pids = {pid for pid, name, _ in records if name == "rss"}
+    assert len(rss_pids) >= 2
+    assert all(nbytes > 0 for _, name, nbytes in records if name == "rss")
+
+    partial_pids = {pid for pid, name, _ in records if name == "partial _label_map_func"}
+    assert len(partial_pids) == 2
+    assert any(name == "pickled partial _label_map_func" for _, name, _ in records)
+    assert "aggregate _label_map_func" in report
+
+
+def test_memory_budget_fails_fast():
+    dataset = create_patients_dataset(20)
+    labeler = CodeLabeler(["2"], TimeHorizon(datetime.timedelta(days=0), datetime.timedelta(days=180)), ["3"])
+
+    femr.memory.set_budget("Labeler.apply", "1K")
+    try:
+        with pytest.raises(femr.memory.MemoryBudgetExceeded) as e:
+            labeler.apply(dataset, num_proc=2, batch_size=3)
+    finally:
+        femr.memory.clear_budgets()
+        femr.memory.disable()
+
+    assert not e.value.can_shrink
+    assert "Labeler.apply" in str(e.value)
+    assert "1.0 KiB" in str(e.value)
+
+
+def _count_map(batch):
+    if len(batch["patient_id"]) > 4:
+        raise femr.memory.MemoryBudgetExceeded("Too many patients", can_shrink=True)
+    return len(batch["patient_id"])
+
+
+def test_memory_budget_shrinks_batch_size():
+    dataset = create_patients_dataset(20)
+
+    with pytest.warns(UserWarning, match="batch size of 4"):
+        total = femr.hf_utils.aggregate_over_dataset(
+            dataset, _count_map, lambda a, b: a + b, batch_size=16, num_proc=1, stage="count"
+        )
+    assert total == 20
+
+    with pytest.raises(femr.memory.MemoryBudgetExceeded):
+        femr.hf_utils.aggregate_over_dataset(
+            dataset, _count_map, lambda a, b: a + b, batch_size=16, num_proc=1, stage="count", min_batch_size=8
+        )
+
+
+class _LargePartial:
+    """A partial result that takes 8 MiB per row in memory, but is pickled as just its number of rows."""
+
+    def __init__(self, num_rows):
+        self.num_rows = num_rows
+        # Filled with ones, so that every page counts towards the RSS
+        self.buffer = np.ones(num_rows << 20)
+
+    def __reduce__(self):
+        return (int, (self.num_rows,))
+
+
+def _large_map(batch):
+    return _LargePartial(len(batch["patient_id"]))
+
+
+def _large_agg(first, second):
+    return int(getattr(first, "num_rows", first)) + int(getattr(second, "num_rows", second))
+
+
+def test_memory_budget_splits_large_batches():
+    dataset = create_patients_dataset(20)
+
+    # Batches of 16 rows need 128 MiB on top of what is in use now, batches of 8 rows fit
+    femr.memory.set_budget("large", femr.memory.get_rss() + (96 << 20))
+    try:
+        with pytest.warns(UserWarning, match="batch size of 8"):
+            total = femr.hf_utils.aggregate_over_dataset(
+                dataset, _large_map, _large_agg, batch_size=16, num_proc=1, stage="large"
+            )
+        report = femr.memory.get_report()
+    finally:
+        femr.memory.clear_budgets()
+        femr.memory.disable()
+
+    assert total == 20
+    assert "partial _large_map" in report
+
+
+def test_memory_budget_rejects_threads():
+    dataset = create_patients_dataset(20)
+
+    femr.memory.set_budget("count", "64G")
+    try:
+        with pytest.raises(ValueError, match="more than one thread"):
+            femr.hf_utils.aggregate_over_dataset(
+                dataset, _count_map, lambda a, b: a + b, batch_size=4, num_proc=2, stage="count", backend="thread"
+            )
+
+        # A single thread is the only one in its process
+        total = femr.hf_utils.aggregate_over_dataset(
+            dataset, _count_map, lambda a, b: a + b, batch_size=4, num_proc=1, stage="count", backend="thread"
+        )
+    finally:
+        femr.memory.clear_budgets()
+        femr.memory.disable()
+
+    assert total == 20
+
+
+def test_parse_size():
+    assert femr.memory.parse_size(1024) == 1024
+    assert femr.memory.parse_size("512") == 512
+    assert femr.memory.parse_size("2K") == 2048
+    assert femr.memory.parse_size("1.5G") == 3 << 29
+    assert femr.memory.parse_size("4GiB") == 4 << 30
+    assert femr.memory.parse_size("3mb") == 3 << 20
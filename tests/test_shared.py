@@ -0,0 +1,86 @@
+import functools
+import os
+import pickle
+
+from femr_test_tools import create_patients_dataset
+
+import femr.hf_utils
+import femr.shared
+
+
+class LargeTable(femr.shared.Shareable):
+    # The number of times a table was unpickled in this process
+    num_unpickled = 0
+
+    def __init__(self, size: int):
+        self.values = {str(i): i for i in range(size)}
+
+    def __setstate__(self, state):
+        LargeTable.num_unpickled += 1
+        self.__dict__.update(state)
+
+
+class Holder:
+    def __init__(self, table: LargeTable):
+        self.table = table
+
+
+def _lookup_map(batch, *, holders):
+    table = holders[0].table
+    num_files = len(os.listdir(femr.shared._directory))
+    total = sum(table.values[str(patient_id)] for patient_id in batch["patient_id"])
+    return {os.getpid()}, total, LargeTable.num_unpickled, num_files
+
+
+def _lookup_agg(first, second):
+    return first[0] | second[0], first[1] + second[1], max(first[2], second[2]), max(first[3], second[3])
+
+
+def test_shareable_pickles_as_handle():
+    table = LargeTable(10_000)
+    full_size = len(pickle.dumps(table))
+
+    # Objects that are first registered while pickling, after forked workers could have started, get a file
+    with femr.shared.sharing():
+        data = pickle.dumps([table, table])
+        assert len(data) < full_size / 10
+
+        # Within this process, the registered object itself is returned
+        first, second = pickle.loads(data)
+        assert first is table and second is table
+
+        # A process that didn't inherit the registry loads the object from its file
+        (token,) = [token for token, obj in femr.shared._objects.items() if obj is table]
+        del femr.shared._objects[token]
+        loaded, _ = pickle.loads(data)
+        assert loaded is not table
+        assert loaded.values == table.values
+
+    assert femr.shared._objects == {}
+    assert len(pickle.dumps(table)) == full_size
+
+
+def test_aggregate_shares_arguments():
+    dataset = create_patients_dataset(20)
+    table = LargeTable(100)
+    LargeTable.num_unpickled = 0
+
+    pids, total, num_unpickled, num_files = femr.hf_utils.aggregate_over_dataset(
+        dataset,
+        functools.partial(_lookup_map, holders=[Holder(table)]),
+        _lookup_agg,
+        batch_size=3,
+        num_proc=2,
+    )
+
+    assert len(pids) == 2
+    assert total == sum(range(20))
+
+    if femr.shared._workers_are_forked():
+        # Workers attached to the table of the parent, which never had to be written or unpickled
+        assert num_unpickled == 0
+        assert num_files == 0
+    else:
+        # Every worker unpickles the table once, from its file
+        assert num_unpickled == 1
+        assert num_files == 1
@@ -0,0 +1,97 @@
+import json
+import os
+import sys
+
+import meds
+import numpy as np
+import pyarrow.parquet as pq
+import pytest
+
+import femr.index
+import femr.synthetic_data
+import femr.transforms.stanford_columnar
+
+
+def test_generate_dataset(tmp_path) -> None:
+    config = femr.synthetic_data.SyntheticDataConfig(seed=3, event_distribution="pareto", mean_events=20)
+    codes = femr.synthetic_data.get_default_codes(1_000)
+
+    femr.synthetic_data.generate_dataset(str(tmp_path / "serial"), codes, 1_000, 3, config, row_group_size=100)
+    femr.synthetic_data.generate_dataset(
+        str(tmp_path / "parallel"), codes, 1_000, 3, config, num_proc=2, row_group_size=100
+    )
+
+    shard_names = sorted(os.listdir(tmp_path / "serial" / "data"))
+    assert len(shard_names) == 3
+
+    tables = [pq.read_table(tmp_path / "serial" / "data" / shard_name) for shard_name in shard_names]
+    for shard_name, table in zip(shard_names, tables):
+        # The output does not depend on the number of processes
+        assert table.equals(pq.read_table(tmp_path / "parallel" / "data" / shard_name))
+
+    patients = [patient for table in tables for patient in table.to_pylist()]
+    assert [patient["patient_id"] for patient in patients] == list(range(1_000))
+
+    num_events = np.array([len(patient["events"]) for patient in patients])
+    # A heavy tail, with the birth event on top of the configured mean
+    assert 15 < num_events.mean() < 60
+    assert num_events.max() > 10 * np.median(num_events)
+
+    for patient in patients[:50]:
+        times = [event["time"] for event in patient["events"]]
+        assert times == sorted(times)
+        assert patient["events"][0]["measurements"][0]["code"] == meds.birth_code
+
+        visit_ids = set()
+        for event in patient["events"][1:]:
+            for measurement in event["measurements"]:
+                visit_ids.add(measurement["metadata"]["visit_id"])
+                if measurement["metadata"]["table"] == "visit":
+                    assert measurement["metadata"]["end"] >= event["time"]
+                else:
+                    assert measurement["code"] in codes
+        assert None not in visit_ids
+
+    with open(tmp_path / "serial" / "metadata.json") as f:
+        assert json.load(f)["synthetic_data_config"]["seed"] == 3
+
+    index = femr.index.PatientIndex.from_sharded_dataset(str(tmp_path / "serial"))
+    assert index.get_index(999) == 999
+
+    # The generated visits are consistent enough to run the Stanford transforms
+    femr.transforms.stanford_columnar.apply_stanford_transforms(tables[0])
+
+
+def test_generate_synthetic_data_program(tmp_path, monkeypatch):
+    monkeypatch.setattr(
+        sys,
+        "argv",
+        [
+            "femr_generate_synthetic_data",
+            str(tmp_path / "output"),
+            "--num_patients",
+            "20",
+            "--mean_events",
+            "12.5",
+            "--mean_days_between_events",
+            "1.5",
+        ],
+    )
+    femr.synthetic_data.femr_generate_synthetic_data_program()
+
+    with open(tmp_path / "output" / "metadata.json") as f:
+        config = json.load(f)["synthetic_data_config"]
+
+    # Float fields accept fractional values, even though their defaults are round numbers
+    assert config["mean_events"] == 12.5
+    assert config["mean_days_between_events"] == 1.5
+    assert config["mean_measurements_per_event"] == 2.0
+
+
+def test_synthetic_data_config_validation():
+    with pytest.raises(ValueError, match="mean_measurements_per_event"):
+        femr.synthetic_data.SyntheticDataConfig(mean_measurements_per_event=0.5)
+    with pytest.raises(ValueError, match="shape above 1"):
+        femr.synthetic_data.SyntheticDataConfig(event_distribution="pareto", pareto_shape=1.0)
+    with pytest.raises(ValueError, match="Unknown event distribution"):
+        femr.synthetic_data.SyntheticDataConfig(event_distribution="uniform")
@@ -0,0 +1,59 @@
+import datetime
+import json
+import pathlib
+
+from femr_test_tools import NUM_EVENTS, create_patients_dataset
+
+import femr.tracing
+from femr.labelers import TimeHorizon
+from femr.labelers.omop import CodeLabeler
+
+
+def test_tracing_collects_worker_spans(tmp_path: pathlib.Path):
+    dataset = create_patients_dataset(20)
+    labeler = CodeLabeler(["2"], TimeHorizon(datetime.timedelta(days=0), datetime.timedelta(days=180)), ["3"])
+
+    expected = labeler.apply(dataset, num_proc=2, batch_size=3)
+
+    femr.tracing.enable()
+    try:
+        labels = labeler.apply(dataset, num_proc=2, batch_size=3)
+
+        summary = femr.tracing.get_summary()
+        femr.tracing.write_chrome_trace(str(tmp_path / "trace.json"))
+        stats = femr.tracing._tracer.stats
+    finally:
+        femr.tracing.disable()
+
+    assert labels == expected
+
+    assert stats["Labeler.apply"][0] == 1
+    assert stats["Labeler.apply"][3]["labels"] == len(labels)
+
+    # Every patient is mapped exactly once, with both workers splitting their 10 patients into 4 batches
+    assert stats["map _label_map_func"][0] == 8
+    assert stats["decode _label_map_func"][0] == 8
+    assert stats["decode _label_map_func"][3]["patients"] == 20
+    assert stats["decode _label_map_func"][3]["measurements"] == 20 * NUM_EVENTS
+    assert stats["pickle _label_map_func"][3]["bytes"] == stats["unpickle _label_map_func"][3]["bytes"]
+    assert stats["fold _label_map_func"][0] == 8
+
+    assert "map _label_map_func" in summary
+
+    with open(tmp_path / "trace.json") as f:
+        trace = json.load(f)
+
+    map_events = [event for event in trace["traceEvents"] if event["name"] == "map _label_map_func"]
+    assert len({event["pid"] for event in map_events}) == 2
+
+    (apply_event,) = [event for event in trace["traceEvents"] if event["name"] == "Labeler.apply"]
+    for event in map_events:
+        assert apply_event["ts"] <= event["ts"] <= apply_event["ts"] + apply_event["dur"]
+
+
+def test_tracing_disabled():
+    with femr.tracing.span("unused") as span:
+        span.count("patients", 1)
+    femr.tracing.count("patients", 1)
+
+    assert not femr.tracing.is_enabled()
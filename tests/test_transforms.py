@@ -1,15 +1,31 @@
 from __future__ import annotations
 
+import copy
 import datetime
+import functools
+import json
+import os
+import random
+import sys
 
 import meds
-
-from femr.transforms import delta_encode, remove_nones
+import numpy as np
+import pyarrow as pa
+import pyarrow.compute as pc
+import pyarrow.parquet as pq
+import pytest
+
+import femr.index
+import femr.post_etl_pipelines.stanford
+import femr.transforms.columnar
+import femr.transforms.stanford_columnar
+from femr.transforms import delta_encode, fix_events, remove_nones
 from femr.transforms.stanford import (
     move_billing_codes,
     move_pre_birth,
     move_to_day_end,
     move_visit_start_to_first_event_start,
+    switch_to_icd10cm,
 )
 
 
@@ -427,3 +443,344 @@ def test_move_billing_codes() -> None:
     print(expected)
 
     assert move_billing_codes(patient) == expected
+
+
+def create_random_stanford_patient(rng: random.Random):
+    birth = datetime.datetime(1990, 1, 1) + datetime.timedelta(days=rng.randint(0, 10))
+
+    events = [{"time": birth, "measurements": [{"code": meds.birth_code, "metadata": {"visit_id": None}}]}]
+
+    def random_time(start):
+        # Many times are at midnight, so that move_to_day_end has something to do
+        time = start + datetime.timedelta(days=rng.randint(-2, 3))
+        if rng.random() < 0.5:
+            time += datetime.timedelta(minutes=rng.randint(1, 24 * 60 - 1))
+        return time
+
+    def random_measurement(visit_id, **metadata):
+        measurement = {
+            "code": rng.choice(["ICD10/A", "ICD10/B", "LOINC/1", "LOINC/2", "Visit/IP"]),
+            "metadata": {"visit_id": visit_id, **metadata},
+        }
+        value_type = rng.choice(["none", "none", "numeric", "text"])
+        if value_type == "numeric":
+            measurement["numeric_value"] = rng.choice([1.0, 2.0])
+        elif value_type == "text":
+            measurement["text_value"] = rng.choice(["a", "b"])
+        return measurement
+
+    for _ in range(rng.randint(0, 3)):
+        # Events before birth, some of which are dropped
+        events.append(
+            {
+                "time": birth - datetime.timedelta(days=rng.choice([1, 20, 40])),
+                "measurements": [random_measurement(None, end=birth - datetime.timedelta(days=1))],
+            }
+        )
+
+    for visit_id in range(rng.randint(1, 4)):
+        visit_start = random_time(birth + datetime.timedelta(days=5 * visit_id + 3))
+        visit_end = visit_start + datetime.timedelta(days=rng.randint(0, 2), hours=rng.randint(0, 5))
+
+        visit_measurements = [
+            {"code": "Visit/IP", "metadata": {"visit_id": visit_id, "table": "visit", "end": visit_end}},
+            {"code": "Visit/Enc", "metadata": {"visit_id": visit_id, "clarity_table": "shc_pat_enc", "end": visit_end}},
+        ]
+        rng.shuffle(visit_measurements)
+        events.append({"time": visit_start, "measurements": visit_measurements})
+
+        for _ in range(rng.randint(0, 6)):
+            billing_table = rng.choice(["shc_pat_enc_dx", "lpch_hsp_acct_dx_list", None])
+            if billing_table is not None:
+                measurement = random_measurement(
+                    rng.choice([visit_id, visit_id + 1, None]), clarity_table=billing_table
+                )
+                if measurement["metadata"]["visit_id"] == visit_id + 1:
+                    # Billing codes can only refer to visits with a known end
+                    measurement["metadata"]["visit_id"] = visit_id
+            else:
+                measurement = random_measurement(rng.choice([visit_id, None]))
+
+            time = visit_start if rng.random() < 0.5 else random_time(visit_start)
+            events.append({"time": time, "measurements": [measurement]})
+
+    for _ in range(rng.randint(0, 5)):
+        # Repeat some events, with identical times and codes, to exercise remove_nones and delta_encode
+        event = rng.choice(events[1:])
+        events.append(copy.deepcopy(event))
+
+    events.sort(key=lambda a: a["time"])
+
+    # Merge some events that share a time
+    merged_events = []
+    for event in events:
+        if merged_events and merged_events[-1]["time"] == event["time"] and rng.random() < 0.5:
+            merged_events[-1]["measurements"].extend(event["measurements"])
+        else:
+            merged_events.append(event)
+
+    patient = {"patient_id": rng.randint(0, 100), "events": merged_events}
+    cleanup(patient)
+    return patient
+
+
+def apply_stanford_transforms(patient):
+    """The per patient transforms that femr.transforms.stanford_columnar.apply_stanford_transforms applies."""
+
+    def is_visit(measurement):
+        return measurement["metadata"]["table"] == "visit"
+
+    chain = [
+        move_pre_birth,
+        move_visit_start_to_first_event_start,
+        move_to_day_end,
+        switch_to_icd10cm,
+        move_billing_codes,
+        functools.partial(remove_nones, do_not_apply_to_filter=is_visit),
+        functools.partial(delta_encode, do_not_apply_to_filter=is_visit),
+    ]
+    return functools.reduce(lambda r, f: f(r), chain, patient)
+
+
+def test_stanford_patient_hash() -> None:
+    rng = random.Random(1234)
+    patients = [create_random_stanford_patient(rng) for _ in range(10)]
+    for i, patient in enumerate(patients):
+        patient["patient_id"] = i
+    table = pa.Table.from_pylist(patients)
+
+    get_patient_hashes = femr.post_etl_pipelines.stanford._get_patient_hashes
+
+    # The hash of a patient doesn't depend on the other patients in the table
+    hashes = get_patient_hashes(table)
+    assert list(get_patient_hashes(table.slice(3, 4))) == list(hashes[3:7])
+    assert list(get_patient_hashes(table.take([5, 2]))) == [hashes[5], hashes[2]]
+    assert len(set(hashes)) == len(hashes)
+
+    for change in range(3):
+        changed = copy.deepcopy(patients)
+        if change == 0:
+            changed[4]["events"][0]["time"] += datetime.timedelta(microseconds=1)
+        elif change == 1:
+            changed[4]["events"][-1]["measurements"][0]["code"] += "1"
+        else:
+            # Moving a measurement into the previous event changes the patient
+            moved = changed[4]["events"][-1]["measurements"].pop()
+            changed[4]["events"][-2]["measurements"].append(moved)
+
+        changed_hashes = get_patient_hashes(pa.Table.from_pylist(changed, schema=table.schema))
+        assert changed_hashes[4] != hashes[4]
+        assert list(np.delete(changed_hashes, 4)) == list(np.delete(hashes, 4))
+
+
+def test_stanford_omop_fixer_shards(tmp_path) -> None:
+    rng = random.Random(4321)
+
+    os.mkdir(tmp_path / "source")
+    for folder in ("target", "target/data", "target/patient_hashes"):
+        os.mkdir(tmp_path / folder)
+
+    expected = []
+    tasks = []
+    for shard in range(2):
+        patients = [create_random_stanford_patient(rng) for _ in range(20)]
+        for i, patient in enumerate(patients):
+            patient["patient_id"] = shard * 100 + i
+
+        source_path = str(tmp_path / "source" / f"{shard}.parquet")
+        pq.write_table(pa.Table.from_pylist(patients), source_path)
+        tasks.append((source_path, str(tmp_path / "target"), 7, None, True))
+
+        # Read back through parquet, so that all patients have the same fields
+        expected.extend(apply_stanford_transforms(p) for p in pq.read_table(source_path).to_pylist())
+
+    shards = [femr.post_etl_pipelines.stanford._process_shard(task) for task in tasks]
+
+    assert shards[1] == {
+        "file": "1.parquet",
+        "num_patients": 20,
+        "min_patient_id": 100,
+        "max_patient_id": 119,
+        "num_transformed": 20,
+    }
+
+    actual = []
+    for shard in range(2):
+        output = pq.ParquetFile(tmp_path / "target" / "data" / f"{shard}.parquet")
+        assert output.metadata.num_row_groups == 3
+        actual.extend(output.read().to_pylist())
+
+    assert actual == expected
+
+    femr.index.write_shard_manifest(str(tmp_path / "target"), shards)
+    index = femr.index.PatientIndex.from_sharded_dataset(str(tmp_path / "target"))
+
+    assert index.get_index(5) == 5
+    assert index.get_index(105) == 25
+    assert list(index.get_indices([119, 0, 100])) == [39, 0, 20]
+    assert index.get_patient_ids() == list(range(20)) + list(range(100, 120))
+    with pytest.raises(KeyError):
+        index.get_index(50)
+
+
+def run_stanford_omop_fixer(monkeypatch, *args) -> None:
+    monkeypatch.setattr(sys, "argv", ["femr_stanford_omop_fixer", *args])
+    femr.post_etl_pipelines.stanford.femr_stanford_omop_fixer_program()
+
+
+def test_stanford_omop_fixer_incremental(tmp_path, monkeypatch) -> None:
+    rng = random.Random(1234)
+
+    patients = [create_random_stanford_patient(rng) for _ in range(30)]
+    for i, patient in enumerate(patients):
+        patient["patient_id"] = i
+
+    # Refreshed extracts keep the same schema
+    schema = pa.Table.from_pylist(patients).schema
+
+    def write_source(name, patients):
+        os.makedirs(tmp_path / name / "data")
+        with open(tmp_path / name / "metadata.json", "w") as f:
+            json.dump({"dataset_name": name}, f)
+        for shard in range(2):
+            pq.write_table(
+                pa.Table.from_pylist(
+                    patients[shard * len(patients) // 2 : (shard + 1) * len(patients) // 2], schema=schema
+                ),
+                tmp_path / name / "data" / f"{shard}.parquet",
+            )
+
+    write_source("first", patients)
+    run_stanford_omop_fixer(
+        monkeypatch, str(tmp_path / "first"), str(tmp_path / "first_output"), "--write_patient_hashes"
+    )
+
+    # Change one patient, remove another, add a new one and move a patient to a different shard
+    refreshed = [copy.deepcopy(patient) for patient in patients]
+    refreshed[3]["events"][-1]["time"] += datetime.timedelta(days=1)
+    del refreshed[10]
+    new_patient = create_random_stanford_patient(rng)
+    new_patient["patient_id"] = 100
+    refreshed.append(new_patient)
+    refreshed.insert(20, refreshed.pop(5))
+
+    write_source("second", refreshed)
+    run_stanford_omop_fixer(
+        monkeypatch,
+        str(tmp_path / "second"),
+        str(tmp_path / "second_output"),
+        "--previous_dataset",
+        str(tmp_path / "first_output"),
+        "--row_group_size",
+        "4",
+    )
+    run_stanford_omop_fixer(monkeypatch, str(tmp_path / "second"), str(tmp_path / "full_output"))
+
+    def read_output(name):
+        return pa.concat_tables(
+            pq.read_table(tmp_path / name / "data" / f"{shard}.parquet") for shard in range(2)
+        ).to_pylist()
+
+    assert read_output("second_output") == read_output("full_output")
+
+    with open(tmp_path / "second_output" / "metadata.json") as f:
+        metadata = json.load(f)
+
+    assert metadata["dataset_name"] == "second"
+    assert [lineage["previous_dataset"] for lineage in metadata["post_etl_lineage"]] == [
+        None,
+        str(tmp_path / "first_output"),
+    ]
+    assert metadata["post_etl_lineage"][-1]["num_patients"] == 30
+    assert metadata["post_etl_lineage"][-1]["num_transformed"] == 2
+    assert metadata["post_etl_lineage"][-1]["num_reused"] == 28
+
+
+def test_columnar_transforms_match() -> None:
+    rng = random.Random(5678)
+
+    patients = [create_random_stanford_patient(rng) for _ in range(200)]
+    for i, patient in enumerate(patients):
+        patient["patient_id"] = i
+    table = pa.Table.from_pylist(patients)
+
+    def is_visit(measurement):
+        return measurement["metadata"]["table"] == "visit"
+
+    columnar_is_visit = pc.field("metadata", "table") == "visit"
+
+    for transform, columnar_transform in [
+        (remove_nones, femr.transforms.columnar.remove_nones),
+        (delta_encode, femr.transforms.columnar.delta_encode),
+        (
+            functools.partial(remove_nones, do_not_apply_to_filter=is_visit),
+            functools.partial(femr.transforms.columnar.remove_nones, do_not_apply_to_filter=columnar_is_visit),
+        ),
+        (
+            functools.partial(delta_encode, do_not_apply_to_filter=is_visit),
+            functools.partial(femr.transforms.columnar.delta_encode, do_not_apply_to_filter=columnar_is_visit),
+        ),
+        (fix_events, femr.transforms.columnar.fix_events),
+    ]:
+        expected = [transform(patient) for patient in table.to_pylist()]
+        actual = femr.transforms.columnar.apply_transforms(table, [columnar_transform]).to_pylist()
+        assert actual == expected
+
+    # Patients can lose all of their events
+    empty = femr.transforms.columnar.apply_transforms(table.slice(0, 3), [lambda m: m.slice(0, 0)])
+    assert empty.to_pylist() == [{"patient_id": i, "events": []} for i in range(3)]
+
+
+def test_columnar_stanford_transforms_match() -> None:
+    rng = random.Random(8765)
+
+    patients = [create_random_stanford_patient(rng) for _ in range(500)]
+    for i, patient in enumerate(patients):
+        patient["patient_id"] = i
+    table = pa.Table.from_pylist(patients)
+
+    expected = [apply_stanford_transforms(patient) for patient in table.to_pylist()]
+    actual = femr.transforms.stanford_columnar.apply_stanford_transforms(table).to_pylist()
+    assert actual == expected
+
+    # Every stage also matches on its own, given the output of the previous stages
+    current = table
+    for transform, columnar_transform in [
+        (move_pre_birth, femr.transforms.stanford_columnar.move_pre_birth),
+        (
+            move_visit_start_to_first_event_start,
+            femr.transforms.stanford_columnar.move_visit_start_to_first_event_start,
+        ),
+        (move_to_day_end, femr.transforms.stanford_columnar.move_to_day_end),
+        (switch_to_icd10cm, femr.transforms.stanford_columnar.switch_to_icd10cm),
+        (move_billing_codes, femr.transforms.stanford_columnar.move_billing_codes),
+    ]:
+        expected = [transform(patient) for patient in current.to_pylist()]
+        actual = femr.transforms.columnar.apply_transforms(current, [columnar_transform]).to_pylist()
+        assert actual == expected
+        current = pa.Table.from_pylist(expected, schema=table.schema)
+
+
+def test_columnar_stanford_errors_report_patient_id() -> None:
+    rng = random.Random(1357)
+
+    patients = [create_random_stanford_patient(rng) for _ in range(3)]
+    for i, patient in enumerate(patients):
+        patient["patient_id"] = 1000 + i
+
+    # A second visit event for the same visit, at a different time
+    visit = next(
+        m for event in patients[2]["events"] for m in event["measurements"] if m["metadata"].get("table") == "visit"
+    )
+    last_time = patients[2]["events"][-1]["time"]
+    patients[2]["events"].append({"time": last_time + datetime.timedelta(days=100), "measurements": [visit]})
+
+    table = pa.Table.from_pylist(patients)
+
+    with pytest.raises(RuntimeError, match="for patient ID 1002"):
+        move_visit_start_to_first_event_start(table.to_pylist()[2])
+
+    with pytest.raises(RuntimeError, match="for patient ID 1002"):
+        femr.transforms.columnar.apply_transforms(
+            table, [femr.transforms.stanford_columnar.move_visit_start_to_first_event_start]
+        )
@@ -0,0 +1,117 @@
+"""
+Benchmark reduced precision CPU inference against float32.
+
+This runs femr.models.transformer.compute_features once per precision on the same labels and reports
+the throughput of each run, as well as how far its representations drift from the float32 ones.
+Only the inference span of femr.tracing is timed, which excludes indexing, batch creation and model loading,
+and an untimed warm up run comes first so that no precision runs on cold caches.
+
+bfloat16 only runs fast on CPUs with bfloat16 matrix units (AMX or AVX512-BF16), such as recent Xeons.
+
+How to run:
+```
+python cpu_precision.py <PATH TO MEDS DATASET> <PATH TO PRETRAINED MODEL> <PATH TO LABELS CSV> \
+    --ontology <(Optional) PATH TO PICKLED ONTOLOGY> --precisions float32 bfloat16 int8
+```
+
+Example: python cpu_precision.py ../../tutorials/input/meds ../../tutorials/input/clmbr_model \
+    ../../tutorials/input/labels.csv
+"""
+
+from __future__ import annotations
+
+import argparse
+import json
+import os
+import pickle
+
+import datasets
+import pyarrow.csv
+import torch
+
+import femr.models.representations
+import femr.models.transformer
+import femr.tracing
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Benchmark reduced precision CPU inference")
+    parser.add_argument("dataset", type=str, help="The path to a MEDS dataset")
+    parser.add_argument("model_path", type=str, help="The path to a pretrained FEMR model")
+    parser.add_argument("labels", type=str, help="A csv of MEDS labels to compute features for")
+    parser.add_argument("--ontology", type=str, default=None, help="A pickled ontology, for hierarchical models")
+    parser.add_argument(
+        "--precisions",
+        type=str,
+        nargs="+",
+        default=["float32", "bfloat16", "int8"],
+        help="The precisions to benchmark. float32 is always run as the reference.",
+    )
+    parser.add_argument("--tokens_per_batch", type=int, default=1024, help="The number of tokens per batch")
+    parser.add_argument("--num_threads", type=int, default=None, help="The number of torch threads to use")
+    parser.add_argument("--num_proc", type=int, default=1, help="The number of processes for batch creation")
+    parser.add_argument("--output", type=str, default=None, help="Where to write the results as json")
+
+    args = parser.parse_args()
+
+    if args.num_threads is not None:
+        torch.set_num_threads(args.num_threads)
+
+    dataset = datasets.Dataset.from_parquet(os.path.join(args.dataset, "data", "*"))
+    labels = pyarrow.csv.read_csv(args.labels).to_pylist()
+
+    ontology = None
+    if args.ontology is not None:
+        with open(args.ontology, "rb") as f:
+            ontology = pickle.load(f)
+
+    precisions = ["float32"] + [p for p in args.precisions if p != "float32"]
+
+    def run(precision):
+        return femr.models.transformer.compute_features(
+            dataset,
+            args.model_path,
+            labels,
+            num_proc=args.num_proc,
+            tokens_per_batch=args.tokens_per_batch,
+            ontology=ontology,
+            precision=precision,
+        )
+
+    # Warm up the caches, the allocator and the thread pool
+    run("float32")
+
+    results = {}
+    reference = None
+
+    for precision in precisions:
+        femr.tracing.enable()
+        features = run(precision)
+        elapsed = femr.tracing.get_stats()["inference"][1] / 1e9
+        femr.tracing.disable()
+
+        if reference is None:
+            reference = features
+
+        results[precision] = {
+            "inference_seconds": elapsed,
+            "representations_per_second": len(features["patient_ids"]) / elapsed,
+            **femr.models.representations.compare_representations(reference, features),
+        }
+
+    header = ("precision", "inference s", "reprs/s", "speedup", "max abs err", "min cosine")
+    print("{:<10} {:>11} {:>12} {:>8} {:>12} {:>11}".format(*header))
+    for precision, result in results.items():
+        print(
+            "{:<10} {:>11.2f} {:>12.1f} {:>8.2f} {:>12.2e} {:>11.6f}".format(
+                precision,
+                result["inference_seconds"],
+                result["representations_per_second"],
+                results["float32"]["inference_seconds"] / result["inference_seconds"],
+                result["max_abs_error"],
+                result["min_cosine_similarity"],
+            )
+        )
+
+    if args.output is not None:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=4)
@@ -0,0 +1,515 @@
+"""
+Benchmark the main FEMR stages end to end on synthetic data of a configurable size.
+
+The stages are run in order, as later stages depend on the output of earlier ones:
+    index: femr.index.PatientIndex
+    split: femr.splits.generate_hash_split
+    ontology: femr.ontology.Ontology and Ontology.prune_to_dataset
+    labeler: Labeler.apply of a CodeLabeler with one label per patient
+    featurizer: FeaturizerList.preprocess_featurizers and FeaturizerList.featurize
+    tokenizer: femr.models.tokenizer.train_tokenizer
+    convert: FEMRBatchProcessor.convert_dataset
+    model: forward and backward steps of a small FEMRModel with a CLMBR task
+    features: femr.models.transformer.compute_features
+
+For every stage the wall time, the throughput (patients/s and, where it applies, tokens/s or labels/s) and the peak RSS
+of the benchmark process are recorded. The peak RSS is reset before every stage through /proc/self/clear_refs, which
+needs Linux. Stages with num_proc > 1 do most of their work in worker processes. A background thread samples
+/proc/<pid>/status of every descendant process during the stage, which gives the largest peak RSS of a single worker
+(workers_peak_rss_mb) and the largest total RSS of all workers at once (workers_total_rss_mb). Workers that start and
+exit between two samples are missed.
+
+The batches of the convert stage are written to a fresh cache directory, so they are never reused from an earlier run.
+
+The synthetic dataset and Athena download are generated once in the work directory and reused by later runs, so that
+runs with the same arguments are comparable. Results can be compared against a baseline from an earlier run, which
+flags slower stages, lower throughput and higher peak memory. The script exits with a nonzero status on a regression.
+
+How to run:
+```
+python pipeline.py <WORK DIRECTORY> --num_patients 10000 --num_proc 4 --output results.json \
+    --baseline <(Optional) PATH TO BASELINE RESULTS JSON> --tolerance 0.2
+```
+
+Example: python pipeline.py /tmp/femr_benchmark --num_patients 10000 --stages index split ontology labeler featurizer
+"""
+
+from __future__ import annotations
+
+import argparse
+import datetime
+import json
+import os
+import resource
+import sys
+import tempfile
+import threading
+import time
+from typing import Any, Callable, Dict, List, Optional
+
+import datasets
+import pyarrow.compute as pc
+import pyarrow.parquet as pq
+import torch
+
+import femr.featurizers
+import femr.index
+import femr.labelers.core
+import femr.labelers.omop
+import femr.models.processor
+import femr.models.tasks
+import femr.models.tokenizer
+import femr.models.transformer
+import femr.ontology
+import femr.splits
+import femr.synthetic_data
+
+STAGES = ["index", "split", "ontology", "labeler", "featurizer", "tokenizer", "convert", "model", "features"]
+
+# Timings of stages this fast are mostly noise, so they are not compared against the baseline
+_MIN_COMPARED_SECONDS = 1.0
+
+# The number of child concepts under every synthetic parent concept
+_CODES_PER_PARENT = 10
+
+
+def _reset_peak_rss() -> None:
+    try:
+        with open("/proc/self/clear_refs", "w") as f:
+            f.write("5")
+    except OSError:
+        pass
+
+
+def _read_status_mb(pid: str, fields: List[str]) -> Optional[List[float]]:
+    """Read memory fields such as VmRSS from /proc/<pid>/status, or None if the process is gone."""
+    values = {}
+    try:
+        with open(f"/proc/{pid}/status") as f:
+            for line in f:
+                name, _, value = line.partition(":")
+                if name in fields:
+                    values[name] = int(value.split()[0]) / 1024
+    except (OSError, ValueError):
+        return None
+    return [values.get(field, 0.0) for field in fields]
+
+
+def _get_peak_rss_mb() -> float:
+    peak = _read_status_mb("self", ["VmHWM"])
+    if peak is not None:
+        return peak[0]
+    # ru_maxrss is in kilobytes on Linux, and is never reset
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / 1024
+
+
+def _get_descendants(pid: int) -> List[int]:
+    children: Dict[int, List[int]] = {}
+    for entry in os.listdir("/proc"):
+        if not entry.isdigit():
+            continue
+        try:
+            with open(f"/proc/{entry}/stat") as f:
+                stat = f.read()
+        except OSError:
+            continue
+        # The command name can contain spaces, so the fields are counted from its closing parenthesis
+        parent = int(stat.rpartition(")")[2].split()[1])
+        children.setdefault(parent, []).append(int(entry))
+
+    descendants = []
+    pending = [pid]
+    while pending:
+        for child in children.get(pending.pop(), []):
+            descendants.append(child)
+            pending.append(child)
+    return descendants
+
+
+class _WorkerRssSampler:
+    """Samples the RSS of the worker processes of this process in a background thread, while a stage runs."""
+
+    def __init__(self, interval: float = 0.1):
+        self.interval = interval
+        self.peak_rss_mb = 0.0
+        self.total_rss_mb = 0.0
+        self.is_stopped = threading.Event()
+        self.thread = threading.Thread(target=self._run, daemon=True)
+
+    def __enter__(self) -> _WorkerRssSampler:
+        if os.path.exists("/proc/self/stat"):
+            self.thread.start()
+        return self
+
+    def __exit__(self, *exc) -> None:
+        self.is_stopped.set()
+        if self.thread.is_alive():
+            self.thread.join()
+
+    def _run(self) -> None:
+        while True:
+            total = 0.0
+            for pid in _get_descendants(os.getpid()):
+                status = _read_status_mb(str(pid), ["VmRSS", "VmHWM"])
+                if status is not None:
+                    total += status[0]
+                    self.peak_rss_mb = max(self.peak_rss_mb, status[1])
+            self.total_rss_mb = max(self.total_rss_mb, total)
+
+            if self.is_stopped.wait(self.interval):
+                return
+
+
+def write_synthetic_athena(path: str, codes: List[str]) -> None:
+    """Write a minimal Athena download for the synthetic codes, with a parent concept for every group of codes."""
+    os.makedirs(path)
+
+    concepts = []
+    ancestors = []
+    for i, code in enumerate(codes):
+        vocabulary, concept_code = code.split("/", 1)
+        concepts.append((i, code, vocabulary, concept_code))
+
+        parent_id = len(codes) + i // _CODES_PER_PARENT
+        ancestors.append((parent_id, i))
+        if i % _CODES_PER_PARENT == 0:
+            concepts.append((parent_id, f"Group of {code}", "SyntheticGroup", str(i // _CODES_PER_PARENT)))
+
+    with open(os.path.join(path, "CONCEPT.csv"), "w") as f:
+        f.write("concept_id\tconcept_name\tvocabulary_id\tstandard_concept\tconcept_code\n")
+        for concept_id, name, vocabulary, concept_code in concepts:
+            f.write(f"{concept_id}\t{name}\t{vocabulary}\tS\t{concept_code}\n")
+
+    with open(os.path.join(path, "CONCEPT_RELATIONSHIP.csv"), "w") as f:
+        f.write("concept_id_1\tconcept_id_2\trelationship_id\n")
+
+    with open(os.path.join(path, "CONCEPT_ANCESTOR.csv"), "w") as f:
+        f.write("ancestor_concept_id\tdescendant_concept_id\tmin_levels_of_separation\tmax_levels_of_separation\n")
+        for ancestor_id, descendant_id in ancestors:
+            f.write(f"{ancestor_id}\t{descendant_id}\t1\t1\n")
+
+
+def _get_num_measurements(data_path: str) -> int:
+    total = 0
+    for file_name in sorted(os.listdir(data_path)):
+        events = pq.read_table(os.path.join(data_path, file_name), columns=["events"]).column("events")
+        measurements = pc.struct_field(pc.list_flatten(events), "measurements")
+        total += pc.sum(pc.list_value_length(measurements)).as_py() or 0
+    return total
+
+
+def _get_num_batch_tokens(batches: datasets.Dataset) -> int:
+    transformer = batches.data.column("transformer").combine_chunks()
+    return pc.sum(pc.list_value_length(pc.struct_field(transformer, "timestamps"))).as_py() or 0
+
+
+def run_benchmark(args: argparse.Namespace) -> Dict[str, Any]:
+    """Run the requested stages, returning the measurements of every stage."""
+    dataset_path = args.dataset
+    if dataset_path is None:
+        dataset_path = os.path.join(args.work_dir, f"synthetic_{args.num_patients}")
+        if not os.path.exists(dataset_path):
+            femr.synthetic_data.generate_dataset(
+                dataset_path,
+                femr.synthetic_data.get_default_codes(args.num_codes),
+                args.num_patients,
+                max(1, args.num_patients // 100_000),
+                femr.synthetic_data.SyntheticDataConfig(seed=args.seed),
+                num_proc=args.num_proc,
+            )
+
+    athena_path = args.athena
+    if athena_path is None:
+        athena_path = os.path.join(args.work_dir, f"athena_{args.num_codes}")
+        if not os.path.exists(athena_path):
+            write_synthetic_athena(athena_path, femr.synthetic_data.get_default_codes(args.num_codes))
+
+    data_path = os.path.join(dataset_path, "data")
+    dataset = datasets.Dataset.from_parquet(os.path.join(data_path, "*"))
+    num_patients = len(dataset)
+    num_measurements = _get_num_measurements(data_path)
+
+    state: Dict[str, Any] = {}
+
+    # from_generator reuses batches that are in its cache from an earlier run with the same inputs
+    convert_cache = tempfile.TemporaryDirectory(prefix="convert_cache_", dir=args.work_dir)
+
+    def run_index():
+        state["index"] = femr.index.PatientIndex(dataset, num_proc=args.num_proc)
+        return {"patients": num_patients}
+
+    def run_split():
+        state["split"] = femr.splits.generate_hash_split(list(state["index"].get_patient_ids()), 97, frac_test=0.15)
+        return {"patients": num_patients}
+
+    def run_ontology():
+        ontology = femr.ontology.Ontology(athena_path)
+        ontology.prune_to_dataset(dataset, num_proc=args.num_proc)
+        state["ontology"] = ontology
+        return {"patients": num_patients, "tokens": num_measurements}
+
+    def run_labeler():
+        codes = femr.synthetic_data.get_default_codes(args.num_codes)
+        labeler = femr.labelers.core.NLabelsPerPatientLabeler(
+            femr.labelers.omop.CodeLabeler(
+                outcome_codes=codes[: len(codes) // 10],
+                time_horizon=femr.labelers.core.TimeHorizon(datetime.timedelta(days=0), datetime.timedelta(days=365)),
+            ),
+            num_labels=1,
+            seed=args.seed,
+        )
+        state["labels"] = labeler.apply(dataset, num_proc=args.num_proc)
+        return {"patients": num_patients, "labels": len(state["labels"])}
+
+    def run_featurizer():
+        featurizers = femr.featurizers.FeaturizerList(
+            [femr.featurizers.AgeFeaturizer(is_normalize=True), femr.featurizers.CountFeaturizer()]
+        )
+        featurizers.preprocess_featurizers(dataset, state["index"], state["labels"], num_proc=args.num_proc)
+        featurizers.featurize(dataset, state["index"], state["labels"], num_proc=args.num_proc)
+        return {"patients": len({label["patient_id"] for label in state["labels"]}), "labels": len(state["labels"])}
+
+    def run_tokenizer():
+        state["tokenizer"] = femr.models.tokenizer.train_tokenizer(
+            dataset, vocab_size=args.vocab_size, num_proc=args.num_proc
+        )
+        return {"patients": num_patients, "tokens": num_measurements}
+
+    def run_convert():
+        processor = femr.models.processor.FEMRBatchProcessor(
+            state["tokenizer"], femr.models.tasks.CLMBRTask(clmbr_vocab_size=64)
+        )
+        batches = processor.convert_dataset(
+            dataset, tokens_per_batch=args.tokens_per_batch, num_proc=args.num_proc, cache_dir=convert_cache.name
+        )
+        num_tokens = _get_num_batch_tokens(batches)
+        batches.set_format("pt")
+        state["processor"] = processor
+        state["batches"] = batches
+        return {"patients": num_patients, "tokens": num_tokens}
+
+    def run_model():
+        tokenizer = state["tokenizer"]
+        task = femr.models.tasks.CLMBRTask(clmbr_vocab_size=64)
+        transformer_config = femr.models.transformer.FEMRTransformerConfig(
+            vocab_size=tokenizer.vocab_size,
+            is_hierarchical=tokenizer.is_hierarchical,
+            n_layers=args.n_layers,
+            hidden_size=args.hidden_size,
+            intermediate_size=args.hidden_size * 2,
+            n_heads=max(1, args.hidden_size // 64),
+        )
+        config = femr.models.transformer.FEMRModelConfig.from_transformer_task_configs(
+            transformer_config, task.get_task_config()
+        )
+        model = femr.models.transformer.FEMRModel(config)
+        optimizer = torch.optim.AdamW(model.parameters(), lr=1e-4)
+
+        batches = state["batches"]
+        num_steps = min(args.train_steps, len(batches))
+        num_tokens = 0
+        num_step_patients = 0
+        for i in range(num_steps):
+            batch = state["processor"].collate([batches[i]])
+            num_tokens += int(batch["batch"]["transformer"]["valid_tokens"].sum())
+            num_step_patients += int(batch["batch"]["num_patients"])
+
+            optimizer.zero_grad()
+            loss, _ = model(**batch)
+            loss.backward()
+            optimizer.step()
+
+        model_path = os.path.join(args.work_dir, "model")
+        model.save_pretrained(model_path)
+        tokenizer.save_pretrained(model_path)
+        state["model_path"] = model_path
+        return {"patients": num_step_patients, "tokens": num_tokens}
+
+    def run_features():
+        features = femr.models.transformer.compute_features(
+            dataset,
+            state["model_path"],
+            state["labels"],
+            num_proc=args.num_proc,
+            tokens_per_batch=args.tokens_per_batch,
+        )
+        return {"patients": len(set(features["patient_ids"])), "labels": len(features["patient_ids"])}
+
+    stage_functions: Dict[str, Callable[[], Dict[str, int]]] = {
+        "index": run_index,
+        "split": run_split,
+        "ontology": run_ontology,
+        "labeler": run_labeler,
+        "featurizer": run_featurizer,
+        "tokenizer": run_tokenizer,
+        "convert": run_convert,
+        "model": run_model,
+        "features": run_features,
+    }
+
+    # Stages are always run in pipeline order, and the dependencies of requested stages are run without being recorded
+    dependencies = {
+        "split": {"index"},
+        "featurizer": {"index", "labeler"},
+        "convert": {"tokenizer"},
+        "model": {"tokenizer", "convert"},
+        "features": {"labeler", "tokenizer", "convert", "model"},
+    }
+    needed = set(args.stages)
+    for stage in args.stages:
+        needed |= dependencies.get(stage, set())
+
+    results = {}
+    with convert_cache:
+        for stage in STAGES:
+            if stage not in needed:
+                continue
+
+            _reset_peak_rss()
+            with _WorkerRssSampler() as workers:
+                start = time.perf_counter()
+                counts = stage_functions[stage]()
+                elapsed = time.perf_counter() - start
+
+            if stage not in args.stages:
+                continue
+
+            result = {
+                "wall_time_s": elapsed,
+                "peak_rss_mb": _get_peak_rss_mb(),
+                "workers_peak_rss_mb": workers.peak_rss_mb,
+                "workers_total_rss_mb": workers.total_rss_mb,
+            }
+            for name, count in counts.items():
+                result[name] = count
+                result[name + "_per_s"] = count / elapsed
+            results[stage] = result
+            print(f"{stage}: {elapsed:.2f}s", file=sys.stderr)
+
+        state.clear()
+
+    return {
+        "config": {
+            "dataset": args.dataset,
+            "num_patients": num_patients,
+            "num_measurements": num_measurements,
+            "num_proc": args.num_proc,
+            "num_codes": args.num_codes,
+            "seed": args.seed,
+            "vocab_size": args.vocab_size,
+            "tokens_per_batch": args.tokens_per_batch,
+            "train_steps": args.train_steps,
+            "n_layers": args.n_layers,
+            "hidden_size": args.hidden_size,
+        },
+        "stages": results,
+    }
+
+
+def compare_to_baseline(results: Dict[str, Any], baseline: Dict[str, Any], tolerance: float) -> List[str]:
+    """Find the regressions of the results relative to a baseline.
+
+    Arguments:
+        results: The output of run_benchmark
+        baseline: The output of an earlier run_benchmark
+        tolerance: The allowed relative change, such as 0.2 for 20%
+
+    Returns:
+        A description of every regression
+    """
+    regressions = []
+    for stage, result in results["stages"].items():
+        if stage not in baseline["stages"]:
+            continue
+        previous = baseline["stages"][stage]
+
+        is_timed = max(result["wall_time_s"], previous["wall_time_s"]) >= _MIN_COMPARED_SECONDS
+        for name, value in result.items():
+            if name not in previous or previous[name] == 0:
+                continue
+            change = value / previous[name] - 1
+
+            if name in ("wall_time_s", "peak_rss_mb", "workers_peak_rss_mb", "workers_total_rss_mb"):
+                is_regression = change > tolerance and (is_timed or name != "wall_time_s")
+            elif name.endswith("_per_s"):
+                is_regression = change < -tolerance and is_timed
+            else:
+                continue
+
+            if is_regression:
+                regressions.append(f"{stage} {name}: {previous[name]:.2f} -> {value:.2f} ({change:+.0%})")
+    return regressions
+
+
+def print_results(results: Dict[str, Any], baseline: Dict[str, Any] | None) -> None:
+    header = ("stage", "seconds", "patients/s", "tokens/s", "labels/s")
+    header += ("peak MB", "worker MB", "workers MB", "vs baseline")
+    print("{:<11} {:>9} {:>12} {:>12} {:>10} {:>9} {:>10} {:>11} {:>12}".format(*header))
+    for stage, result in results["stages"].items():
+        relative = ""
+        if baseline is not None and stage in baseline["stages"]:
+            relative = "{:.2f}x".format(baseline["stages"][stage]["wall_time_s"] / result["wall_time_s"])
+        print(
+            "{:<11} {:>9.2f} {:>12.1f} {:>12} {:>10} {:>9.0f} {:>10.0f} {:>11.0f} {:>12}".format(
+                stage,
+                result["wall_time_s"],
+                result["patients_per_s"],
+                "{:.0f}".format(result["tokens_per_s"]) if "tokens_per_s" in result else "",
+                "{:.1f}".format(result["labels_per_s"]) if "labels_per_s" in result else "",
+                result["peak_rss_mb"],
+                result["workers_peak_rss_mb"],
+                result["workers_total_rss_mb"],
+                relative,
+            )
+        )
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Benchmark the main FEMR stages on synthetic data")
+    parser.add_argument("work_dir", type=str, help="Where to store the generated data and model, reused across runs")
+    parser.add_argument("--stages", type=str, nargs="+", default=STAGES, choices=STAGES, help="The stages to run")
+    parser.add_argument("--num_patients", type=int, default=10_000, help="The number of synthetic patients")
+    parser.add_argument("--num_codes", type=int, default=10_000, help="The number of synthetic codes")
+    parser.add_argument("--seed", type=int, default=0, help="The seed of the synthetic data and labels")
+    parser.add_argument("--dataset", type=str, default=None, help="Benchmark an existing MEDS dataset instead")
+    parser.add_argument(
+        "--athena",
+        type=str,
+        default=None,
+        help="An Athena download for the ontology stage, by default a synthetic one matching the synthetic codes",
+    )
+    parser.add_argument("--num_proc", type=int, default=1, help="The number of processes to use")
+    parser.add_argument("--vocab_size", type=int, default=2048, help="The vocabulary size of the tokenizer")
+    parser.add_argument("--tokens_per_batch", type=int, default=1024, help="The number of tokens per batch")
+    parser.add_argument("--train_steps", type=int, default=10, help="The number of forward and backward steps")
+    parser.add_argument("--n_layers", type=int, default=2, help="The number of transformer layers")
+    parser.add_argument("--hidden_size", type=int, default=128, help="The transformer hidden size")
+    parser.add_argument("--output", type=str, default=None, help="Where to write the results as json")
+    parser.add_argument("--baseline", type=str, default=None, help="Results of an earlier run to compare against")
+    parser.add_argument("--tolerance", type=float, default=0.2, help="The relative change flagged as a regression")
+
+    args = parser.parse_args()
+
+    os.makedirs(args.work_dir, exist_ok=True)
+
+    results = run_benchmark(args)
+
+    baseline = None
+    if args.baseline is not None:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        if baseline["config"] != results["config"]:
+            print("Warning: the baseline was run with a different configuration", file=sys.stderr)
+
+    print_results(results, baseline)
+
+    if args.output is not None:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=4)
+
+    if baseline is not None:
+        regressions = compare_to_baseline(results, baseline, args.tolerance)
+        for regression in regressions:
+            print("Regression:", regression)
+        if regressions:
+            sys.exit(1)
@@ -1,3 +1,8 @@
+"""Create a small synthetic dataset for the tutorials.
+
+For large datasets to load test femr pipelines, use femr_generate_synthetic_data instead.
+"""
+
 import argparse
 import datetime
 import json